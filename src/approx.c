@@ -0,0 +1,262 @@
+/*
+ * File:    approx.c
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "approx.h"
+
+static inline uint64_t getHeapValue(const struct t_summary *summary, uint32_t pos)
+{
+    return getSummaryValue(summary, &(summary->entries[summary->heap[pos]]));
+}
+
+static inline void swapHeap(struct t_summary *summary, uint32_t a, uint32_t b)
+{
+    uint32_t tmp = summary->heap[a];
+    summary->heap[a] = summary->heap[b];
+    summary->heap[b] = tmp;
+    summary->entries[summary->heap[a]].heap = a;
+    summary->entries[summary->heap[b]].heap = b;
+}
+
+/* Move a grown counter towards the leaves */
+static void siftDownSummary(struct t_summary *summary, uint32_t pos)
+{
+    for (;;)
+    {
+        uint32_t child = 2 * pos + 1;
+        if (child >= summary->count)
+            break;
+        if (child + 1 < summary->count && getHeapValue(summary, child + 1) < getHeapValue(summary, child))
+            child++;
+        if (getHeapValue(summary, child) >= getHeapValue(summary, pos))
+            break;
+        swapHeap(summary, pos, child);
+        pos = child;
+    }
+}
+
+static void siftUpSummary(struct t_summary *summary, uint32_t pos)
+{
+    while (pos > 0 && getHeapValue(summary, (pos - 1) / 2) > getHeapValue(summary, pos))
+    {
+        swapHeap(summary, pos, (pos - 1) / 2);
+        pos = (pos - 1) / 2;
+    }
+}
+
+/* Index slot of the key, or the empty slot the key belongs to */
+static uint32_t findSummarySlot(const struct t_summary *summary, const struct t_tupleKey *key, uint64_t hash)
+{
+    uint32_t pos = (uint32_t) hash & summary->indexMask;
+    while (summary->index[pos] != 0 && !equalsTuple(&(summary->entries[summary->index[pos] - 1].key), key))
+    {
+        pos = (pos + 1) & summary->indexMask;
+    }
+    return pos;
+}
+
+/* Empty an index slot, following keys are shifted back so no probe sequence breaks */
+static void removeSummarySlot(struct t_summary *summary, uint32_t pos)
+{
+    uint32_t mask = summary->indexMask;
+    uint32_t next = (pos + 1) & mask;
+
+    summary->index[pos] = 0;
+    while (summary->index[next] != 0)
+    {
+        const struct t_tupleKey *key = &(summary->entries[summary->index[next] - 1].key);
+        uint32_t home = (uint32_t) hashSummaryKey(summary, key) & mask;
+        if (((next - home) & mask) >= ((next - pos) & mask))
+        {
+            summary->index[pos] = summary->index[next];
+            summary->index[next] = 0;
+            pos = next;
+        }
+        next = (next + 1) & mask;
+    }
+}
+
+struct t_summary *initSummary(uint32_t capacity, char bytes, char tuples)
+{
+    struct t_summary *summary = malloc(sizeof (struct t_summary));
+    if (summary == NULL)
+        return NULL;
+
+    /* Index is kept at most half full */
+    uint32_t size = EN_TABLE_GROUP;
+    while (size < capacity * 2)
+    {
+        size *= 2;
+    }
+
+    summary->capacity = capacity;
+    summary->count = 0;
+    summary->bytes = bytes;
+    summary->tuples = tuples;
+    summary->entries = malloc(capacity * sizeof (struct t_summaryEntry));
+    summary->heap = malloc(capacity * sizeof (uint32_t));
+    summary->index = calloc(size, sizeof (uint32_t));
+    summary->indexMask = size - 1;
+
+    if (summary->entries == NULL || summary->heap == NULL || summary->index == NULL)
+    {
+        finishSummary(summary);
+        return NULL;
+    }
+    return summary;
+}
+
+void finishSummary(struct t_summary *summary)
+{
+    if (summary == NULL)
+        return;
+
+    free(summary->entries);
+    free(summary->heap);
+    free(summary->index);
+    free(summary);
+}
+
+void addSummary(struct t_summary *summary, const struct t_tupleKey *key, uint64_t hash, uint64_t packets, uint64_t bytes)
+{
+    struct t_summaryEntry *entry;
+    uint32_t pos = findSummarySlot(summary, key, hash);
+
+    /* Tracked key */
+    if (summary->index[pos] != 0)
+    {
+        entry = &(summary->entries[summary->index[pos] - 1]);
+        entry->packets += packets;
+        entry->bytes += bytes;
+        siftDownSummary(summary, entry->heap);
+        return;
+    }
+
+    /* Free counter */
+    if (summary->count < summary->capacity)
+    {
+        uint32_t n = summary->count++;
+        entry = &(summary->entries[n]);
+        entry->key = *key;
+        entry->packets = packets;
+        entry->bytes = bytes;
+        entry->error = 0;
+        entry->heap = n;
+        summary->heap[n] = n;
+        summary->index[pos] = n + 1;
+        siftUpSummary(summary, n);
+        return;
+    }
+
+    /* The smallest counter is taken over, its value becomes the error */
+    uint32_t n = summary->heap[0];
+    entry = &(summary->entries[n]);
+    uint64_t smallest = getSummaryValue(summary, entry);
+
+    removeSummarySlot(summary, findSummarySlot(summary, &(entry->key), hashSummaryKey(summary, &(entry->key))));
+    pos = findSummarySlot(summary, key, hash);
+
+    entry->key = *key;
+    entry->error = smallest;
+    entry->packets = packets + (summary->bytes ? 0 : smallest);
+    entry->bytes = bytes + (summary->bytes ? smallest : 0);
+    summary->index[pos] = n + 1;
+    siftDownSummary(summary, 0);
+}
+
+/* Order of merged entries, the largest weighted counter first */
+static int compareSummaryEntries(const void *a, const void *b, void *data)
+{
+    const struct t_summary *summary = data;
+    uint64_t valueA = getSummaryValue(summary, a);
+    uint64_t valueB = getSummaryValue(summary, b);
+
+    if (valueA != valueB)
+        return valueA > valueB ? -1 : 1;
+    return memcmp(&(((const struct t_summaryEntry *) a)->key), &(((const struct t_summaryEntry *) b)->key), sizeof (struct t_tupleKey));
+}
+
+/* Add a bound of a key missing in a full summary, it could have had its smallest counter */
+static inline void addSummaryBound(const struct t_summary *summary, struct t_summaryEntry *entry, uint64_t smallest)
+{
+    if (summary->bytes)
+        entry->bytes += smallest;
+    else
+        entry->packets += smallest;
+    entry->error += smallest;
+}
+
+int mergeSummary(struct t_summary *result, struct t_summary *source)
+{
+    uint64_t smallestResult = 0;
+    uint64_t smallestSource = 0;
+    uint32_t i, n = 0;
+
+    if (result->count == result->capacity && result->count > 0)
+        smallestResult = getHeapValue(result, 0);
+    if (source->count == source->capacity && source->count > 0)
+        smallestSource = getHeapValue(source, 0);
+
+    struct t_summaryEntry *merged = malloc((result->count + source->count + 1) * sizeof (struct t_summaryEntry));
+    if (merged == NULL)
+        return 1;
+
+    /* Counters of both summaries are added, the best ones are kept */
+    for (i = 0; i < result->count; i++)
+    {
+        struct t_summaryEntry *entry = &(result->entries[i]);
+        uint32_t pos = findSummarySlot(source, &(entry->key), hashSummaryKey(source, &(entry->key)));
+
+        merged[n] = *entry;
+        if (source->index[pos] != 0)
+        {
+            struct t_summaryEntry *other = &(source->entries[source->index[pos] - 1]);
+            merged[n].packets += other->packets;
+            merged[n].bytes += other->bytes;
+            merged[n].error += other->error;
+        }
+        else
+            addSummaryBound(source, &merged[n], smallestSource);
+        n++;
+    }
+    for (i = 0; i < source->count; i++)
+    {
+        struct t_summaryEntry *entry = &(source->entries[i]);
+        uint32_t pos = findSummarySlot(result, &(entry->key), hashSummaryKey(result, &(entry->key)));
+        if (result->index[pos] != 0)
+            continue;
+
+        merged[n] = *entry;
+        addSummaryBound(result, &merged[n], smallestResult);
+        n++;
+    }
+
+    qsort_r(merged, n, sizeof (struct t_summaryEntry), compareSummaryEntries, result);
+    if (n > result->capacity)
+        n = result->capacity;
+
+    /* Rebuild the index and the heap of the kept entries */
+    memset(result->index, 0, (result->indexMask + 1) * sizeof (uint32_t));
+    memcpy(result->entries, merged, n * sizeof (struct t_summaryEntry));
+    result->count = n;
+    for (i = 0; i < n; i++)
+    {
+        struct t_summaryEntry *entry = &(result->entries[i]);
+        result->index[findSummarySlot(result, &(entry->key), hashSummaryKey(result, &(entry->key)))] = i + 1;
+        result->heap[i] = i;
+        entry->heap = i;
+    }
+    for (i = n / 2; i > 0; i--)
+    {
+        siftDownSummary(result, i - 1);
+    }
+
+    free(merged);
+    return 0;
+}
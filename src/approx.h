@@ -0,0 +1,67 @@
+/*
+ * File:    approx.h
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#ifndef APPROX_H
+#define	APPROX_H
+
+#include <stdint.h>
+#include "table.h"
+
+/*
+ * Approximate aggregation in a fixed amount of memory by the weighted
+ * Space-Saving algorithm. At most a given number of keys is tracked; a new
+ * key replaces the key of the smallest counter and inherits its value as
+ * the error. The counter of the sort key is never below the true value and
+ * exceeds it by the error at most, every key whose true value is above the
+ * smallest counter is tracked. The other counter is counted only since the
+ * key is tracked, so it is a lower bound.
+ */
+
+/* Tracked key with its counters */
+struct t_summaryEntry
+{
+    struct t_tupleKey key; //addresses in src unless the keys are composite
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t error; //maximal overestimate of the weighted counter
+    uint32_t heap; //position in the heap
+};
+
+struct t_summary
+{
+    uint32_t capacity; //maximal number of tracked keys
+    uint32_t count;
+    char bytes; //weighted by bytes, otherwise by packets
+    char tuples; //keys are composite
+    struct t_summaryEntry *entries;
+    uint32_t *heap; //entry numbers, smallest weighted counter first
+    uint32_t *index; //entry number + 1 by the key hash, zero for an empty slot
+    uint32_t indexMask;
+};
+
+/* Prototypes */
+struct t_summary *initSummary(uint32_t capacity, char bytes, char tuples);
+void finishSummary(struct t_summary *summary);
+void addSummary(struct t_summary *summary, const struct t_tupleKey *key, uint64_t hash, uint64_t packets, uint64_t bytes);
+int mergeSummary(struct t_summary *result, struct t_summary *source);
+
+/* Counter the summary is kept by */
+static inline uint64_t getSummaryValue(const struct t_summary *summary, const struct t_summaryEntry *entry)
+{
+    return summary->bytes ? entry->bytes : entry->packets;
+}
+
+/* Hash of a key, the same as of the exact tables */
+static inline uint64_t hashSummaryKey(const struct t_summary *summary, const struct t_tupleKey *key)
+{
+    if (summary->tuples)
+        return hashTuple(key);
+    if (key->family == 4)
+        return hashIP4(&(key->src.s6_addr32[3]));
+    return hashIP6(&(key->src));
+}
+
+#endif /* APPROX_H */
@@ -0,0 +1,147 @@
+/*
+ * File:    arena.c
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+struct t_region
+{
+    void *ptr;
+    size_t size; //mapped size, a multiple of huge pages
+};
+
+/* Regions released for reuse, shared by all threads */
+static struct t_region cached[EN_ARENA_CACHE];
+static int ncached = 0;
+static pthread_mutex_t arenaLock = PTHREAD_MUTEX_INITIALIZER;
+static char hugeTLB = 0;
+
+void setArenaHugePages(char explicit)
+{
+    hugeTLB = explicit;
+}
+
+static inline size_t getRegionSize(size_t size)
+{
+    return (size + EN_ARENA_PAGE - 1) & ~((size_t) EN_ARENA_PAGE - 1);
+}
+
+/* Fresh zero-filled region aligned to a huge page */
+static void *mapRegion(size_t size)
+{
+    void *ptr;
+    if (hugeTLB)
+    {
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+#ifdef MAP_HUGE_2MB
+        flags |= MAP_HUGE_2MB;
+#endif
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (ptr != MAP_FAILED)
+            return ptr;
+    }
+
+    /* The mapping is larger by a page, so an aligned region can be cut out of it */
+    char *map = mmap(NULL, size + EN_ARENA_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    size_t lead = (EN_ARENA_PAGE - ((uintptr_t) map & (EN_ARENA_PAGE - 1))) & (EN_ARENA_PAGE - 1);
+    if (lead > 0)
+        munmap(map, lead);
+    munmap(map + lead + size, EN_ARENA_PAGE - lead);
+
+    madvise(map + lead, size, MADV_HUGEPAGE);
+    return map + lead;
+}
+
+/* Smallest cached region of at least given size, NULL if there is none */
+static void *takeRegion(size_t size, size_t *taken)
+{
+    int best = -1;
+    int i;
+
+    pthread_mutex_lock(&arenaLock);
+    for (i = 0; i < ncached; i++)
+    {
+        if (cached[i].size >= size && (best < 0 || cached[i].size < cached[best].size))
+            best = i;
+    }
+
+    void *ptr = NULL;
+    if (best >= 0)
+    {
+        ptr = cached[best].ptr;
+        *taken = cached[best].size;
+        cached[best] = cached[--ncached];
+    }
+    pthread_mutex_unlock(&arenaLock);
+    return ptr;
+}
+
+void *allocArena(size_t size, char zeroed)
+{
+    if (size < EN_ARENA_PAGE)
+        return zeroed ? calloc(1, size) : malloc(size);
+
+    size = getRegionSize(size);
+    size_t taken;
+    void *ptr = takeRegion(size, &taken);
+    if (ptr == NULL)
+        return mapRegion(size);
+
+    /* The tail of a larger region is of no use to the array, it is returned to the system */
+    if (taken > size)
+        munmap((char *) ptr + size, taken - size);
+    return ptr;
+}
+
+void freeArena(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+        return;
+    if (size < EN_ARENA_PAGE)
+    {
+        free(ptr);
+        return;
+    }
+
+    /* Pages of a cached region are dropped, older kernels cannot drop huge pages and it is unmapped */
+    size = getRegionSize(size);
+    if (madvise(ptr, size, MADV_DONTNEED) != 0)
+    {
+        munmap(ptr, size);
+        return;
+    }
+
+    pthread_mutex_lock(&arenaLock);
+    if (ncached < EN_ARENA_CACHE)
+    {
+        cached[ncached].ptr = ptr;
+        cached[ncached++].size = size;
+        ptr = NULL;
+    }
+    pthread_mutex_unlock(&arenaLock);
+
+    if (ptr != NULL)
+        munmap(ptr, size);
+}
+
+/* Unmap all cached regions */
+void releaseArena(void)
+{
+    pthread_mutex_lock(&arenaLock);
+    while (ncached > 0)
+    {
+        ncached--;
+        munmap(cached[ncached].ptr, cached[ncached].size);
+    }
+    pthread_mutex_unlock(&arenaLock);
+}
@@ -0,0 +1,38 @@
+/*
+ * File:    arena.h
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#ifndef ARENA_H
+#define	ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Memory of large table arrays. Arrays of at least one huge page are mapped
+ * directly, aligned to huge pages and advised to be backed by transparent
+ * huge pages, so random probes of large tables miss the TLB much less.
+ * Explicit huge pages (MAP_HUGETLB) are used when requested and reserved
+ * by the system, ordinary pages otherwise. Fresh mappings are zero-filled,
+ * so tags need no clearing loop and pages are touched only when used.
+ *
+ * Released regions are kept for reuse by later arrays instead of being
+ * unmapped. Their pages are dropped by madvise as they are released, so a
+ * cached region takes no memory and is zero-filled again when reused.
+ * Smaller arrays come from malloc.
+ */
+
+/* Size of a huge page, the unit of mapped regions */
+#define EN_ARENA_PAGE (2 * 1024 * 1024)
+
+/* Released regions kept for reuse */
+#define EN_ARENA_CACHE 16
+
+/* Prototypes */
+void setArenaHugePages(char explicit);
+void *allocArena(size_t size, char zeroed);
+void freeArena(void *ptr, size_t size);
+void releaseArena(void);
+
+#endif /* ARENA_H */
@@ -0,0 +1,70 @@
+#!/bin/sh
+#
+# File:    bench.sh
+# Author:  Martin Simon <martiinsiimon@gmail.com>
+# License: See the LICENSE file
+#
+# Benchmark of the aggregation over generated data sets. Every aggregation
+# key is run with every sort key for the top entries, and once with the
+# full output, which measures the sort and the writer of whole reports. The
+# throughput with the times of the phases reported by --stats is printed.
+#
+# Environment:
+#   BENCH_DIR      directory of the generated data (default /tmp/flow-bench)
+#   BENCH_RECORDS  records of every data set (default 2000000)
+#   BENCH_THREADS  threads of the aggregation (default all processors)
+#
+
+BIN=$(cd "$(dirname "$0")/../bin" && pwd) || exit 1
+DIR=${BENCH_DIR:-/tmp/flow-bench}
+RECORDS=${BENCH_RECORDS:-2000000}
+THREADS=${BENCH_THREADS:-$(nproc)}
+
+AGGKEYS="srcip dstip4/24 srcip6/64 dstport srcip+dstport"
+# sort key and the number of entries printed, all for the full report
+RUNS="packets:10 bytes:10 packets:all"
+
+# name and parameters of the generator of every data set
+DATASETS="uniform:-k_1000000 zipf:-k_1000000_-z_1.1_-6_25"
+
+mkdir -p "$DIR" || exit 1
+
+for set in $DATASETS; do
+    name=${set%%:*}
+    if [ ! -f "$DIR/$name/data" ]; then
+        mkdir -p "$DIR/$name" || exit 1
+        $BIN/flowgen -o "$DIR/$name/data" -n "$RECORDS" $(echo "${set#*:}" | tr _ ' ') || exit 1
+    fi
+done
+
+printf "%-8s %-14s %-8s %5s %9s %11s %9s %9s %9s %9s %9s %9s %9s\n" \
+    data aggkey sortkey top wall records/s MB/s walk aggregate merge rollup sort print
+
+for set in $DATASETS; do
+    name=${set%%:*}
+    size=$(stat -c %s "$DIR/$name/data")
+    for aggkey in $AGGKEYS; do
+        for run in $RUNS; do
+            sortkey=${run%%:*}
+            top=${run#*:}
+            limit=""
+            [ "$top" != all ] && limit="-n $top"
+            start=$(date +%s.%N)
+            $BIN/flow -f "$DIR/$name" -a "$aggkey" -s "$sortkey" -j "$THREADS" $limit -t \
+                2> "$DIR/stats" > /dev/null || { cat "$DIR/stats"; exit 1; }
+            end=$(date +%s.%N)
+            awk -v data="$name" -v aggkey="$aggkey" -v sortkey="$sortkey" -v top="$top" \
+                -v wall="$(echo "$end $start" | awk '{ print $1 - $2 }')" \
+                -v size="$size" '
+                /^STAT: time\./ { sub(/^time\./, "", $2); t[$2] = $3 }
+                /^STAT: records / { records = $3 }
+                END {
+                    printf "%-8s %-14s %-8s %5s %9.3f %11.0f %9.1f %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+                        data, aggkey, sortkey, top, wall, records / wall, size / wall / 1048576,
+                        t["walk"], t["aggregate"], t["merge"], t["rollup"], t["sort"], t["print"]
+                }' "$DIR/stats"
+        done
+    done
+done
+
+rm -f "$DIR/stats"
@@ -0,0 +1,370 @@
+/*
+ * File:    cache.c
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "stats.h"
+
+static void printCacheWarning(char *file, char *msg)
+{
+    fprintf(stderr, "WARN: %s: %s\n", file, msg);
+}
+
+/* Header describing given input file and aggregation key, exported partials have no input file */
+static void fillPartialHeader(struct t_partialHeader *header, const struct t_inputFile *file, const struct t_report *report)
+{
+    /* Padding is zeroed too, so headers can be compared as a whole */
+    memset(header, 0, sizeof (struct t_partialHeader));
+    memcpy(header->magic, EN_PARTIAL_MAGIC, sizeof (header->magic));
+    header->version = EN_PARTIAL_VERSION;
+    header->aggkey = report->aggkey;
+    header->mask = report->mask;
+    header->spec = report->spec;
+    if (file != NULL)
+    {
+        header->size = file->size;
+        header->device = file->device;
+        header->inode = file->inode;
+        header->mtime = (int64_t) file->mtime.tv_sec * 1000000000 + file->mtime.tv_nsec;
+    }
+}
+
+char *getPartialFile(char *cache, const struct t_inputFile *file, const char *key)
+{
+    /* The same file reached by another relative path shares the partials */
+    char resolved[PATH_MAX];
+    const char *path = realpath(file->name, resolved) != NULL ? resolved : file->name;
+
+    /* Partial of srcip4/24 goes to cache/<hash>_srcip4_24.part */
+    char *partial = malloc(strlen(cache) + 1 + 16 + 1 + strlen(key) + 6);
+    int prefix = sprintf(partial, "%s/%016llx_", cache, (unsigned long long) hashString(path));
+    sprintf(partial + prefix, "%s.part", key);
+
+    char *p;
+    for (p = partial + prefix; *p != '\0'; p++)
+    {
+        if (*p == '/')
+            *p = '_';
+    }
+    return partial;
+}
+
+/* Add entries following a header read already, nothing is added from a damaged partial */
+static int loadPartialEntries(FILE *f, const struct t_partialHeader *header, struct t_aggregation *aggregation)
+{
+    /* Tables missing for entries of some kind mean a damaged partial */
+    if ((header->count4 != 0 && aggregation->ip4 == NULL) ||
+        (header->count6 != 0 && aggregation->ip6 == NULL) ||
+        (header->countTuple != 0 && aggregation->tuples == NULL) ||
+        (header->countPort != 0 && aggregation->ports == NULL) ||
+        header->countPort > EN_PORT_COUNT)
+        return 1;
+
+    /* Counts are bounded by the file and the tables first, so their sum cannot overflow */
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0 || (uint64_t) st.st_size < sizeof (struct t_partialHeader))
+        return 1;
+    uint64_t entries = (uint64_t) st.st_size - sizeof (struct t_partialHeader);
+    if (header->count4 > entries / EN_PARTIAL_IP4 || header->count4 > EN_TABLE_MAX ||
+        header->count6 > entries / EN_PARTIAL_IP6 || header->count6 > EN_TABLE_MAX ||
+        header->countTuple > entries / EN_PARTIAL_TUPLE || header->countTuple > EN_TABLE_MAX)
+        return 1;
+
+    /* The whole partial is read before anything is added, a short one is ignored */
+    uint64_t size = header->count4 * EN_PARTIAL_IP4 + header->count6 * EN_PARTIAL_IP6 +
+        header->countTuple * EN_PARTIAL_TUPLE + header->countPort * EN_PARTIAL_PORT;
+    if (size != entries)
+        return 1;
+
+    char *data = malloc(size + 1);
+    if (data == NULL || (size > 0 && fread(data, size, 1, f) != 1))
+    {
+        free(data);
+        return 1;
+    }
+
+    /* Entries come in the order of the slots of the stored tables, which have to fit at once */
+    if (header->count4 > 0)
+        reserveIP4Table(&(aggregation->ip4[0]), header->count4);
+    if (header->count6 > 0)
+        reserveIP6Table(&(aggregation->ip6[0]), header->count6);
+    if (header->countTuple > 0)
+        reserveTupleTable(&(aggregation->tuples[0]), header->countTuple);
+
+    uint64_t packets, bytes, i;
+    const char *p = data;
+    for (i = 0; i < header->count4; i++, p += EN_PARTIAL_IP4)
+    {
+        uint32_t key;
+        memcpy(&key, p, sizeof (key));
+        memcpy(&packets, p + 4, sizeof (packets));
+        memcpy(&bytes, p + 12, sizeof (bytes));
+        addIP4Table(&(aggregation->ip4[0]), &key, hashIP4(&key), packets, bytes);
+    }
+    for (i = 0; i < header->count6; i++, p += EN_PARTIAL_IP6)
+    {
+        struct in6_addr key;
+        memcpy(&key, p, sizeof (key));
+        memcpy(&packets, p + 16, sizeof (packets));
+        memcpy(&bytes, p + 24, sizeof (bytes));
+        addIP6Table(&(aggregation->ip6[0]), &key, hashIP6(&key), packets, bytes);
+    }
+    for (i = 0; i < header->countTuple; i++, p += EN_PARTIAL_TUPLE)
+    {
+        struct t_tupleKey key;
+        memcpy(&key, p, sizeof (key));
+        memcpy(&packets, p + sizeof (key), sizeof (packets));
+        memcpy(&bytes, p + sizeof (key) + 8, sizeof (bytes));
+        addTupleTable(&(aggregation->tuples[0]), &key, hashTuple(&key), packets, bytes);
+    }
+    for (i = 0; i < header->countPort; i++, p += EN_PARTIAL_PORT)
+    {
+        uint16_t value;
+        memcpy(&value, p, sizeof (value));
+        memcpy(&packets, p + 2, sizeof (packets));
+        memcpy(&bytes, p + 10, sizeof (bytes));
+        aggregation->ports->counters[value].packets += packets;
+        aggregation->ports->counters[value].bytes += bytes;
+        aggregation->ports->used[value / 64] |= (uint64_t) 1 << (value % 64);
+    }
+
+    free(data);
+    return 0;
+}
+
+int loadPartial(char *path, const struct t_inputFile *file, const struct t_report *report, struct t_aggregation *aggregation)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return 1;
+
+    /* Partial of another key or of an older version of the file is of no use */
+    struct t_partialHeader expected, header;
+    fillPartialHeader(&expected, file, report);
+    int result = 1;
+    if (fread(&header, sizeof (header), 1, f) == 1 &&
+        memcmp(&header, &expected, offsetof(struct t_partialHeader, count4)) == 0)
+        result = loadPartialEntries(f, &header, aggregation);
+
+    fclose(f);
+    return result;
+}
+
+int mergePartial(char *path, const struct t_report *reports, int nreports, struct t_aggregation *aggregations)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        fprintf(stderr, "ERR: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    struct t_partialHeader header;
+    if (fread(&header, sizeof (header), 1, f) != 1 ||
+        memcmp(header.magic, EN_PARTIAL_MAGIC, sizeof (header.magic)) != 0 || header.version != EN_PARTIAL_VERSION)
+    {
+        fprintf(stderr, "ERR: %s: Not a partial aggregate!\n", path);
+        fclose(f);
+        return 1;
+    }
+
+    /* Partial belongs to the report of the same key, whatever input it was aggregated from; keys of rollups are derived again */
+    int r;
+    for (r = 0; r < nreports; r++)
+    {
+        struct t_partialHeader expected;
+        fillPartialHeader(&expected, NULL, &reports[r]);
+        if (memcmp(&header, &expected, offsetof(struct t_partialHeader, size)) == 0)
+            break;
+    }
+    if (r == nreports)
+    {
+        printCacheWarning(path, "Partial aggregate of a key not read from the data, skipped!");
+        fclose(f);
+        return 0;
+    }
+
+    int result = loadPartialEntries(f, &header, &aggregations[r]);
+    if (result != 0)
+        fprintf(stderr, "ERR: %s: Damaged partial aggregate!\n", path);
+    fclose(f);
+    return result;
+}
+
+/* Write a header of given input file and all entries of an aggregation */
+static int writePartial(FILE *f, const struct t_inputFile *file, const struct t_report *report, struct t_aggregation *aggregation)
+{
+    struct t_partialHeader header;
+    fillPartialHeader(&header, file, report);
+
+    /* Entries are counted first, the header goes before them */
+    uint32_t p, i, w;
+    for (p = 0; aggregation->ip4 != NULL && p < aggregation->parts; p++)
+    {
+        header.count4 += aggregation->ip4[p].count;
+    }
+    for (p = 0; aggregation->ip6 != NULL && p < aggregation->parts; p++)
+    {
+        header.count6 += aggregation->ip6[p].count;
+    }
+    for (p = 0; aggregation->tuples != NULL && p < aggregation->parts; p++)
+    {
+        header.countTuple += aggregation->tuples[p].count;
+    }
+    for (w = 0; aggregation->ports != NULL && w < EN_PORT_COUNT / 64; w++)
+    {
+        header.countPort += __builtin_popcountll(aggregation->ports->used[w]);
+    }
+
+    int failed = fwrite(&header, sizeof (header), 1, f) != 1;
+    char entry[EN_PARTIAL_TUPLE];
+    for (p = 0; aggregation->ip4 != NULL && p < aggregation->parts; p++)
+    {
+        struct t_ip4Table *table = &(aggregation->ip4[p]);
+        for (i = 0; i < table->capacity; i++)
+        {
+            if (table->tags[i] != EN_TAG_EMPTY)
+            {
+                memcpy(entry, &(table->slots[i].key), 4);
+                memcpy(entry + 4, &(table->slots[i].packets), 8);
+                memcpy(entry + 12, &(table->slots[i].bytes), 8);
+                failed |= fwrite(entry, EN_PARTIAL_IP4, 1, f) != 1;
+            }
+        }
+    }
+    for (p = 0; aggregation->ip6 != NULL && p < aggregation->parts; p++)
+    {
+        struct t_ip6Table *table = &(aggregation->ip6[p]);
+        for (i = 0; i < table->capacity; i++)
+        {
+            if (table->tags[i] != EN_TAG_EMPTY)
+            {
+                memcpy(entry, &(table->slots[i].key), 16);
+                memcpy(entry + 16, &(table->slots[i].packets), 8);
+                memcpy(entry + 24, &(table->slots[i].bytes), 8);
+                failed |= fwrite(entry, EN_PARTIAL_IP6, 1, f) != 1;
+            }
+        }
+    }
+    for (p = 0; aggregation->tuples != NULL && p < aggregation->parts; p++)
+    {
+        struct t_tupleTable *table = &(aggregation->tuples[p]);
+        for (i = 0; i < table->capacity; i++)
+        {
+            if (table->tags[i] != EN_TAG_EMPTY)
+            {
+                memcpy(entry, &(table->slots[i].key), sizeof (struct t_tupleKey));
+                memcpy(entry + sizeof (struct t_tupleKey), &(table->slots[i].packets), 8);
+                memcpy(entry + sizeof (struct t_tupleKey) + 8, &(table->slots[i].bytes), 8);
+                failed |= fwrite(entry, EN_PARTIAL_TUPLE, 1, f) != 1;
+            }
+        }
+    }
+    for (w = 0; aggregation->ports != NULL && w < EN_PORT_COUNT / 64; w++)
+    {
+        uint64_t used = aggregation->ports->used[w];
+        while (used)
+        {
+            uint16_t value = w * 64 + __builtin_ctzll(used);
+            memcpy(entry, &value, 2);
+            memcpy(entry + 2, &(aggregation->ports->counters[value].packets), 8);
+            memcpy(entry + 10, &(aggregation->ports->counters[value].bytes), 8);
+            failed |= fwrite(entry, EN_PARTIAL_PORT, 1, f) != 1;
+            used &= used - 1;
+        }
+    }
+
+    return failed;
+}
+
+int storePartial(char *path, const struct t_inputFile *file, const struct t_report *report, struct t_aggregation *aggregation)
+{
+    /* Written under a temporary name and renamed, so readers never see a partial one */
+    char *tmpPath = malloc(strlen(path) + 32);
+    if (tmpPath == NULL)
+    {
+        printCacheWarning(path, "Unable to allocate file name!");
+        return 1;
+    }
+    sprintf(tmpPath, "%s.%ld.tmp", path, (long) getpid());
+    FILE *f = fopen(tmpPath, "wb");
+    if (f == NULL)
+    {
+        printCacheWarning(tmpPath, "Unable to create partial aggregate!");
+        free(tmpPath);
+        return 1;
+    }
+
+    int failed = writePartial(f, file, report, aggregation);
+    failed |= fclose(f) != 0;
+    if (failed || rename(tmpPath, path) != 0)
+    {
+        printCacheWarning(path, "Unable to store partial aggregate!");
+        unlink(tmpPath);
+        free(tmpPath);
+        return 1;
+    }
+
+    free(tmpPath);
+    return 0;
+}
+
+int exportPartial(struct t_report *report)
+{
+    /* Renamed over the previous partial, so a collector never ships one cut short */
+    FILE *f = stdout;
+    char *tmpFile = NULL;
+    if (report->file != NULL)
+    {
+        tmpFile = malloc(strlen(report->file) + 32);
+        if (tmpFile == NULL)
+        {
+            printError("Unable to allocate file name!");
+            return 1;
+        }
+        sprintf(tmpFile, "%s.%ld.tmp", report->file, (long) getpid());
+        if ((f = fopen(tmpFile, "wb")) == NULL)
+        {
+            fprintf(stderr, "ERR: %s: %s\n", tmpFile, strerror(errno));
+            free(tmpFile);
+            return 1;
+        }
+    }
+
+    double start = getStatsTime();
+    int failed = writePartial(f, NULL, report, &(report->aggregation));
+    if (report->file != NULL)
+    {
+        failed |= fclose(f) != 0;
+        if (failed || rename(tmpFile, report->file) != 0)
+        {
+            unlink(tmpFile);
+            failed = 1;
+        }
+        free(tmpFile);
+    }
+    else
+        failed |= fflush(f) != 0;
+    addPhaseTime(EN_PHASE_PRINT, start);
+    if (failed)
+    {
+        if (report->file != NULL)
+            fprintf(stderr, "ERR: %s: Writing of the partial aggregate failed!\n", report->file);
+        else
+            printError("Writing of the output failed!");
+    }
+    return failed;
+}
@@ -0,0 +1,69 @@
+/*
+ * File:    cache.h
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#ifndef CACHE_H
+#define	CACHE_H
+
+#include <stdint.h>
+#include "main.h"
+#include "reader.h"
+
+/*
+ * Cache of partial aggregates. The aggregate of every input file and
+ * aggregation key is stored in a file of the cache directory, named by the
+ * hash of the path of the input file and by the key. Its header holds the
+ * identity of the input file (size, device, inode and time of the last
+ * change). A following run loads the partial aggregate instead of reading
+ * the input file again, unless the file has changed since.
+ *
+ * The same format carries aggregates between hosts: a report exported as
+ * a partial aggregate has an empty identity and holds the unsorted keys
+ * of the whole aggregation. Partials of any number of hosts (or of the
+ * cache) are merged into the tables of the report of the same key, which
+ * is sorted as if the records were aggregated by a single run. Entries
+ * are in the byte order of the writer, a partial of another byte order
+ * is rejected by its version.
+ */
+
+#define EN_PARTIAL_MAGIC "FLOWPART"
+#define EN_PARTIAL_VERSION 1
+
+/* Sizes of stored entries: key followed by packets and bytes */
+#define EN_PARTIAL_IP4 (4 + 16)
+#define EN_PARTIAL_IP6 (16 + 16)
+#define EN_PARTIAL_TUPLE (sizeof (struct t_tupleKey) + 16)
+#define EN_PARTIAL_PORT (2 + 16)
+
+/* Header of a partial aggregate, followed by the entries */
+struct t_partialHeader
+{
+    char magic[8];
+    uint32_t version;
+    int32_t aggkey;
+    int32_t mask;
+    struct t_tupleSpec spec;
+
+    /* Identity of the input file */
+    uint64_t size;
+    uint64_t device;
+    uint64_t inode;
+    int64_t mtime; //nanoseconds
+
+    /* Number of entries of every kind, in this order */
+    uint64_t count4;
+    uint64_t count6;
+    uint64_t countTuple;
+    uint64_t countPort;
+};
+
+/* Prototypes */
+char *getPartialFile(char *cache, const struct t_inputFile *file, const char *key);
+int loadPartial(char *path, const struct t_inputFile *file, const struct t_report *report, struct t_aggregation *aggregation);
+int storePartial(char *path, const struct t_inputFile *file, const struct t_report *report, struct t_aggregation *aggregation);
+int exportPartial(struct t_report *report);
+int mergePartial(char *path, const struct t_report *reports, int nreports, struct t_aggregation *aggregations);
+
+#endif /* CACHE_H */
@@ -0,0 +1,232 @@
+/*
+ * File:    compress.c
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "compress.h"
+
+extern char **environ;
+
+static void printCompressError(char *file, char *msg)
+{
+    fprintf(stderr, "ERR: %s: %s\n", file, msg);
+}
+
+int detectCompression(int fd)
+{
+    unsigned char magic[4];
+    if (pread(fd, magic, sizeof (magic), 0) != sizeof (magic))
+        return EN_COMPRESS_NONE;
+
+    /* Records start with the address family, which never looks like these */
+    if (magic[0] == 0x1f && magic[1] == 0x8b)
+        return EN_COMPRESS_GZIP;
+    if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+        return EN_COMPRESS_ZSTD;
+    if (magic[0] == 0x04 && magic[1] == 0x22 && magic[2] == 0x4d && magic[3] == 0x18)
+        return EN_COMPRESS_LZ4;
+    return EN_COMPRESS_NONE;
+}
+
+/* Fill blocks of the ring from the decompressor until its output ends */
+static void *fillRing(void *arg)
+{
+    struct t_ring *ring = arg;
+    size_t capacity = EN_RING_BLOCK_RECORDS * sizeof (struct flow);
+    char end = 0;
+
+    while (!end)
+    {
+        pthread_mutex_lock(&(ring->lock));
+        while (ring->count == EN_RING_BLOCKS)
+        {
+            pthread_cond_wait(&(ring->emptied), &(ring->lock));
+        }
+        unsigned slot = (ring->head + ring->count) % EN_RING_BLOCKS;
+        pthread_mutex_unlock(&(ring->lock));
+
+        /* Every block but the last one is full, so records never straddle blocks */
+        size_t filled = 0;
+        while (filled < capacity)
+        {
+            ssize_t n = read(ring->fd, ring->blocks[slot] + filled, capacity - filled);
+            if (n <= 0)
+            {
+                end = 1;
+                if (n < 0)
+                    ring->failed = 1;
+                break;
+            }
+            filled += n;
+        }
+
+        pthread_mutex_lock(&(ring->lock));
+        ring->sizes[slot] = filled;
+        if (filled > 0)
+            ring->count++;
+        ring->done = end;
+        pthread_cond_signal(&(ring->filled));
+        pthread_mutex_unlock(&(ring->lock));
+    }
+
+    return NULL;
+}
+
+/* Aggregate the blocks in the order they were filled, return the size of the last one */
+static size_t drainRing(struct t_ring *ring, t_flowHandler handler, void *data)
+{
+    size_t last = 0;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&(ring->lock));
+        while (ring->count == 0 && !ring->done)
+        {
+            pthread_cond_wait(&(ring->filled), &(ring->lock));
+        }
+        if (ring->count == 0)
+        {
+            pthread_mutex_unlock(&(ring->lock));
+            break;
+        }
+        unsigned slot = ring->head;
+        pthread_mutex_unlock(&(ring->lock));
+
+        last = ring->sizes[slot];
+        if (last >= sizeof (struct flow))
+            handler((const struct flow *) ring->blocks[slot], last / sizeof (struct flow), data);
+
+        pthread_mutex_lock(&(ring->lock));
+        ring->head = (ring->head + 1) % EN_RING_BLOCKS;
+        ring->count--;
+        pthread_cond_signal(&(ring->emptied));
+        pthread_mutex_unlock(&(ring->lock));
+    }
+
+    return last;
+}
+
+/* Start the decompressor reading given file, its output is returned */
+static int spawnDecompressor(char *file, int fd, int compression, pid_t *pid)
+{
+    static char *tools[] = {NULL, "gzip", "zstd", "lz4"};
+    char *argv[] = {tools[compression], "-dc", NULL};
+
+    /* Other decompressors started meanwhile must not inherit the pipe */
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) != 0)
+    {
+        printCompressError(file, "Unable to create pipe!");
+        return -1;
+    }
+    fcntl(pipefd[0], F_SETPIPE_SZ, EN_PIPE_SIZE);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fd, STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+
+    int result = posix_spawnp(pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(pipefd[1]);
+
+    if (result != 0)
+    {
+        fprintf(stderr, "ERR: %s: Unable to run %s: %s\n", file, argv[0], strerror(result));
+        close(pipefd[0]);
+        return -1;
+    }
+    return pipefd[0];
+}
+
+int readCompressedFile(char *file, int fd, int compression, t_flowHandler handler, void *data)
+{
+    struct t_ring ring;
+    int i;
+
+    /* The decompressor reads the file from its beginning */
+    if (lseek(fd, 0, SEEK_SET) != 0)
+    {
+        printCompressError(file, "Unable to seek in file!");
+        return 1;
+    }
+
+    memset(&ring, 0, sizeof (ring));
+    for (i = 0; i < EN_RING_BLOCKS; i++)
+    {
+        ring.blocks[i] = malloc(EN_RING_BLOCK_RECORDS * sizeof (struct flow));
+        if (ring.blocks[i] == NULL)
+            ring.failed = 1;
+    }
+    if (ring.failed)
+    {
+        printCompressError(file, "Unable to allocate decompression buffers!");
+        for (i = 0; i < EN_RING_BLOCKS; i++)
+        {
+            free(ring.blocks[i]);
+        }
+        return 1;
+    }
+
+    pid_t pid;
+    ring.fd = spawnDecompressor(file, fd, compression, &pid);
+    if (ring.fd < 0)
+    {
+        for (i = 0; i < EN_RING_BLOCKS; i++)
+        {
+            free(ring.blocks[i]);
+        }
+        return 1;
+    }
+
+    pthread_mutex_init(&(ring.lock), NULL);
+    pthread_cond_init(&(ring.filled), NULL);
+    pthread_cond_init(&(ring.emptied), NULL);
+
+    /* Blocks are read by another thread while the filled ones are aggregated */
+    int result = 0;
+    pthread_t thread;
+    size_t last = 0;
+    if (pthread_create(&thread, NULL, fillRing, &ring) != 0)
+    {
+        printCompressError(file, "Unable to start decompression thread!");
+        result = 1;
+    }
+    else
+    {
+        last = drainRing(&ring, handler, data);
+        pthread_join(thread, NULL);
+    }
+
+    /* The output ends early only if the decompressor failed */
+    close(ring.fd);
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || ring.failed)
+    {
+        if (result == 0)
+            printCompressError(file, "Decompression failed!");
+        result = 1;
+    }
+    else if (last % sizeof (struct flow) != 0)
+        fprintf(stderr, "WARN: %s: %s\n", file, "Truncated trailing record ignored!");
+
+    pthread_mutex_destroy(&(ring.lock));
+    pthread_cond_destroy(&(ring.filled));
+    pthread_cond_destroy(&(ring.emptied));
+    for (i = 0; i < EN_RING_BLOCKS; i++)
+    {
+        free(ring.blocks[i]);
+    }
+    return result;
+}
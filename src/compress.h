@@ -0,0 +1,55 @@
+/*
+ * File:    compress.h
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#ifndef COMPRESS_H
+#define	COMPRESS_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include "reader.h"
+
+/*
+ * Compressed input files, recognized by the magic bytes of gzip, zstd and
+ * lz4 frames. A file is decompressed by the standard tool running as a
+ * separate process, its output is read by a thread into a ring of blocks
+ * and the aggregation takes the blocks as they are filled. Decompression
+ * thus runs on another core all the time, not only while the aggregation
+ * waits for data.
+ */
+
+/* Compression formats */
+#define EN_COMPRESS_NONE 0
+#define EN_COMPRESS_GZIP 1
+#define EN_COMPRESS_ZSTD 2
+#define EN_COMPRESS_LZ4 3
+
+/* Blocks of the ring and records of a block */
+#define EN_RING_BLOCKS 8
+#define EN_RING_BLOCK_RECORDS 16384
+
+/* Requested size of the pipe from the decompressor */
+#define EN_PIPE_SIZE (1024 * 1024)
+
+/* Blocks of decompressed data between the reading thread and the aggregation */
+struct t_ring
+{
+    pthread_mutex_t lock;
+    pthread_cond_t filled; //a block was filled or the input ended
+    pthread_cond_t emptied; //a block was handed over
+    char *blocks[EN_RING_BLOCKS];
+    size_t sizes[EN_RING_BLOCKS];
+    unsigned head; //next block to be aggregated
+    unsigned count; //filled blocks
+    char done; //no more blocks will be filled
+    char failed;
+    int fd; //output of the decompressor
+};
+
+/* Prototypes */
+int detectCompression(int fd);
+int readCompressedFile(char *file, int fd, int compression, t_flowHandler handler, void *data);
+
+#endif /* COMPRESS_H */
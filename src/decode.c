@@ -0,0 +1,424 @@
+/*
+ * File:    decode.c
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "main.h"
+#include "decode.h"
+#ifdef EN_DECODE_X86
+#include <immintrin.h>
+#endif
+
+/* Offset of both counters, bytes follow packets */
+#define EN_COUNTERS_OFFSET offsetof(struct flow, packets)
+
+/* Masks of composite key addresses for both families */
+static void initTupleMasks(struct in6_addr *masksOf, char used, int family, int mask)
+{
+    struct in6_addr full;
+    memset(&full, 0xff, sizeof (struct in6_addr));
+    memset(masksOf, 0, 2 * sizeof (struct in6_addr));
+    if (!used)
+        return;
+
+    /* IPv4 address keeps only the last word */
+    masksOf[0].s6_addr32[3] = (family == 4 && mask != 0) ? masks[mask] : masks[32];
+    masksOf[1] = (family == 6 && mask != 0) ? maskIPv6(&full, mask) : full;
+}
+
+int getPeerField(int aggkey, const struct t_tupleSpec *spec)
+{
+    /* Addresses are peers of addresses, ports of ports */
+    int field;
+    switch (aggkey)
+    {
+    case EN_AGG_SRCIP:
+    case EN_AGG_SRCIP4:
+    case EN_AGG_SRCIP6:
+        return EN_FIELD_DSTIP;
+    case EN_AGG_DSTIP:
+    case EN_AGG_DSTIP4:
+    case EN_AGG_DSTIP6:
+        return EN_FIELD_SRCIP;
+    case EN_AGG_SRCPORT:
+        return EN_FIELD_DSTPORT;
+    case EN_AGG_DSTPORT:
+        return EN_FIELD_SRCPORT;
+    }
+
+    /* Composite key counts peers of its first field, unless they are a part of the key */
+    static const int counterparts[] = {0, EN_FIELD_DSTIP, EN_FIELD_SRCIP, EN_FIELD_DSTPORT, EN_FIELD_SRCPORT};
+    field = counterparts[spec->fields[0]];
+    int i;
+    for (i = 0; i < spec->count; i++)
+    {
+        if (spec->fields[i] == field)
+            return EN_ERROR;
+    }
+    return field;
+}
+
+void initDecoder(struct t_decoder *decoder, int aggkey, int mask, const struct t_tupleSpec *spec, char peers)
+{
+    struct in6_addr full;
+    memset(&full, 0xff, sizeof (struct in6_addr));
+
+    int field = peers ? getPeerField(aggkey, spec) : EN_ERROR;
+    decoder->peers = (field != EN_ERROR);
+    decoder->peerPort = (field == EN_FIELD_SRCPORT || field == EN_FIELD_DSTPORT);
+    if (field == EN_FIELD_SRCIP)
+        decoder->peerOffset = offsetof(struct flow, src_addr);
+    else if (field == EN_FIELD_DSTIP)
+        decoder->peerOffset = offsetof(struct flow, dst_addr);
+    else if (field == EN_FIELD_SRCPORT)
+        decoder->peerOffset = offsetof(struct flow, src_port);
+    else
+        decoder->peerOffset = offsetof(struct flow, dst_port);
+
+    decoder->tuple = (aggkey == EN_AGG_TUPLE);
+    if (decoder->tuple)
+    {
+        char used[EN_TUPLE_FIELDS + 1] = {0};
+        int i;
+        for (i = 0; i < spec->count; i++)
+        {
+            used[spec->fields[i]] = 1;
+        }
+
+        decoder->ports = 0;
+        decoder->hash4 = 0;
+        decoder->hash6 = 0;
+        decoder->families = (spec->family == 4) ? 1 : (spec->family == 6) ? 2 : 3;
+        initTupleMasks(decoder->srcMask, used[EN_FIELD_SRCIP], spec->family, spec->srcMask);
+        initTupleMasks(decoder->dstMask, used[EN_FIELD_DSTIP], spec->family, spec->dstMask);
+        decoder->familyMask = (used[EN_FIELD_SRCIP] || used[EN_FIELD_DSTIP]) ? 0xffffffff : 0;
+        decoder->srcPortMask = used[EN_FIELD_SRCPORT] ? 0xffff : 0;
+        decoder->dstPortMask = used[EN_FIELD_DSTPORT] ? 0xffff : 0;
+        decoder->decode = decodeTupleScalar;
+        return;
+    }
+
+    decoder->families = 3;
+    decoder->ports = (aggkey == EN_AGG_SRCPORT || aggkey == EN_AGG_DSTPORT);
+    decoder->hash4 = !decoder->ports && aggkey != EN_AGG_SRCIP6 && aggkey != EN_AGG_DSTIP6;
+    decoder->hash6 = !decoder->ports && aggkey != EN_AGG_SRCIP4 && aggkey != EN_AGG_DSTIP4;
+
+    if (aggkey == EN_AGG_SRCPORT)
+        decoder->offset = offsetof(struct flow, src_port);
+    else if (aggkey == EN_AGG_DSTPORT)
+        decoder->offset = offsetof(struct flow, dst_port);
+    else if (aggkey == EN_AGG_SRCIP || aggkey == EN_AGG_SRCIP4 || aggkey == EN_AGG_SRCIP6)
+        decoder->offset = offsetof(struct flow, src_addr);
+    else
+        decoder->offset = offsetof(struct flow, dst_addr);
+
+    /* The mask applies only to its own family, the other one is kept whole */
+    decoder->mask4 = masks[32];
+    decoder->mask6 = full;
+    if (aggkey == EN_AGG_SRCIP4 || aggkey == EN_AGG_DSTIP4)
+        decoder->mask4 = masks[mask];
+    else if (aggkey == EN_AGG_SRCIP6 || aggkey == EN_AGG_DSTIP6)
+        decoder->mask6 = maskIPv6(&full, mask);
+
+    decoder->decode = decoder->ports ? decodePortScalar : decodeAddrScalar;
+#ifdef EN_DECODE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        decoder->decode = decoder->ports ? decodePortAVX2 : decodeAddrAVX2;
+    else if (__builtin_cpu_supports("sse4.1"))
+        decoder->decode = decoder->ports ? decodePortSSE4 : decodeAddrSSE4;
+#endif
+}
+
+/* Hashes of counterparts, records are kept or skipped the same way as by the decode */
+static void decodePeers(const struct flow *fl, size_t count, const struct t_decoder *decoder, struct t_decodeBatch *batch)
+{
+    uint32_t n4 = 0, n6 = 0, n = 0;
+    size_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        const char *peer = (const char *) &fl[i] + decoder->peerOffset;
+        uint32_t is6 = (fl[i].sa_family == SA_FAMILY_IPV6);
+        uint64_t hash;
+
+        /* Whole addresses of both families, the IPv4 one is in the last word */
+        if (decoder->peerPort)
+        {
+            uint16_t value;
+            memcpy(&value, peer, sizeof (value));
+            hash = mixHash(value + 0x9e3779b97f4a7c15ULL);
+        }
+        else
+            hash = hashIP6((const struct in6_addr *) peer);
+
+        if (decoder->tuple)
+        {
+            batch->peerTuple[n] = hash;
+            n += (decoder->families >> is6) & 1;
+        }
+        else if (decoder->ports)
+            batch->peer4[i] = hash;
+        else
+        {
+            batch->peer4[n4] = hash;
+            batch->peer6[n6] = hash;
+            n4 += is6 ^ 1;
+            n6 += is6;
+        }
+    }
+}
+
+void decodeFlows(const struct flow *fl, size_t count, const struct t_decoder *decoder, struct t_decodeBatch *batch)
+{
+    decoder->decode(fl, count, decoder, batch);
+    if (decoder->peers)
+        decodePeers(fl, count, decoder, batch);
+
+    /* Hashes of the whole batch at once, the tables can prefetch by them */
+    uint32_t i;
+    if (decoder->hash4)
+    {
+        for (i = 0; i < batch->count4; i++)
+        {
+            batch->hash4[i] = hashIP4(&(batch->key4[i]));
+        }
+    }
+    if (decoder->hash6)
+    {
+        for (i = 0; i < batch->count6; i++)
+        {
+            batch->hash6[i] = hashIP6(&(batch->key6[i]));
+        }
+    }
+    if (decoder->tuple)
+    {
+        for (i = 0; i < batch->countTuple; i++)
+        {
+            batch->hashTuple[i] = hashTuple(&(batch->keyTuple[i]));
+        }
+    }
+}
+
+void decodeAddrScalar(const struct flow *fl, size_t count, const struct t_decoder *decoder, struct t_decodeBatch *batch)
+{
+    uint32_t n4 = 0, n6 = 0;
+    size_t i;
+    int w;
+
+    for (i = 0; i < count; i++)
+    {
+        const struct in6_addr *addr = (const struct in6_addr *) ((const char *) &fl[i] + decoder->offset);
+        uint32_t is6 = (fl[i].sa_family == SA_FAMILY_IPV6);
+
+        struct t_flowCounters counters;
+        counters.packets = __builtin_bswap64(fl[i].packets);
+        counters.bytes = __builtin_bswap64(fl[i].bytes);
+
+        /* The record goes to both arrays, only its family keeps it */
+        batch->key4[n4] = addr->s6_addr32[3] & decoder->mask4;
+        batch->counters4[n4] = counters;
+        for (w = 0; w < 4; w++)
+        {
+            batch->key6[n6].s6_addr32[w] = addr->s6_addr32[w] & decoder->mask6.s6_addr32[w];
+        }
+        batch->counters6[n6] = counters;
+
+        n4 += is6 ^ 1;
+        n6 += is6;
+    }
+
+    batch->count4 = n4;
+    batch->count6 = n6;
+}
+
+void decodePortScalar(const struct flow *fl, size_t count, const struct t_decoder *decoder, struct t_decodeBatch *batch)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        const uint16_t *value = (const uint16_t *) ((const char *) &fl[i] + decoder->offset);
+        batch->key4[i] = __builtin_bswap16(*value);
+        batch->counters4[i].packets = __builtin_bswap64(fl[i].packets);
+        batch->counters4[i].bytes = __builtin_bswap64(fl[i].bytes);
+    }
+
+    batch->count4 = count;
+    batch->count6 = 0;
+}
+
+void decodeTupleScalar(const struct flow *fl, size_t count, const struct t_decoder *decoder, struct t_decodeBatch *batch)
+{
+    uint32_t n = 0;
+    size_t i;
+    int w;
+
+    for (i = 0; i < count; i++)
+    {
+        uint32_t is6 = (fl[i].sa_family == SA_FAMILY_IPV6);
+        struct t_tupleKey *key = &(batch->keyTuple[n]);
+
+        /* Masks of fields not in the key are zero, masks of the family select the words */
+        for (w = 0; w < 4; w++)
+        {
+            key->src.s6_addr32[w] = fl[i].src_addr.s6_addr32[w] & decoder->srcMask[is6].s6_addr32[w];
+            key->dst.s6_addr32[w] = fl[i].dst_addr.s6_addr32[w] & decoder->dstMask[is6].s6_addr32[w];
+        }
+        key->srcPort = __builtin_bswap16(fl[i].src_port) & decoder->srcPortMask;
+        key->dstPort = __builtin_bswap16(fl[i].dst_port) & decoder->dstPortMask;
+        key->family = (4 + 2 * is6) & decoder->familyMask;
+
+        batch->countersTuple[n].packets = __builtin_bswap64(fl[i].packets);
+        batch->countersTuple[n].bytes = __builtin_bswap64(fl[i].bytes);
+
+        /* Records of other family than the key asks for are overwritten */
+        n += (decoder->families >> is6) & 1;
+    }
+
+    batch->countTuple = n;
+    batch->count4 = 0;
+    batch->count6 = 0;
+}
+
+#ifdef EN_DECODE_X86
+
+/* Shuffle reversing bytes of both 64 bit halves */
+#define EN_SWAP64_BYTES 8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7
+
+/* Decode a single record, both counters are swapped by one shuffle */
+__attribute__((target("sse4.1")))
+static inline void decodeAddrRecord(const char *record, const struct t_decoder *decoder, __m128i swap, __m128i mask6, struct t_decodeBatch *batch, uint32_t *n4, uint32_t *n6)
+{
+    __m128i counters = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (record + EN_COUNTERS_OFFSET)), swap);
+    __m128i addr = _mm_loadu_si128((const __m128i *) (record + decoder->offset));
+    uint32_t is6 = (((const struct flow *) record)->sa_family == SA_FAMILY_IPV6);
+
+    batch->key4[*n4] = (uint32_t) _mm_extract_epi32(addr, 3) & decoder->mask4;
+    _mm_storeu_si128((__m128i *) &(batch->counters4[*n4]), counters);
+    _mm_storeu_si128((__m128i *) &(batch->key6[*n6]), _mm_and_si128(addr, mask6));
+    _mm_storeu_si128((__m128i *) &(batch->counters6[*n6]), counters);
+
+    *n4 += is6 ^ 1;
+    *n6 += is6;
+}
+
+__attribute__((target("sse4.1")))
+void decodeAddrSSE4(const struct flow *fl, size_t count, const struct t_decoder *decoder, struct t_decodeBatch *batch)
+{
+    const __m128i swap = _mm_set_epi8(EN_SWAP64_BYTES);
+    const __m128i mask6 = _mm_loadu_si128((const __m128i *) &(decoder->mask6));
+    uint32_t n4 = 0, n6 = 0;
+    size_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        decodeAddrRecord((const char *) &fl[i], decoder, swap, mask6, batch, &n4, &n6);
+    }
+
+    batch->count4 = n4;
+    batch->count6 = n6;
+}
+
+__attribute__((target("sse4.1")))
+void decodePortSSE4(const struct flow *fl, size_t count, const struct t_decoder *decoder, struct t_decodeBatch *batch)
+{
+    const __m128i swap = _mm_set_epi8(EN_SWAP64_BYTES);
+    size_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        const char *record = (const char *) &fl[i];
+        __m128i counters = _mm_loadu_si128((const __m128i *) (record + EN_COUNTERS_OFFSET));
+        _mm_storeu_si128((__m128i *) &(batch->counters4[i]), _mm_shuffle_epi8(counters, swap));
+        batch->key4[i] = __builtin_bswap16(*(const uint16_t *) (record + decoder->offset));
+    }
+
+    batch->count4 = count;
+    batch->count6 = 0;
+}
+
+/* Two records are loaded into the halves of one register */
+__attribute__((target("avx2")))
+static inline __m256i loadRecordPair(const char *record, size_t offset)
+{
+    __m128i first = _mm_loadu_si128((const __m128i *) (record + offset));
+    __m128i second = _mm_loadu_si128((const __m128i *) (record + sizeof (struct flow) + offset));
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(first), second, 1);
+}
+
+__attribute__((target("avx2")))
+void decodeAddrAVX2(const struct flow *fl, size_t count, const struct t_decoder *decoder, struct t_decodeBatch *batch)
+{
+    const __m256i swap = _mm256_set_epi8(EN_SWAP64_BYTES, EN_SWAP64_BYTES);
+    const __m128i mask6 = _mm_loadu_si128((const __m128i *) &(decoder->mask6));
+    const __m256i mask6x2 = _mm256_broadcastsi128_si256(mask6);
+    uint32_t n4 = 0, n6 = 0;
+    size_t i;
+
+    for (i = 0; i + 1 < count; i += 2)
+    {
+        const char *record = (const char *) &fl[i];
+        __m256i counters = _mm256_shuffle_epi8(loadRecordPair(record, EN_COUNTERS_OFFSET), swap);
+        __m256i addr = loadRecordPair(record, decoder->offset);
+        __m256i key6 = _mm256_and_si256(addr, mask6x2);
+        uint32_t is6 = (fl[i].sa_family == SA_FAMILY_IPV6);
+
+        batch->key4[n4] = (uint32_t) _mm256_extract_epi32(addr, 3) & decoder->mask4;
+        _mm_storeu_si128((__m128i *) &(batch->counters4[n4]), _mm256_castsi256_si128(counters));
+        _mm_storeu_si128((__m128i *) &(batch->key6[n6]), _mm256_castsi256_si128(key6));
+        _mm_storeu_si128((__m128i *) &(batch->counters6[n6]), _mm256_castsi256_si128(counters));
+        n4 += is6 ^ 1;
+        n6 += is6;
+
+        is6 = (fl[i + 1].sa_family == SA_FAMILY_IPV6);
+        batch->key4[n4] = (uint32_t) _mm256_extract_epi32(addr, 7) & decoder->mask4;
+        _mm_storeu_si128((__m128i *) &(batch->counters4[n4]), _mm256_extracti128_si256(counters, 1));
+        _mm_storeu_si128((__m128i *) &(batch->key6[n6]), _mm256_extracti128_si256(key6, 1));
+        _mm_storeu_si128((__m128i *) &(batch->counters6[n6]), _mm256_extracti128_si256(counters, 1));
+        n4 += is6 ^ 1;
+        n6 += is6;
+    }
+
+    /* Odd record at the end */
+    if (i < count)
+        decodeAddrRecord((const char *) &fl[i], decoder, _mm256_castsi256_si128(swap), mask6, batch, &n4, &n6);
+
+    batch->count4 = n4;
+    batch->count6 = n6;
+}
+
+__attribute__((target("avx2")))
+void decodePortAVX2(const struct flow *fl, size_t count, const struct t_decoder *decoder, struct t_decodeBatch *batch)
+{
+    const __m256i swap = _mm256_set_epi8(EN_SWAP64_BYTES, EN_SWAP64_BYTES);
+    size_t i;
+
+    /* Counters of two records are next to each other in the batch */
+    for (i = 0; i + 1 < count; i += 2)
+    {
+        const char *record = (const char *) &fl[i];
+        __m256i counters = _mm256_shuffle_epi8(loadRecordPair(record, EN_COUNTERS_OFFSET), swap);
+        _mm256_storeu_si256((__m256i *) &(batch->counters4[i]), counters);
+        batch->key4[i] = __builtin_bswap16(*(const uint16_t *) (record + decoder->offset));
+        batch->key4[i + 1] = __builtin_bswap16(*(const uint16_t *) (record + sizeof (struct flow) + decoder->offset));
+    }
+
+    if (i < count)
+    {
+        batch->key4[i] = __builtin_bswap16(*(const uint16_t *) ((const char *) &fl[i] + decoder->offset));
+        batch->counters4[i].packets = __builtin_bswap64(fl[i].packets);
+        batch->counters4[i].bytes = __builtin_bswap64(fl[i].bytes);
+    }
+
+    batch->count4 = count;
+    batch->count6 = 0;
+}
+
+#endif /* EN_DECODE_X86 */
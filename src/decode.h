@@ -0,0 +1,127 @@
+/*
+ * File:    decode.h
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#ifndef DECODE_H
+#define	DECODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include "table.h"
+
+/*
+ * Batch decode of flow records. A block of records is turned into arrays
+ * of ready-made keys with counters in host order and hashes of the keys,
+ * IPv4 and IPv6 keys in separate arrays. Every record is written to both
+ * arrays and only the count of its family is advanced, so the decode has
+ * no branch on the address family. Byte swapping and masking use SSE4.1
+ * or AVX2 if the CPU supports them, chosen once at runtime.
+ */
+
+/* Vector decoders are built for x86 by GCC compatible compilers */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define EN_DECODE_X86
+#endif
+
+/* Number of records decoded at once */
+#define EN_DECODE_BATCH 256
+
+/* Distance of the records whose table slots are prefetched */
+#define EN_DECODE_PREFETCH 8
+
+struct flow;
+
+/* Fields of a composite key */
+#define EN_TUPLE_FIELDS 4
+#define EN_FIELD_SRCIP 1
+#define EN_FIELD_DSTIP 2
+#define EN_FIELD_SRCPORT 3
+#define EN_FIELD_DSTPORT 4
+
+/* Composition of a composite key */
+struct t_tupleSpec
+{
+    int count;
+    int fields[EN_TUPLE_FIELDS]; //in the order of output columns
+    int family; //0 for both families, or 4 or 6
+    int srcMask; //prefix length of the family given, 0 for whole address
+    int dstMask;
+};
+
+/* Counters of a record in host order */
+struct t_flowCounters
+{
+    uint64_t packets;
+    uint64_t bytes;
+};
+
+/* Decoded block of records */
+struct t_decodeBatch
+{
+    uint32_t count4; //IPv4 keys, or ports
+    uint32_t count6; //IPv6 keys
+    uint32_t countTuple; //composite keys
+    uint32_t key4[EN_DECODE_BATCH]; //IPv4 address in order, or port in host order
+    uint64_t hash4[EN_DECODE_BATCH];
+    struct t_flowCounters counters4[EN_DECODE_BATCH];
+    struct in6_addr key6[EN_DECODE_BATCH];
+    uint64_t hash6[EN_DECODE_BATCH];
+    struct t_flowCounters counters6[EN_DECODE_BATCH];
+    struct t_tupleKey keyTuple[EN_DECODE_BATCH];
+    uint64_t hashTuple[EN_DECODE_BATCH];
+    struct t_flowCounters countersTuple[EN_DECODE_BATCH];
+
+    /* Hashes of counterparts of the keys, in the same order */
+    uint64_t peer4[EN_DECODE_BATCH];
+    uint64_t peer6[EN_DECODE_BATCH];
+    uint64_t peerTuple[EN_DECODE_BATCH];
+};
+
+struct t_decoder;
+
+typedef void (*t_decodeFunction)(const struct flow *fl, size_t count, const struct t_decoder *decoder, struct t_decodeBatch *batch);
+
+struct t_decoder
+{
+    size_t offset; //offset of the address or the port in a record
+    char ports; //decode ports instead of addresses
+    char hash4; //hash IPv4 keys
+    char hash6; //hash IPv6 keys
+    uint32_t mask4; //IPv4 mask in order
+    struct in6_addr mask6;
+
+    /* Composite keys */
+    char tuple;
+    uint32_t families; //bit 0 accepts IPv4 records, bit 1 IPv6 records
+    struct in6_addr srcMask[2]; //mask of IPv4 and IPv6 source addresses
+    struct in6_addr dstMask[2];
+    uint32_t familyMask; //keys without addresses do not tell families apart
+    uint16_t srcPortMask;
+    uint16_t dstPortMask;
+
+    /* Distinct peers */
+    char peers; //hash counterparts of the keys
+    char peerPort; //the counterpart is a port, otherwise an address
+    size_t peerOffset; //offset of the counterpart in a record
+
+    t_decodeFunction decode;
+};
+
+/* Prototypes */
+int getPeerField(int aggkey, const struct t_tupleSpec *spec);
+void initDecoder(struct t_decoder *decoder, int aggkey, int mask, const struct t_tupleSpec *spec, char peers);
+void decodeFlows(const struct flow *fl, size_t count, const struct t_decoder *decoder, struct t_decodeBatch *batch);
+void decodeAddrScalar(const struct flow *fl, size_t count, const struct t_decoder *decoder, struct t_decodeBatch *batch);
+void decodePortScalar(const struct flow *fl, size_t count, const struct t_decoder *decoder, struct t_decodeBatch *batch);
+void decodeTupleScalar(const struct flow *fl, size_t count, const struct t_decoder *decoder, struct t_decodeBatch *batch);
+#ifdef EN_DECODE_X86
+void decodeAddrSSE4(const struct flow *fl, size_t count, const struct t_decoder *decoder, struct t_decodeBatch *batch);
+void decodePortSSE4(const struct flow *fl, size_t count, const struct t_decoder *decoder, struct t_decodeBatch *batch);
+void decodeAddrAVX2(const struct flow *fl, size_t count, const struct t_decoder *decoder, struct t_decodeBatch *batch);
+void decodePortAVX2(const struct flow *fl, size_t count, const struct t_decoder *decoder, struct t_decodeBatch *batch);
+#endif
+
+#endif /* DECODE_H */
@@ -0,0 +1,496 @@
+/*
+ * File:    filter.c
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+#include "filter.h"
+
+/* Families of a record by the bit of the families mask */
+#define EN_FILTER_IPV4 0
+#define EN_FILTER_IPV6 1
+
+static inline int compareAddr(const struct t_filterAddr *a, const struct t_filterAddr *b)
+{
+    if (a->high != b->high)
+        return a->high < b->high ? -1 : 1;
+    if (a->low != b->low)
+        return a->low < b->low ? -1 : 1;
+    return 0;
+}
+
+/* Address of a record in host order */
+static inline void getFilterAddr(struct t_filterAddr *addr, const struct in6_addr *src, int family)
+{
+    if (family == EN_FILTER_IPV4)
+    {
+        addr->high = 0;
+        addr->low = ntohl(src->s6_addr32[3]);
+        return;
+    }
+    addr->high = ((uint64_t) ntohl(src->s6_addr32[0]) << 32) | ntohl(src->s6_addr32[1]);
+    addr->low = ((uint64_t) ntohl(src->s6_addr32[2]) << 32) | ntohl(src->s6_addr32[3]);
+}
+
+/* Binary search of the last range starting at or below the address */
+static inline int matchRanges(const struct t_rangeTable *table, const struct t_filterAddr *addr)
+{
+    uint32_t low = 0, high = table->count;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        if (compareAddr(&(table->ranges[mid].first), addr) <= 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low > 0 && compareAddr(addr, &(table->ranges[low - 1].last)) <= 0;
+}
+
+static inline int matchPort(const uint64_t *ports, uint16_t number)
+{
+    return (ports[number >> 6] >> (number & 63)) & 1;
+}
+
+static int acceptFlow(const struct flow *fl, const struct t_filter *filter)
+{
+    int family = (fl->sa_family == SA_FAMILY_IPV6) ? EN_FILTER_IPV6 : EN_FILTER_IPV4;
+    struct t_filterAddr addr;
+
+    if (!((filter->families >> family) & 1))
+        return 0;
+    if (filter->minBytes > 0 && __builtin_bswap64(fl->bytes) < filter->minBytes)
+        return 0;
+    if (filter->srcPorts != NULL && !matchPort(filter->srcPorts, fl->src_port))
+        return 0;
+    if (filter->dstPorts != NULL && !matchPort(filter->dstPorts, fl->dst_port))
+        return 0;
+    if (filter->srcNets != NULL)
+    {
+        getFilterAddr(&addr, &(fl->src_addr), family);
+        if (!matchRanges(&(filter->srcNets[family]), &addr))
+            return 0;
+    }
+    if (filter->dstNets != NULL)
+    {
+        getFilterAddr(&addr, &(fl->dst_addr), family);
+        if (!matchRanges(&(filter->dstNets[family]), &addr))
+            return 0;
+    }
+    return 1;
+}
+
+size_t filterFlows(const struct flow *fl, size_t count, const struct t_filter *filter, struct flow *accepted)
+{
+    /* Every record is copied and only the accepted ones are kept, so there is no branch on the result */
+    size_t n = 0;
+    size_t i;
+    for (i = 0; i < count; i++)
+    {
+        accepted[n] = fl[i];
+        n += acceptFlow(&fl[i], filter);
+    }
+    return n;
+}
+
+void initFilter(struct t_filter *filter)
+{
+    memset(filter, 0, sizeof (struct t_filter));
+    filter->families = 3;
+}
+
+void finishFilter(struct t_filter *filter)
+{
+    int f;
+    for (f = 0; f < 2; f++)
+    {
+        if (filter->srcNets != NULL)
+            free(filter->srcNets[f].ranges);
+        if (filter->dstNets != NULL)
+            free(filter->dstNets[f].ranges);
+    }
+    free(filter->srcPorts);
+    free(filter->dstPorts);
+    free(filter->srcNets);
+    free(filter->dstNets);
+    initFilter(filter);
+}
+
+/* Bitmap of the ports of a list, NULL if the list is invalid */
+static uint64_t *compilePorts(char *list, char negate)
+{
+    uint64_t *ports = calloc(EN_PORT_COUNT / 64, sizeof (uint64_t));
+    char *state;
+    char *value;
+    if (ports == NULL)
+        return NULL;
+
+    for (value = strtok_r(list, ",", &state); value != NULL; value = strtok_r(NULL, ",", &state))
+    {
+        char *end;
+        long first = strtol(value, &end, 10);
+        long last = first;
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+        if (end == value || *end != '\0' || first < 0 || last < first || last >= EN_PORT_COUNT)
+        {
+            free(ports);
+            return NULL;
+        }
+
+        /* Ports of records are in network order, the bitmap is indexed by them as they are */
+        long number;
+        for (number = first; number <= last; number++)
+        {
+            uint16_t index = htons((uint16_t) number);
+            ports[index >> 6] |= (uint64_t) 1 << (index & 63);
+        }
+    }
+
+    if (negate)
+    {
+        int w;
+        for (w = 0; w < EN_PORT_COUNT / 64; w++)
+        {
+            ports[w] = ~ports[w];
+        }
+    }
+    return ports;
+}
+
+/* Merge a new condition of ports into the previous ones of the field */
+static int addPortCondition(uint64_t **ports, char *list, char negate)
+{
+    uint64_t *compiled = compilePorts(list, negate);
+    if (compiled == NULL)
+        return 1;
+
+    if (*ports == NULL)
+    {
+        *ports = compiled;
+        return 0;
+    }
+
+    int w;
+    for (w = 0; w < EN_PORT_COUNT / 64; w++)
+    {
+        (*ports)[w] &= compiled[w];
+    }
+    free(compiled);
+    return 0;
+}
+
+/* Largest address of a family */
+static struct t_filterAddr getLastAddr(int family)
+{
+    struct t_filterAddr last;
+    last.high = family == EN_FILTER_IPV4 ? 0 : UINT64_MAX;
+    last.low = family == EN_FILTER_IPV4 ? UINT32_MAX : UINT64_MAX;
+    return last;
+}
+
+static inline struct t_filterAddr nextAddr(struct t_filterAddr addr)
+{
+    addr.low++;
+    if (addr.low == 0)
+        addr.high++;
+    return addr;
+}
+
+static inline struct t_filterAddr previousAddr(struct t_filterAddr addr)
+{
+    if (addr.low == 0)
+        addr.high--;
+    addr.low--;
+    return addr;
+}
+
+static int compareRanges(const void *a, const void *b)
+{
+    return compareAddr(&(((const struct t_filterRange *) a)->first), &(((const struct t_filterRange *) b)->first));
+}
+
+/* Sort the ranges and join the overlapping and adjacent ones */
+static void normalizeRanges(struct t_rangeTable *table, int family)
+{
+    struct t_filterAddr last = getLastAddr(family);
+    uint32_t n = 0;
+    uint32_t i;
+
+    qsort(table->ranges, table->count, sizeof (struct t_filterRange), compareRanges);
+    for (i = 0; i < table->count; i++)
+    {
+        struct t_filterRange *range = &(table->ranges[i]);
+        if (n > 0)
+        {
+            struct t_filterRange *previous = &(table->ranges[n - 1]);
+            if (compareAddr(&(previous->last), &last) == 0)
+                continue;
+            struct t_filterAddr next = nextAddr(previous->last);
+            if (compareAddr(&(range->first), &next) <= 0)
+            {
+                if (compareAddr(&(range->last), &(previous->last)) > 0)
+                    previous->last = range->last;
+                continue;
+            }
+        }
+        table->ranges[n++] = *range;
+    }
+    table->count = n;
+}
+
+/* Addresses of a family not covered by the table */
+static int complementRanges(struct t_rangeTable *table, int family)
+{
+    struct t_filterRange *ranges = malloc((table->count + 1) * sizeof (struct t_filterRange));
+    struct t_filterAddr last = getLastAddr(family);
+    struct t_filterAddr first = {0, 0};
+    char covered = 0; //the whole family up to the last range is covered
+    uint32_t n = 0;
+    uint32_t i;
+    if (ranges == NULL)
+        return 1;
+
+    for (i = 0; i < table->count; i++)
+    {
+        struct t_filterRange *range = &(table->ranges[i]);
+        if (compareAddr(&(range->first), &first) > 0)
+        {
+            ranges[n].first = first;
+            ranges[n++].last = previousAddr(range->first);
+        }
+        covered = (compareAddr(&(range->last), &last) == 0);
+        if (!covered)
+            first = nextAddr(range->last);
+    }
+    if (!covered)
+    {
+        ranges[n].first = first;
+        ranges[n++].last = last;
+    }
+
+    free(table->ranges);
+    table->ranges = ranges;
+    table->count = n;
+    return 0;
+}
+
+/* Addresses covered by both tables, the result replaces the first one */
+static int intersectRanges(struct t_rangeTable *table, const struct t_rangeTable *other)
+{
+    struct t_filterRange *ranges = malloc((table->count + other->count + 1) * sizeof (struct t_filterRange));
+    uint32_t n = 0, i = 0, j = 0;
+    if (ranges == NULL)
+        return 1;
+
+    while (i < table->count && j < other->count)
+    {
+        const struct t_filterRange *a = &(table->ranges[i]);
+        const struct t_filterRange *b = &(other->ranges[j]);
+        const struct t_filterAddr *first = compareAddr(&(a->first), &(b->first)) > 0 ? &(a->first) : &(b->first);
+        const struct t_filterAddr *last = compareAddr(&(a->last), &(b->last)) < 0 ? &(a->last) : &(b->last);
+        if (compareAddr(first, last) <= 0)
+        {
+            ranges[n].first = *first;
+            ranges[n++].last = *last;
+        }
+
+        /* The range ending first cannot overlap any further one */
+        if (compareAddr(&(a->last), &(b->last)) < 0)
+            i++;
+        else
+            j++;
+    }
+
+    free(table->ranges);
+    table->ranges = ranges;
+    table->count = n;
+    return 0;
+}
+
+/* Range of a single prefix, e.g. 10.0.0.0/8, a plain address is a prefix of its full length */
+static int parsePrefix(char *value, struct t_filterRange *range, int *family)
+{
+    struct in6_addr addr;
+    char *slash = strchr(value, '/');
+    long length = -1;
+    if (slash != NULL)
+    {
+        char *end;
+        *slash = '\0';
+        length = strtol(slash + 1, &end, 10);
+        if (end == slash + 1 || *end != '\0' || length < 0)
+            return 1;
+    }
+
+    memset(&addr, 0, sizeof (addr));
+    if (inet_pton(AF_INET, value, &(addr.s6_addr32[3])) == 1)
+        *family = EN_FILTER_IPV4;
+    else if (inet_pton(AF_INET6, value, &addr) == 1)
+        *family = EN_FILTER_IPV6;
+    else
+        return 1;
+
+    int bits = *family == EN_FILTER_IPV4 ? 32 : 128;
+    if (length < 0)
+        length = bits;
+    if (length > bits)
+        return 1;
+
+    /* Host bits of the prefix are cleared for the first address and set for the last one */
+    struct t_filterAddr host = {0, 0};
+    int hostBits = bits - length;
+    if (hostBits > 64)
+        host.high = UINT64_MAX >> (128 - hostBits);
+    if (hostBits >= 64)
+        host.low = UINT64_MAX;
+    else if (hostBits > 0)
+        host.low = UINT64_MAX >> (64 - hostBits);
+
+    getFilterAddr(&(range->first), &addr, *family);
+    range->first.high &= ~host.high;
+    range->first.low &= ~host.low;
+    range->last.high = range->first.high | host.high;
+    range->last.low = range->first.low | host.low;
+    return 0;
+}
+
+/* Tables of both families of a list of prefixes */
+static struct t_rangeTable *compileNets(char *list, char negate)
+{
+    struct t_rangeTable *tables = calloc(2, sizeof (struct t_rangeTable));
+    size_t size = strlen(list) / 2 + 1; //prefixes are separated by commas
+    char *state;
+    char *value;
+    int f;
+    if (tables == NULL)
+        return NULL;
+    tables[0].ranges = malloc(size * sizeof (struct t_filterRange));
+    tables[1].ranges = malloc(size * sizeof (struct t_filterRange));
+
+    int result = (tables[0].ranges == NULL || tables[1].ranges == NULL);
+    for (value = strtok_r(list, ",", &state); value != NULL && result == 0; value = strtok_r(NULL, ",", &state))
+    {
+        struct t_filterRange range;
+        int family;
+        if (parsePrefix(value, &range, &family) != 0)
+            result = 1;
+        else
+            tables[family].ranges[tables[family].count++] = range;
+    }
+
+    for (f = 0; f < 2 && result == 0; f++)
+    {
+        normalizeRanges(&tables[f], f);
+        if (negate)
+            result = complementRanges(&tables[f], f);
+    }
+
+    if (result != 0)
+    {
+        free(tables[0].ranges);
+        free(tables[1].ranges);
+        free(tables);
+        return NULL;
+    }
+    return tables;
+}
+
+/* Merge a new condition of prefixes into the previous ones of the field */
+static int addNetCondition(struct t_rangeTable **nets, char *list, char negate)
+{
+    struct t_rangeTable *compiled = compileNets(list, negate);
+    int result = 0;
+    int f;
+    if (compiled == NULL)
+        return 1;
+
+    if (*nets == NULL)
+    {
+        *nets = compiled;
+        return 0;
+    }
+
+    for (f = 0; f < 2; f++)
+    {
+        if (intersectRanges(&((*nets)[f]), &compiled[f]) != 0)
+            result = 1;
+        free(compiled[f].ranges);
+    }
+    free(compiled);
+    return result;
+}
+
+static int parseCondition(struct t_filter *filter, char *condition)
+{
+    char *value = strchr(condition, '=');
+    char negate = 0;
+    if (value == NULL || value == condition || value[1] == '\0')
+        return 1;
+
+    if (value[-1] == '!')
+    {
+        negate = 1;
+        value[-1] = '\0';
+    }
+    *value++ = '\0';
+
+    if (strcmp(condition, "srcport") == 0)
+        return addPortCondition(&(filter->srcPorts), value, negate);
+    if (strcmp(condition, "dstport") == 0)
+        return addPortCondition(&(filter->dstPorts), value, negate);
+    if (strcmp(condition, "srcnet") == 0)
+        return addNetCondition(&(filter->srcNets), value, negate);
+    if (strcmp(condition, "dstnet") == 0)
+        return addNetCondition(&(filter->dstNets), value, negate);
+
+    if (negate)
+        return 1;
+
+    if (strcmp(condition, "family") == 0)
+    {
+        if (strcmp(value, "4") == 0)
+            filter->families &= 1 << EN_FILTER_IPV4;
+        else if (strcmp(value, "6") == 0)
+            filter->families &= 1 << EN_FILTER_IPV6;
+        else
+            return 1;
+        return 0;
+    }
+    if (strcmp(condition, "minbytes") == 0)
+    {
+        char *end;
+        errno = 0;
+        unsigned long long bytes = strtoull(value, &end, 10);
+        if (end == value || *end != '\0' || value[0] == '-' || errno == ERANGE)
+            return 1;
+        if (bytes > filter->minBytes)
+            filter->minBytes = bytes;
+        return 0;
+    }
+    return 1;
+}
+
+int parseFilter(struct t_filter *filter, char *expression)
+{
+    char *tmpExpression = strdup(expression);
+    char *state;
+    char *condition;
+    int result = 0;
+
+    for (condition = strtok_r(tmpExpression, " \t", &state); condition != NULL && result == 0; condition = strtok_r(NULL, " \t", &state))
+    {
+        result = parseCondition(filter, condition);
+    }
+
+    filter->active = 1;
+    free(tmpExpression);
+    return result;
+}
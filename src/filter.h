@@ -0,0 +1,68 @@
+/*
+ * File:    filter.h
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#ifndef FILTER_H
+#define	FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "main.h"
+
+/*
+ * Record filters. A filter expression is a list of conditions separated by
+ * spaces and a record is aggregated only if it meets all of them:
+ *   family=4, family=6
+ *   srcport=list, dstport=list  ports and port ranges, e.g. 53,80,1024-2047
+ *   srcnet=list, dstnet=list    prefixes of both families, e.g.
+ *                               10.0.0.0/8,2001:db8::/32
+ *   minbytes=count              bytes of the record at least
+ * A condition of ports or prefixes is negated by != instead of =.
+ *
+ * The expression is compiled once: port lists into bitmaps of all ports,
+ * prefix lists into sorted tables of disjoint address ranges and repeated
+ * conditions of a field into their intersection. A block of records is
+ * then reduced to the accepted ones before it is decoded, so rejected
+ * records never reach the tables.
+ */
+
+/* Address as a 128 bit number, IPv4 address in the low word */
+struct t_filterAddr
+{
+    uint64_t high;
+    uint64_t low;
+};
+
+struct t_filterRange
+{
+    struct t_filterAddr first;
+    struct t_filterAddr last;
+};
+
+/* Sorted disjoint ranges of accepted addresses of one family */
+struct t_rangeTable
+{
+    uint32_t count;
+    struct t_filterRange *ranges;
+};
+
+struct t_filter
+{
+    char active; //any condition was given
+    uint32_t families; //bit 0 accepts IPv4 records, bit 1 IPv6 records
+    uint64_t minBytes;
+    uint64_t *srcPorts; //bitmaps of accepted ports indexed in network order, NULL accepts all
+    uint64_t *dstPorts;
+    struct t_rangeTable *srcNets; //tables of IPv4 and IPv6 addresses, NULL accepts all
+    struct t_rangeTable *dstNets;
+};
+
+/* Prototypes */
+void initFilter(struct t_filter *filter);
+int parseFilter(struct t_filter *filter, char *expression);
+size_t filterFlows(const struct flow *fl, size_t count, const struct t_filter *filter, struct flow *accepted);
+void finishFilter(struct t_filter *filter);
+
+#endif /* FILTER_H */
@@ -0,0 +1,234 @@
+/*
+ * File:    flowgen.c
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ *
+ * Generator of synthetic flow data files for benchmarks. Hosts are drawn
+ * uniformly or by the Zipf distribution from a given number of distinct
+ * addresses, so both the number of keys and the skew of the traffic are
+ * under control. The output is deterministic for a given seed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+
+#include "main.h"
+
+/* Records generated before they are written */
+#define EN_GEN_BUFFER 65536
+
+/* Distinct destination ports */
+#define EN_GEN_PORTS 64
+
+/* Distribution of drawn hosts */
+struct t_distribution
+{
+    uint32_t count; //distinct values
+    double *cdf; //cumulative probabilities of the Zipf distribution, NULL for uniform
+};
+
+/* xorshift64* generator, good enough and fast */
+static inline uint64_t nextRandom(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+/* Uniform number in [0, 1) */
+static inline double nextUniform(uint64_t *state)
+{
+    return (nextRandom(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int initDistribution(struct t_distribution *dist, uint32_t count, double skew)
+{
+    dist->count = count;
+    dist->cdf = NULL;
+    if (skew <= 0)
+        return 0;
+
+    dist->cdf = malloc(count * sizeof (double));
+    if (dist->cdf == NULL)
+        return 1;
+
+    double sum = 0;
+    uint32_t i;
+    for (i = 0; i < count; i++)
+    {
+        sum += 1.0 / pow(i + 1, skew);
+        dist->cdf[i] = sum;
+    }
+    for (i = 0; i < count; i++)
+    {
+        dist->cdf[i] /= sum;
+    }
+    return 0;
+}
+
+/* Index of a drawn value, 0 is the most frequent one of a skewed distribution */
+static uint32_t drawDistribution(const struct t_distribution *dist, uint64_t *state)
+{
+    if (dist->cdf == NULL)
+        return (uint32_t) (nextRandom(state) % dist->count);
+
+    double u = nextUniform(state);
+    uint32_t low = 0, high = dist->count - 1;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        if (dist->cdf[mid] < u)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+/* Address of a host, hosts are scattered over the address space by a hash */
+static void setHostAddress(struct in6_addr *addr, uint32_t host, char ipv6)
+{
+    uint64_t h = mixHash(host + 1);
+    memset(addr, 0, sizeof (struct in6_addr));
+    if (ipv6)
+    {
+        addr->s6_addr32[0] = htonl(0x20010db8);
+        addr->s6_addr32[1] = htonl((uint32_t) (h >> 48));
+        addr->s6_addr32[2] = htonl((uint32_t) h);
+        addr->s6_addr32[3] = htonl(host);
+    }
+    else
+        addr->s6_addr32[3] = htonl(0x0a000000 | (host & 0xffffff));
+}
+
+static void printGenHelp(char *name)
+{
+    fprintf(stdout, "Usage: %s -o file -n records [-k hosts] [-z skew] [-6 percent] [-r seed]\n", name);
+    fprintf(stdout, "    file         output flow data file\n");
+    fprintf(stdout, "    records      number of generated records\n");
+    fprintf(stdout, "    hosts        distinct source and destination hosts (default 65536,\n"
+            "                 at most 16777216 for IPv4 addresses)\n");
+    fprintf(stdout, "    skew         exponent of the Zipf distribution of hosts, 0 for the\n"
+            "                 uniform one (default 0)\n");
+    fprintf(stdout, "    percent      share of IPv6 records (default 0)\n");
+    fprintf(stdout, "    seed         seed of the random generator (default 1)\n\n");
+}
+
+int main(int argc, char *argv[])
+{
+    char *file = NULL;
+    uint64_t records = 0;
+    uint32_t hosts = 65536;
+    double skew = 0;
+    int percent6 = 0;
+    uint64_t state = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "ho:n:k:z:6:r:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'o':
+            file = optarg;
+            break;
+        case 'n':
+            records = strtoull(optarg, NULL, 10);
+            break;
+        case 'k':
+            hosts = strtoul(optarg, NULL, 10);
+            break;
+        case 'z':
+            skew = atof(optarg);
+            break;
+        case '6':
+            percent6 = atoi(optarg);
+            break;
+        case 'r':
+            state = strtoull(optarg, NULL, 10);
+            break;
+        case 'h':
+            printGenHelp(argv[0]);
+            return (EXIT_SUCCESS);
+        default:
+            printGenHelp(argv[0]);
+            return (EXIT_FAILURE);
+        }
+    }
+
+    if (file == NULL || records == 0 || hosts < 1 || hosts > 16777216 || percent6 < 0 || percent6 > 100 || skew < 0)
+    {
+        fprintf(stderr, "ERR: Invalid parameters!\n");
+        printGenHelp(argv[0]);
+        return (EXIT_FAILURE);
+    }
+
+    /* Zero seed would stay zero forever */
+    state = mixHash(state) | 1;
+
+    struct t_distribution dist, ports;
+    struct flow *buffer = malloc(EN_GEN_BUFFER * sizeof (struct flow));
+    if (buffer == NULL || initDistribution(&dist, hosts, skew) != 0 || initDistribution(&ports, EN_GEN_PORTS, 1.0) != 0)
+    {
+        fprintf(stderr, "ERR: Unable to allocate the generator!\n");
+        return (EXIT_FAILURE);
+    }
+
+    FILE *f = fopen(file, "wb");
+    if (f == NULL)
+    {
+        fprintf(stderr, "ERR: %s: Unable to create file!\n", file);
+        return (EXIT_FAILURE);
+    }
+
+    /* Well known destination ports are skewed, source ports are ephemeral */
+    static const uint16_t wellKnown[EN_GEN_PORTS] = {
+        443, 80, 53, 22, 123, 25, 993, 8080, 3306, 5432, 389, 636, 110, 143, 445, 139,
+        21, 23, 161, 162, 514, 587, 853, 995, 1194, 1433, 1521, 2049, 3389, 5060, 5061, 5222,
+        5353, 5900, 6379, 6443, 8000, 8443, 8888, 9000, 9090, 9200, 9300, 9418, 10050, 11211, 27017, 1883,
+        8883, 179, 67, 68, 69, 88, 111, 135, 137, 138, 500, 4500, 1701, 1723, 3478, 51820
+    };
+
+    int result = EXIT_SUCCESS;
+    uint64_t done = 0;
+    while (done < records && result == EXIT_SUCCESS)
+    {
+        size_t n = records - done < EN_GEN_BUFFER ? records - done : EN_GEN_BUFFER;
+        size_t i;
+        for (i = 0; i < n; i++)
+        {
+            struct flow *fl = &buffer[i];
+            char ipv6 = (int) (nextRandom(&state) % 100) < percent6;
+            uint64_t packets = 1 + (uint64_t) (-log(1.0 - nextUniform(&state)) * 8);
+            uint64_t size = 40 + nextRandom(&state) % 1461;
+
+            fl->sa_family = ipv6 ? SA_FAMILY_IPV6 : SA_FAMILY_IPV4;
+            setHostAddress(&(fl->src_addr), drawDistribution(&dist, &state), ipv6);
+            setHostAddress(&(fl->dst_addr), drawDistribution(&dist, &state), ipv6);
+            fl->src_port = htons((uint16_t) (1024 + nextRandom(&state) % 64512));
+            fl->dst_port = htons(wellKnown[drawDistribution(&ports, &state)]);
+            fl->packets = __builtin_bswap64(packets);
+            fl->bytes = __builtin_bswap64(packets * size);
+        }
+
+        if (fwrite(buffer, sizeof (struct flow), n, f) != n)
+            result = EXIT_FAILURE;
+        done += n;
+    }
+
+    if (fclose(f) != 0 || result != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "ERR: %s: Writing of the file failed!\n", file);
+        result = EXIT_FAILURE;
+    }
+
+    free(buffer);
+    free(dist.cdf);
+    free(ports.cdf);
+    return result;
+}
@@ -9,42 +9,183 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
 
 #include <string.h>
-#include <dirent.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 #include "main.h"
-
-void printData(struct t_dataStruct *d)
+#include "reader.h"
+#include "table.h"
+#include "sort.h"
+#include "output.h"
+#include "cache.h"
+#include "watch.h"
+#include "result.h"
+#include "stats.h"
+#include "filter.h"
+#include "arena.h"
+#include "prefetch.h"
+#include "spill.h"
+
+/* IPv4 masks */
+uint32_t masks[] = {
+    0,
+    128, //address 128.0.0.0
+    192, //address 192.0.0.0
+    224, //address 224.0.0.0
+    240, //address 240.0.0.0
+    248, //address 248.0.0.0
+    252, //address 252.0.0.0
+    254, //address 254.0.0.0
+    255, //address 255.0.0.0
+    33023, //address 255.128.0.0
+    49407, //address 255.192.0.0
+    57599, //address 255.224.0.0
+    61695, //address 255.240.0.0
+    63743, //address 255.248.0.0
+    64767, //address 255.252.0.0
+    65279, //address 255.254.0.0
+    65535, //address 255.255.0.0
+    8454143, //address 255.255.128.0
+    12648447, //address 255.255.192.0
+    14745599, //address 255.255.224.0
+    15794175, //address 255.255.240.0
+    16318463, //address 255.255.248.0
+    16580607, //address 255.255.252.0
+    16711679, //address 255.255.254.0
+    16777215, //address 255.255.255.0
+    2164260863, //address 255.255.255.128
+    3238002687, //address 255.255.255.196
+    3774873599, //address 255.255.255.224
+    4043309055, //address 255.255.255.240
+    4177526783, //address 255.255.255.248
+    4244635647, //address 255.255.255.252
+    4278190079, //address 255.255.255.254
+    4294967295, //address 255.255.255.255
+};
+
+void printData(struct t_output *out, struct t_dataStruct *d)
 {
+    char *p = reserveOutput(out, EN_OUTPUT_LINE);
+
     if (d->used == EN_DATA_PORT)
-    {
-        printf("%d,%lu,%lu\n", d->port, d->packets, d->bytes);
+        p = formatUint(p, d->port);
+    else if (d->used == EN_DATA_IP4)
+        p = formatIP4(p, d->addr4);
+    else if (d->used == EN_DATA_IP6)
+        p = formatIP6(p, &(d->addr6));
+    else if (d->used == EN_DATA_TUPLE)
+        p = formatTuple(p, &(d->tupleKey), d->spec);
+    else
+        return;
 
+    *p++ = ',';
+    p = formatUint(p, d->packets);
+    *p++ = ',';
+    p = formatUint(p, d->bytes);
+    if (d->counted)
+    {
+        *p++ = ',';
+        p = formatUint(p, d->peers);
     }
-    else if (d->used == EN_DATA_IP4)
+    if (d->approximate)
     {
-        char ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &(d->addr4), ip, INET_ADDRSTRLEN);
-        printf("%s,%lu,%lu\n", ip, d->packets, d->bytes);
+        *p++ = ',';
+        p = formatUint(p, d->error);
     }
-    else if (d->used == EN_DATA_IP6)
+    *p++ = '\n';
+    commitOutput(out, p);
+}
+
+char *formatTuple(char *dst, const struct t_tupleKey *key, const struct t_tupleSpec *spec)
+{
+    int i;
+    for (i = 0; i < spec->count; i++)
     {
-        char ip[INET6_ADDRSTRLEN];
-        inet_ntop(AF_INET6, &(d->addr6), ip, INET6_ADDRSTRLEN);
-        printf("%s,%lu,%lu\n", ip, d->packets, d->bytes);
+        if (i > 0)
+            *dst++ = ',';
+
+        switch (spec->fields[i])
+        {
+        case EN_FIELD_SRCIP:
+            if (key->family == 4)
+                dst = formatIP4(dst, key->src.s6_addr32[3]);
+            else
+                dst = formatIP6(dst, &(key->src));
+            break;
+        case EN_FIELD_DSTIP:
+            if (key->family == 4)
+                dst = formatIP4(dst, key->dst.s6_addr32[3]);
+            else
+                dst = formatIP6(dst, &(key->dst));
+            break;
+        case EN_FIELD_SRCPORT:
+            dst = formatUint(dst, key->srcPort);
+            break;
+        case EN_FIELD_DSTPORT:
+            dst = formatUint(dst, key->dstPort);
+            break;
+        }
     }
+    return dst;
 }
 
 void printHelp(char *name)
 {
-    fprintf(stdout, "Usage: %s -f directory -a aggregation -s sort\n", name);
+    fprintf(stdout, "Usage: %s -f directory -a aggregation [-a aggregation ...] -s sort [-o output]\n"
+            "       [-e filter ...] [-n count] [-j threads] [-p] [-g] [-d] [-b] [-t] [-c cache]\n"
+            "       [-w interval] [-x keys] [-m size]\n", name);
+    fprintf(stdout, "       %s -f directory -a aggregation [-a aggregation ...] -P [-o output] ...\n", name);
+    fprintf(stdout, "       %s -M -a aggregation [-a aggregation ...] -s sort [-o output] ... partial ...\n", name);
     fprintf(stdout, "       %s -h\n", name);
     fprintf(stdout, "       %s --help\n", name);
-    fprintf(stdout, "    directory    directory with flow data files\n");
+    fprintf(stdout, "    directory    directory with flow data files, raw or compressed by gzip, zstd\n"
+            "                 or lz4 (decompressed by the tools of the same name)\n");
     fprintf(stdout, "    aggregation  aggregation key [srcip, dstip, srcip4/mask, dstip4/mask,\n"
             "                 srcip6/mask, dstip6/mask, srcport, dstport]\n");
-    fprintf(stdout, "    sort         sort key [packets, bytes]\n\n");
+    fprintf(stdout, "                 or composite key of fields joined by + or , [e.g. srcip+dstport,\n"
+            "                 srcip,dstip, srcip+srcport+dstip+dstport]\n");
+    fprintf(stdout, "                 or rollup of several masks [e.g. srcip4/8,16,24, dstip6/32,48]\n");
+    fprintf(stdout, "                 several keys are aggregated in a single pass over the data\n");
+    fprintf(stdout, "    sort         sort key [packets, bytes, peers]\n");
+    fprintf(stdout, "    filter       aggregate only records meeting all conditions separated by\n"
+            "                 spaces [family=4|6, srcport=list, dstport=list, srcnet=list,\n"
+            "                 dstnet=list, minbytes=count] (e.g. \"dstport=53 srcnet!=10.0.0.0/8\"),\n"
+            "                 lists of ports and ranges or prefixes separated by commas,\n"
+            "                 != negates the list, see filter.h\n");
+    fprintf(stdout, "    output       directory of the reports, one file per aggregation key\n"
+            "                 (e.g. srcip4_24.csv), required for several keys\n");
+    fprintf(stdout, "    -P           write reports as unsorted partial aggregates (e.g. srcip4_24.part)\n"
+            "                 to be merged with partials of other hosts, see cache.h\n");
+    fprintf(stdout, "    -M           merge partial aggregates given as arguments instead of reading\n"
+            "                 a directory, each into the report of its aggregation key\n");
+    fprintf(stdout, "    -b           write reports in the binary result format to be mapped into\n"
+            "                 memory (e.g. srcip4_24.bin), see result.h\n");
+    fprintf(stdout, "    -t           print statistics of the run to the error output: times of\n"
+            "                 the phases, records read, growth, load and probe lengths\n"
+            "                 of the tables\n");
+    fprintf(stdout, "    count        print only given number of top entries\n");
+    fprintf(stdout, "    threads      number of aggregation threads (default 1)\n");
+    fprintf(stdout, "    -p           presize tables by the input size, so they never grow\n");
+    fprintf(stdout, "    -g           back large tables by explicit huge pages reserved by the system\n"
+            "                 (vm.nr_hugepages), transparent huge pages are used otherwise\n");
+    fprintf(stdout, "    -d           estimate distinct peers of every key (destinations of\n"
+            "                 a source, sources of a destination, the other port of a port),\n"
+            "                 implied by the peers sort key\n");
+    fprintf(stdout, "    cache        directory of partial aggregates of single files, files not\n"
+            "                 changed since they were cached are not read again\n");
+    fprintf(stdout, "    interval     keep watching the directory, aggregate new records and write\n"
+            "                 the reports again every given number of seconds\n");
+    fprintf(stdout, "    keys         approximate aggregation tracking only given number of keys\n"
+            "                 of addresses, the error column bounds the overestimate of\n"
+            "                 the sort key counter (ports stay exact)\n");
+    fprintf(stdout, "    size         memory limit of the tables of address and composite keys\n"
+            "                 with an optional suffix K, M or G (e.g. 512M), keys over\n"
+            "                 the limit are spilled to files in TMPDIR, see spill.h\n\n");
 }
 
 inline void printError(char *msg)
@@ -58,10 +199,108 @@ int parseSortKey(char *key)
         return EN_SORT_PACKETS;
     else if (strcmp(key, "bytes") == 0)
         return EN_SORT_BYTES;
+    else if (strcmp(key, "peers") == 0)
+        return EN_SORT_PEERS;
     else
         return EN_ERROR;
 }
 
+/* Number of bytes with an optional suffix K, M or G, 0 if invalid */
+uint64_t parseSize(char *size)
+{
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(size, &end, 10);
+    if (errno != 0 || end == size || size[0] == '-')
+        return 0;
+
+    int shift = 0;
+    if (*end == 'K' || *end == 'k')
+        shift = 10;
+    else if (*end == 'M' || *end == 'm')
+        shift = 20;
+    else if (*end == 'G' || *end == 'g')
+        shift = 30;
+    if (shift > 0)
+        end++;
+    if (*end != '\0' || value > (UINT64_MAX >> shift))
+        return 0;
+    return (uint64_t) value << shift;
+}
+
+int parseTupleKey(char *key, struct t_tupleSpec *spec)
+{
+    char *tmpKey = strdup(key);
+    char *state;
+    char *field;
+    int result = EN_AGG_TUPLE;
+
+    spec->count = 0;
+    spec->family = 0;
+    spec->srcMask = 0;
+    spec->dstMask = 0;
+
+    /* Every field is a single aggregation key */
+    for (field = strtok_r(tmpKey, "+,", &state); field != NULL && result != EN_ERROR; field = strtok_r(NULL, "+,", &state))
+    {
+        int mask = 0;
+        int family = 0;
+        int id;
+
+        switch (parseAggKey(field, &mask))
+        {
+        case EN_AGG_SRCIP4:
+        case EN_AGG_SRCIP6:
+            family = (strncmp(field, "srcip4", 6) == 0) ? 4 : 6;
+            spec->srcMask = mask;
+            /* fall through */
+        case EN_AGG_SRCIP:
+            id = EN_FIELD_SRCIP;
+            break;
+        case EN_AGG_DSTIP4:
+        case EN_AGG_DSTIP6:
+            family = (strncmp(field, "dstip4", 6) == 0) ? 4 : 6;
+            spec->dstMask = mask;
+            /* fall through */
+        case EN_AGG_DSTIP:
+            id = EN_FIELD_DSTIP;
+            break;
+        case EN_AGG_SRCPORT:
+            id = EN_FIELD_SRCPORT;
+            break;
+        case EN_AGG_DSTPORT:
+            id = EN_FIELD_DSTPORT;
+            break;
+        default:
+            id = EN_ERROR;
+            break;
+        }
+
+        /* Fields have to be distinct and of the same family */
+        int i;
+        for (i = 0; i < spec->count; i++)
+        {
+            if (spec->fields[i] == id)
+                id = EN_ERROR;
+        }
+        if (id == EN_ERROR || (family != 0 && spec->family != 0 && family != spec->family))
+        {
+            result = EN_ERROR;
+            break;
+        }
+
+        if (family != 0)
+            spec->family = family;
+        spec->fields[spec->count++] = id;
+    }
+
+    if (spec->count < 2)
+        result = EN_ERROR;
+
+    free(tmpKey);
+    return result;
+}
+
 int parseAggKey(char *key, int * mask)
 {
     char * p = strchr(key, '/');
@@ -108,376 +347,130 @@ int parseAggKey(char *key, int * mask)
         return EN_ERROR;
 }
 
-void addRecordIP(struct flow *fl, int aggkey, int mask, struct t_hashTable *hashTable)
+void addBatchIP4(const struct t_decodeBatch *batch, struct t_ip4Table *table)
 {
-    if (aggkey == EN_AGG_SRCIP4 || aggkey == EN_AGG_DSTIP4)
-    {
-        /* Skip unwanted IP flows (by protocol version) */
-        if (fl->sa_family == SA_FAMILY_IPV6)
-        {
-            return;
-        }
-
-        /* Add IPv4 record to the hash table */
-        addRecordIP4(fl, aggkey, mask, hashTable);
-
-        /* Check the size of hash table and double it if necessary */
-        if (hashTable->count > hashTable->limit)
-        {
-            doubleHashTable(hashTable, aggkey);
-        }
-    }
-    else if (aggkey == EN_AGG_SRCIP6 || aggkey == EN_AGG_DSTIP6)
-    {
-        /* Skip unwanted IP flows (by protocol version) */
-        if (fl->sa_family == SA_FAMILY_IPV4)
-        {
-            return;
-        }
-
-        /* Add IPv6 record to the hash table */
-        addRecordIP6(fl, aggkey, mask, hashTable);
-
-        /* Check the size of hash table and double it if necessary */
-        if (hashTable->count > hashTable->limit)
-        {
-            doubleHashTable(hashTable, aggkey);
-        }
-    }
-    else /* aggkey == EN_AGG_SRCIP || aggkey == EN_AGG_DSTIP */
+    uint32_t i;
+    for (i = 0; i < batch->count4; i++)
     {
-        /* Process IPv6 addresses */
-        if (fl->sa_family == SA_FAMILY_IPV6)
-        {
-            mask = 128;
-
-            /* Add IPv6 record to the hash table */
-            addRecordIP6(fl, aggkey, mask, hashTable);
+        /* Hashes are known ahead, tags of following keys are fetched meanwhile */
+        if (i + EN_DECODE_PREFETCH < batch->count4)
+            prefetchIP4Table(table, batch->hash4[i + EN_DECODE_PREFETCH]);
 
-            /* Check the size of hash table and double it if necessary */
-            if (hashTable->count > hashTable->limit)
-            {
-                doubleHashTable(hashTable, aggkey);
-            }
-        }
-        else /* fl->sa_family == SA_FAMILY_IPV4 */
-        {
-            mask = 32;
-
-            /* Add IPv4 record to the hash table */
-            addRecordIP4(fl, aggkey, mask, hashTable);
-
-            /* Check the size of hash table and double it if necessary */
-            if (hashTable->count > hashTable->limit)
-            {
-                doubleHashTable(hashTable, aggkey);
-            }
-        }
+        struct t_peers **peers = addIP4Table(table, &(batch->key4[i]), batch->hash4[i], batch->counters4[i].packets, batch->counters4[i].bytes);
+        if (peers != NULL)
+            addPeer(peers, batch->peer4[i]);
     }
 }
 
-void addRecordIP6(struct flow *fl, int aggkey, int mask, struct t_hashTable *hashTable)
+void addBatchIP6(const struct t_decodeBatch *batch, struct t_ip6Table *table)
 {
-    /* Get correct address */
-    struct in6_addr ipaddr;
-    if (aggkey == EN_AGG_SRCIP6 || aggkey == EN_AGG_SRCIP)
-        ipaddr = fl->src_addr;
-    else
-        ipaddr = fl->dst_addr;
-
-    /* Get masked address */
-    struct in6_addr maskedAddr = maskIPv6(&ipaddr, mask);
-
-    /* Get the hash */
-    uint32_t hash = hashFunction6(maskedAddr, hashTable->size);
-
-    /* Add the record */
-    if (hashTable->data[hash].used != EN_DATA_UNUSED)
+    uint32_t i;
+    for (i = 0; i < batch->count6; i++)
     {
-        if (hashTable->data[hash].used == EN_DATA_IP6 && equals_in6_addr(&(hashTable->data[hash].addr6), &maskedAddr))
-        {
-            hashTable->data[hash].bytes += __builtin_bswap64(fl->bytes);
-            hashTable->data[hash].packets += __builtin_bswap64(fl->packets);
-        }
-        else
-        {
-            uint32_t newHash = (hash + EN_HASH_STEP) % hashTable->size;
-
-            while ((hashTable->data[newHash].used == EN_DATA_IP6 && !equals_in6_addr(&(hashTable->data[newHash].addr6), &maskedAddr)) || hashTable->data[newHash].used == EN_DATA_IP4 || hashTable->data[hash].used == EN_DATA_PORT)
-            {
-                newHash = (uint32_t) (newHash + EN_HASH_STEP) % hashTable->size;
-            }
+        if (i + EN_DECODE_PREFETCH < batch->count6)
+            prefetchIP6Table(table, batch->hash6[i + EN_DECODE_PREFETCH]);
 
-            if (hashTable->data[newHash].used == EN_DATA_UNUSED)
-            {
-                hashTable->data[newHash].addr6 = maskedAddr;
-                hashTable->data[newHash].bytes = __builtin_bswap64(fl->bytes);
-                hashTable->data[newHash].packets = __builtin_bswap64(fl->packets);
-                hashTable->data[newHash].used = EN_DATA_IP6;
-                hashTable->count++;
-            }
-            else
-            {
-                hashTable->data[newHash].bytes += __builtin_bswap64(fl->bytes);
-                hashTable->data[newHash].packets += __builtin_bswap64(fl->packets);
-            }
-        }
-    }
-        /* Initialize if there is not a record yet */
-    else
-    {
-        hashTable->data[hash].addr6 = maskedAddr;
-        hashTable->data[hash].bytes = __builtin_bswap64(fl->bytes);
-        hashTable->data[hash].packets = __builtin_bswap64(fl->packets);
-        hashTable->data[hash].used = EN_DATA_IP6;
-        hashTable->count++;
+        struct t_peers **peers = addIP6Table(table, &(batch->key6[i]), batch->hash6[i], batch->counters6[i].packets, batch->counters6[i].bytes);
+        if (peers != NULL)
+            addPeer(peers, batch->peer6[i]);
     }
 }
 
-void addRecordIP4(struct flow *fl, int aggkey, int mask, struct t_hashTable *hashTable)
+void addBatchTuple(const struct t_decodeBatch *batch, struct t_tupleTable *table)
 {
-    /* Get correct address */
-    uint32_t ipaddr;
-    if (aggkey == EN_AGG_SRCIP4 || aggkey == EN_AGG_SRCIP)
-        ipaddr = fl->src_addr.s6_addr32[3];
-    else
-        ipaddr = fl->dst_addr.s6_addr32[3];
-
-    /* Get masked address */
-    uint32_t maskedAddr;
-    if (mask == 32)
-        maskedAddr = ipaddr;
-    else
-        maskedAddr = ipaddr & masks[mask];
-
-    /* Get the hash */
-    uint32_t hash = hashFunction(maskedAddr, hashTable->size);
-
-    /* Add the record */
-    if (hashTable->data[hash].used != EN_DATA_UNUSED)
+    uint32_t i;
+    for (i = 0; i < batch->countTuple; i++)
     {
-        if (hashTable->data[hash].used == EN_DATA_IP4 && hashTable->data[hash].addr4 == maskedAddr)
-        {
-            hashTable->data[hash].bytes += __builtin_bswap64(fl->bytes);
-            hashTable->data[hash].packets += __builtin_bswap64(fl->packets);
-        }
-        else
-        {
-            uint32_t newHash = (uint32_t) (hash + EN_HASH_STEP) % hashTable->size;
+        if (i + EN_DECODE_PREFETCH < batch->countTuple)
+            prefetchTupleTable(table, batch->hashTuple[i + EN_DECODE_PREFETCH]);
 
-            while ((hashTable->data[newHash].used == EN_DATA_IP4 && hashTable->data[newHash].addr4 != maskedAddr) || hashTable->data[newHash].used == EN_DATA_IP6 || hashTable->data[hash].used == EN_DATA_PORT)
-            {
-                newHash = (newHash + EN_HASH_STEP) % hashTable->size;
-            }
-
-            if (hashTable->data[newHash].used == EN_DATA_UNUSED)
-            {
-                hashTable->data[newHash].addr4 = maskedAddr;
-                hashTable->data[newHash].bytes = __builtin_bswap64(fl->bytes);
-                hashTable->data[newHash].packets = __builtin_bswap64(fl->packets);
-                hashTable->data[newHash].used = EN_DATA_IP4;
-                hashTable->count++;
-            }
-            else
-            {
-                hashTable->data[newHash].bytes += __builtin_bswap64(fl->bytes);
-                hashTable->data[newHash].packets += __builtin_bswap64(fl->packets);
-            }
-        }
-    }
-        /* Initialize if there is not a record yet */
-    else
-    {
-        hashTable->data[hash].addr4 = maskedAddr;
-        hashTable->data[hash].bytes = __builtin_bswap64(fl->bytes);
-        hashTable->data[hash].packets = __builtin_bswap64(fl->packets);
-        hashTable->data[hash].used = EN_DATA_IP4;
-        hashTable->count++;
+        struct t_peers **peers = addTupleTable(table, &(batch->keyTuple[i]), batch->hashTuple[i], batch->countersTuple[i].packets, batch->countersTuple[i].bytes);
+        if (peers != NULL)
+            addPeer(peers, batch->peerTuple[i]);
     }
 }
 
-void addRecordPort(struct flow *fl, int aggkey, struct t_hashTable *hashTable)
+void addBatchSummary(const struct t_decodeBatch *batch, const struct t_decoder *decoder, struct t_summary *summary)
 {
-    /* Try to add a record to data structure */
-    uint32_t value;
-    if (aggkey == EN_AGG_SRCPORT)
-        value = __builtin_bswap16(fl->src_port);
-    else if (aggkey == EN_AGG_DSTPORT)
-        value = __builtin_bswap16(fl->dst_port);
-    else
-        return;
-
-    /* Get the hash */
-    uint32_t hash = hashFunction(value, hashTable->size);
-
-    /* Add if there is a record */
-    if (hashTable->data[hash].used)
+    uint32_t i;
+    if (summary->tuples)
     {
-        if (hashTable->data[hash].port == value)
-        {
-            hashTable->data[hash].bytes += __builtin_bswap64(fl->bytes);
-            hashTable->data[hash].packets += __builtin_bswap64(fl->packets);
-        }
-        else
+        for (i = 0; i < batch->countTuple; i++)
         {
-            uint32_t newHash = (hash + EN_HASH_STEP) % hashTable->size;
-
-            while (hashTable->data[newHash].used && hashTable->data[newHash].port != value)
-            {
-                newHash = (newHash + EN_HASH_STEP) % hashTable->size;
-            }
-
-            if (!hashTable->data[newHash].used)
-            {
-                hashTable->data[newHash].port = value;
-                hashTable->data[newHash].bytes = __builtin_bswap64(fl->bytes);
-                hashTable->data[newHash].packets = __builtin_bswap64(fl->packets);
-                hashTable->data[newHash].used = EN_DATA_PORT;
-                hashTable->count++;
-            }
-            else
-            {
-                hashTable->data[newHash].bytes += __builtin_bswap64(fl->bytes);
-                hashTable->data[newHash].packets += __builtin_bswap64(fl->packets);
-            }
+            addSummary(summary, &(batch->keyTuple[i]), batch->hashTuple[i], batch->countersTuple[i].packets, batch->countersTuple[i].bytes);
         }
+        return;
     }
-        /* Initialize if there is not a record yet */
-    else
+
+    /* Addresses are kept in the source of a composite key, hashes stay those of the tables */
+    struct t_tupleKey key;
+    memset(&key, 0, sizeof (key));
+    key.family = 4;
+    for (i = 0; decoder->hash4 && i < batch->count4; i++)
     {
-        hashTable->data[hash].port = value;
-        hashTable->data[hash].bytes = __builtin_bswap64(fl->bytes);
-        hashTable->data[hash].packets = __builtin_bswap64(fl->packets);
-        hashTable->data[hash].used = EN_DATA_PORT;
-        hashTable->count++;
+        key.src.s6_addr32[3] = batch->key4[i];
+        addSummary(summary, &key, batch->hash4[i], batch->counters4[i].packets, batch->counters4[i].bytes);
     }
 
-    if (hashTable->count > hashTable->limit)
+    key.family = 6;
+    for (i = 0; decoder->hash6 && i < batch->count6; i++)
     {
-        doubleHashTable(hashTable, aggkey);
+        key.src = batch->key6[i];
+        addSummary(summary, &key, batch->hash6[i], batch->counters6[i].packets, batch->counters6[i].bytes);
     }
 }
 
-char equals_in6_addr(struct in6_addr *i1, struct in6_addr *i2)
-{
-    if (i1->s6_addr32[0] == i2->s6_addr32[0] &&
-        i1->s6_addr32[1] == i2->s6_addr32[1] &&
-        i1->s6_addr32[2] == i2->s6_addr32[2] &&
-        i1->s6_addr32[3] == i2->s6_addr32[3])
-        return 1;
-    return 0;
-}
-
-void doubleHashTable(struct t_hashTable *hashTable, int aggkey)
+void addBatchPort(const struct t_decodeBatch *batch, struct t_portTable *ports)
 {
-    struct t_dataStruct *oldDataStruct = hashTable->data;
-    uint32_t oldSize = hashTable->size;
-    initHashTable(hashTable, oldSize * 2);
-
-    struct flow tmpFl;
-
+    /* Port is the index of the counter */
     uint32_t i;
-    for (i = 0; i < oldSize; i++)
+    for (i = 0; i < batch->count4; i++)
     {
-        if (oldDataStruct[i].used)
-        {
-            tmpFl.bytes = __builtin_bswap64(oldDataStruct[i].bytes);
-            tmpFl.packets = __builtin_bswap64(oldDataStruct[i].packets);
-            if (aggkey == EN_AGG_SRCIP4)
-            {
-                tmpFl.src_addr.s6_addr32[3] = oldDataStruct[i].addr4;
-                addRecordIP4(&tmpFl, aggkey, 32, hashTable);
-            }
-            else if (aggkey == EN_AGG_DSTIP4)
-            {
-                tmpFl.dst_addr.s6_addr32[3] = oldDataStruct[i].addr4;
-                addRecordIP4(&tmpFl, aggkey, 32, hashTable);
-            }
-            else if (aggkey == EN_AGG_SRCIP6)
-            {
-                tmpFl.src_addr = oldDataStruct[i].addr6;
-                addRecordIP6(&tmpFl, aggkey, 128, hashTable);
-            }
-            else if (aggkey == EN_AGG_DSTIP6)
-            {
-                tmpFl.dst_addr = oldDataStruct[i].addr6;
-                addRecordIP6(&tmpFl, aggkey, 128, hashTable);
-            }
-            else if (aggkey == EN_AGG_SRCIP)
-            {
-                if (oldDataStruct[i].used == EN_DATA_IP4)
-                {
-                    tmpFl.src_addr.s6_addr32[3] = oldDataStruct[i].addr4;
-                    addRecordIP4(&tmpFl, aggkey, 32, hashTable);
-                }
-                else
-                {
-                    tmpFl.src_addr = oldDataStruct[i].addr6;
-                    addRecordIP6(&tmpFl, aggkey, 128, hashTable);
-                }
-            }
-            else if (aggkey == EN_AGG_DSTIP6)
-            {
-                if (oldDataStruct[i].used == EN_DATA_IP4)
-                {
-                    tmpFl.dst_addr.s6_addr32[3] = oldDataStruct[i].addr4;
-                    addRecordIP4(&tmpFl, aggkey, 32, hashTable);
-                }
-                else
-                {
-                    tmpFl.dst_addr = oldDataStruct[i].addr6;
-                    addRecordIP6(&tmpFl, aggkey, 128, hashTable);
-                }
-            }
-            else if (aggkey == EN_AGG_SRCPORT)
-            {
-                tmpFl.src_port = __builtin_bswap16(oldDataStruct[i].port);
-                addRecordPort(&tmpFl, aggkey, hashTable);
-            }
-            else if (aggkey == EN_AGG_DSTPORT)
-            {
-                tmpFl.dst_port = __builtin_bswap16(oldDataStruct[i].port);
-                addRecordPort(&tmpFl, aggkey, hashTable);
-            }
-        }
+        uint32_t value = batch->key4[i];
+        ports->counters[value].packets += batch->counters4[i].packets;
+        ports->counters[value].bytes += batch->counters4[i].bytes;
+        ports->used[value / 64] |= (uint64_t) 1 << (value % 64);
+        if (ports->peers != NULL)
+            addPeer(&(ports->peers[value]), batch->peer4[i]);
     }
-    free(oldDataStruct);
 }
 
-uint32_t hashFunction(const uint32_t input, uint32_t tableSize)
+struct t_portTable *initPortTable(void)
 {
-    return ((uint32_t) (input * 2654435761) % tableSize);
+    /* Zeroed counters and bitmap are all the initialization needed */
+    return calloc(1, sizeof (struct t_portTable));
 }
 
-uint32_t hashFunction6(const struct in6_addr input, uint32_t tableSize)
+void finishPortTable(struct t_portTable *ports)
 {
-    return ((uint32_t) (input.s6_addr32[0] +
-                        input.s6_addr32[1] +
-                        input.s6_addr32[2] +
-                        input.s6_addr32[3] *
-                        2654435761) % tableSize);
-}
-
-void initHashTable(struct t_hashTable *hashTable, uint32_t tableSize)
-{
-    hashTable->data = malloc(sizeof (struct t_dataStruct) * tableSize);
-    hashTable->size = tableSize;
-    hashTable->count = 0;
-    hashTable->limit = 0.8 * tableSize;
-
     uint32_t i;
-    for (i = 0; i < tableSize; i++)
+    for (i = 0; ports != NULL && ports->peers != NULL && i < EN_PORT_COUNT; i++)
     {
-        hashTable->data[i].used = 0;
+        finishPeers(ports->peers[i]);
     }
+    if (ports != NULL)
+        free(ports->peers);
+    free(ports);
 }
 
-void finishHashTable(struct t_hashTable *hashTable)
+void mergePortTable(struct t_portTable *result, struct t_portTable *source, uint32_t from, uint32_t to)
 {
-    if (hashTable != NULL)
+    /* Ports are processed by whole bitmap words */
+    uint32_t w;
+    for (w = from / 64; w < to / 64; w++)
     {
-        free(hashTable->data);
-        free(hashTable);
+        uint64_t used = source->used[w];
+        result->used[w] |= used;
+
+        while (used)
+        {
+            uint32_t value = w * 64 + __builtin_ctzll(used);
+            result->counters[value].packets += source->counters[value].packets;
+            result->counters[value].bytes += source->counters[value].bytes;
+            if (result->peers != NULL)
+                mergePeers(&(result->peers[value]), getPeersAt(source->peers, value));
+            used &= used - 1;
+        }
     }
 }
 
@@ -511,238 +504,1892 @@ struct in6_addr maskIPv6(struct in6_addr* addr, int mask)
     return result;
 }
 
-int compareSortStruct(const void * a, const void * b)
+uint32_t getAggregationCount(struct t_aggregation *aggregation)
 {
-    if (((struct t_sortStruct*) a)->value < ((struct t_sortStruct*) b)->value)
-        return 1;
-    else if (((struct t_sortStruct*) a)->value == ((struct t_sortStruct*) b)->value)
-        return 0;
-    else
-        return -1;
-}
+    uint32_t count = 0;
+    uint32_t p, w;
 
-int sortHashArray(struct t_sortStruct *hashArray, struct t_hashTable *hashTable, int sortkey)
-{
-    /* Fill the internal sort structure */
-    uint32_t n = 0;
-    uint32_t i;
-    for (i = 0; i < hashTable->size; i++)
+    if (aggregation->summary != NULL)
+        return aggregation->summary->count;
+
+    if (aggregation->ports != NULL)
     {
-        if (hashTable->data[i].used)
+        for (w = 0; w < EN_PORT_COUNT / 64; w++)
         {
-            if (sortkey == EN_SORT_BYTES)
-                hashArray[n].value = hashTable->data[i].bytes;
-            else
-                hashArray[n].value = hashTable->data[i].packets;
-
-            hashArray[n].key = i;
-            n++;
+            count += __builtin_popcountll(aggregation->ports->used[w]);
         }
     }
 
-    /* Sort internal sort structure */
-    qsort(hashArray, n, sizeof (struct t_sortStruct), compareSortStruct);
+    for (p = 0; p < aggregation->parts; p++)
+    {
+        if (aggregation->ip4 != NULL)
+            count += aggregation->ip4[p].count;
+        if (aggregation->ip6 != NULL)
+            count += aggregation->ip6[p].count;
+        if (aggregation->tuples != NULL)
+            count += aggregation->tuples[p].count;
+    }
 
-    return n;
+    return count;
 }
 
-int processDirectory(char *directory, struct t_hashTable *hashTable, int aggkey, int mask)
+/* Slots of all tables of an aggregation, their share in use is the load factor */
+uint64_t getAggregationCapacity(struct t_aggregation *aggregation)
 {
-    DIR *dir;
-    struct dirent *ent;
-    if ((dir = opendir(directory)) != NULL)
-    {
-        while ((ent = readdir(dir)) != NULL)
-        {
-            /* Skip special unix files . and .. */
-            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
-                continue;
+    uint64_t capacity = 0;
+    uint32_t p;
 
-            /* Get file name */
-            char * file = malloc(strlen(ent->d_name) + strlen(directory) + 1 + 1);
-            strcpy(file, directory);
-            strcat(file, "/");
-            strcat(file, ent->d_name);
+    if (aggregation->summary != NULL)
+        return aggregation->summary->capacity;
+    if (aggregation->ports != NULL)
+        return EN_PORT_COUNT;
 
-            if (ent->d_type != DT_DIR)
-            {
-                /* Start to parse file by chosen aggregation */
-                FILE *fp = fopen(file, "rb");
-                struct flow fl;
-                size_t n = 0;
-
-                if (aggkey == EN_AGG_SRCIP ||
-                    aggkey == EN_AGG_DSTIP ||
-                    aggkey == EN_AGG_SRCIP4 ||
-                    aggkey == EN_AGG_DSTIP4 ||
-                    aggkey == EN_AGG_SRCIP6 ||
-                    aggkey == EN_AGG_DSTIP6)
-                {
-                    while ((n = fread(&fl, sizeof (struct flow), 1, fp)) != 0)
-                    {
-                        addRecordIP(&fl, aggkey, mask, hashTable);
-                    }
-                }
-                else
-                {
-                    while ((n = fread(&fl, sizeof (struct flow), 1, fp)) != 0)
-                    {
-                        addRecordPort(&fl, aggkey, hashTable);
-                    }
-                }
+    for (p = 0; p < aggregation->parts; p++)
+    {
+        if (aggregation->ip4 != NULL)
+            capacity += aggregation->ip4[p].capacity;
+        if (aggregation->ip6 != NULL)
+            capacity += aggregation->ip6[p].capacity;
+        if (aggregation->tuples != NULL)
+            capacity += aggregation->tuples[p].capacity;
+    }
 
-                /* Close the file */
-                fclose(fp);
+    return capacity;
+}
 
-                /* Free the file name */
-                free(file);
-            }
-            else
-            {
-                /* Recursively process directory */
-                if (processDirectory(file, hashTable, aggkey, mask) != 0)
-                {
-                    closedir(dir);
-                    return 1;
-                }
-                free(file);
-            }
-        }
-        closedir(dir);
-    }
-    else
+int isAggregationFailed(const struct t_aggregation *aggregation)
+{
+    uint32_t p;
+    int failed = 0;
+    for (p = 0; p < aggregation->parts; p++)
     {
-        /* Unable to open directory */
-        printError("Unable to open given directory!");
-        return 1;
+        failed |= aggregation->ip4 != NULL && aggregation->ip4[p].failed;
+        failed |= aggregation->ip6 != NULL && aggregation->ip6[p].failed;
+        failed |= aggregation->tuples != NULL && aggregation->tuples[p].failed;
     }
-
-    return 0;
+    return failed;
 }
 
-int main(int argc, char *argv[])
+/* Value a key is sorted by, peers are estimated only if they are the sort key */
+static inline uint64_t getSortValue(int sortkey, uint64_t packets, uint64_t bytes, struct t_peers * const *peers, uint32_t i)
 {
-    char *directory;
-    int sortkey;
-    int aggkey;
-    int mask = 0;
-    struct t_hashTable *hashTable = malloc(sizeof (struct t_hashTable));
+    if (sortkey == EN_SORT_PEERS)
+        return estimatePeers(getPeersAt(peers, i));
+    return sortkey == EN_SORT_BYTES ? bytes : packets;
+}
 
-    if (argc == 2 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0))
+void sortAggregation(struct t_sortArray *array, struct t_aggregation *aggregation, int sortkey, int threads)
+{
+    /*
+     * Fill the internal sort structure. A key is the port number for ports,
+     * otherwise an index into all IPv4, IPv6 and composite slots in a row.
+     * Rank breaks ties of equal values by the port or the address, by the
+     * first field of composite keys.
+     */
+    uint32_t base = 0;
+    uint32_t p, i;
+
+    /* IPv6 rank covers only a part of the address, composite only a field */
+    if (aggregation->ip6 != NULL || aggregation->tuples != NULL || aggregation->summary != NULL)
     {
-        /* Help requested */
-        printHelp(argv[0]);
-        return (EXIT_SUCCESS);
+        array->tie = compareAggregationKeys;
+        array->tieData = aggregation;
     }
-    else if (argc == 7 && strcmp(argv[1], "-f") == 0 && strcmp(argv[3], "-a") == 0 && strcmp(argv[5], "-s") == 0)
-    {
-        /* Correct parameters */
-        directory = argv[2]; /* Will be checked by openning */
 
-        /* Check aggkey */
-        if ((aggkey = parseAggKey(argv[4], &mask)) == EN_ERROR)
+    /* Keys of approximate aggregation are indexes of the tracked entries */
+    if (aggregation->summary != NULL)
+    {
+        struct t_summary *summary = aggregation->summary;
+        for (i = 0; i < summary->count; i++)
         {
-            printError("Invalid aggregation key!");
-            printHelp(argv[0]);
-            return (EXIT_FAILURE);
-        }
+            struct t_summaryEntry *entry = &(summary->entries[i]);
+            uint32_t rank;
+            if (summary->tuples)
+                rank = getTupleRank(&(entry->key), &(aggregation->spec));
+            else
+                rank = ntohl(entry->key.family == 4 ? entry->key.src.s6_addr32[3] : entry->key.src.s6_addr32[0]);
 
-        /* Check sortkey */
-        if ((sortkey = parseSortKey(argv[6])) == EN_ERROR)
-        {
-            printError("Invalid sort key!");
-            printHelp(argv[0]);
-            return (EXIT_FAILURE);
+            if (sortkey == EN_SORT_BYTES)
+                pushSortArray(array, entry->bytes, i, rank);
+            else
+                pushSortArray(array, entry->packets, i, rank);
         }
     }
-    else
+
+    if (aggregation->ports != NULL)
     {
-        /* Invalid parameters! */
-        printError("Invalid parameters!");
-        printHelp(argv[0]);
-        return (EXIT_FAILURE);
+        struct t_portTable *ports = aggregation->ports;
+        for (i = 0; i < EN_PORT_COUNT / 64; i++)
+        {
+            uint64_t used = ports->used[i];
+            while (used)
+            {
+                uint32_t value = i * 64 + __builtin_ctzll(used);
+                pushSortArray(array, getSortValue(sortkey, ports->counters[value].packets, ports->counters[value].bytes, ports->peers, value), value, value);
+                used &= used - 1;
+            }
+        }
     }
 
-    /* Initialize has tables */
-    if (aggkey == EN_AGG_SRCIP ||
-        aggkey == EN_AGG_DSTIP ||
-        aggkey == EN_AGG_SRCIP4 ||
-        aggkey == EN_AGG_DSTIP4 ||
-        aggkey == EN_AGG_SRCIP6 ||
-        aggkey == EN_AGG_DSTIP6)
+    for (p = 0; aggregation->ip4 != NULL && p < aggregation->parts; p++)
     {
-        /* Initialize hash table for IP based data structure */
-        initHashTable(hashTable, EN_HASH_INIT_IP);
+        struct t_ip4Table *table = &(aggregation->ip4[p]);
+        for (i = 0; i < table->capacity; i++)
+        {
+            if (table->tags[i] != EN_TAG_EMPTY)
+            {
+                uint64_t value = getSortValue(sortkey, table->slots[i].packets, table->slots[i].bytes, table->peers, i);
+                pushSortArray(array, value, base + i, ntohl(table->slots[i].key));
+            }
+        }
+        base += table->capacity;
     }
-    else
+
+    for (p = 0; aggregation->ip6 != NULL && p < aggregation->parts; p++)
     {
-        /* Initialize hash table for port based data structure */
-        initHashTable(hashTable, EN_HASH_INIT_PORT);
+        struct t_ip6Table *table = &(aggregation->ip6[p]);
+        for (i = 0; i < table->capacity; i++)
+        {
+            if (table->tags[i] != EN_TAG_EMPTY)
+            {
+                uint64_t value = getSortValue(sortkey, table->slots[i].packets, table->slots[i].bytes, table->peers, i);
+                pushSortArray(array, value, base + i, ntohl(table->slots[i].key.s6_addr32[0]));
+            }
+        }
+        base += table->capacity;
     }
 
-    /* Process given directory recursively */
-    if (processDirectory(directory, hashTable, aggkey, mask) != 0)
+    for (p = 0; aggregation->tuples != NULL && p < aggregation->parts; p++)
     {
-        /* Free the hash tables */
-        finishHashTable(hashTable);
-        printf("pip");
-        return (EXIT_FAILURE);
+        struct t_tupleTable *table = &(aggregation->tuples[p]);
+        for (i = 0; i < table->capacity; i++)
+        {
+            if (table->tags[i] != EN_TAG_EMPTY)
+            {
+                uint32_t rank = getTupleRank(&(table->slots[i].key), &(aggregation->spec));
+                pushSortArray(array, getSortValue(sortkey, table->slots[i].packets, table->slots[i].bytes, table->peers, i), base + i, rank);
+            }
+        }
+        base += table->capacity;
+    }
+
+    /* Sort internal sort structure */
+    sortSortArray(array, threads);
+}
+
+uint32_t getTupleRank(const struct t_tupleKey *key, const struct t_tupleSpec *spec)
+{
+    /* Ports, IPv4 addresses or the first word of IPv6 ones in host order */
+    const struct in6_addr *addr;
+    switch (spec->fields[0])
+    {
+    case EN_FIELD_SRCPORT:
+        return key->srcPort;
+    case EN_FIELD_DSTPORT:
+        return key->dstPort;
+    case EN_FIELD_SRCIP:
+        addr = &(key->src);
+        break;
+    default:
+        addr = &(key->dst);
+        break;
+    }
+
+    return ntohl(key->family == 4 ? addr->s6_addr32[3] : addr->s6_addr32[0]);
+}
+
+int compareTupleKeys(const struct t_tupleKey *a, const struct t_tupleKey *b, const struct t_tupleSpec *spec)
+{
+    /* IPv4 before IPv6, then fields in the order of columns */
+    if (a->family != b->family)
+        return (int) a->family - (int) b->family;
+
+    int i, result = 0;
+    for (i = 0; i < spec->count && result == 0; i++)
+    {
+        switch (spec->fields[i])
+        {
+        case EN_FIELD_SRCIP:
+            result = memcmp(&(a->src), &(b->src), sizeof (struct in6_addr));
+            break;
+        case EN_FIELD_DSTIP:
+            result = memcmp(&(a->dst), &(b->dst), sizeof (struct in6_addr));
+            break;
+        case EN_FIELD_SRCPORT:
+            result = (int) a->srcPort - (int) b->srcPort;
+            break;
+        case EN_FIELD_DSTPORT:
+            result = (int) a->dstPort - (int) b->dstPort;
+            break;
+        }
+    }
+    return result;
+}
+
+int compareAggregationKeys(uint32_t keyA, uint32_t keyB, void *data)
+{
+    /* Keys of equal rank: IPv4 before IPv6, IPv6 by the whole address */
+    struct t_dataStruct a, b;
+    getAggregationEntry(data, keyA, &a);
+    getAggregationEntry(data, keyB, &b);
+
+    if (a.used != b.used)
+        return a.used - b.used;
+    if (a.used == EN_DATA_IP6)
+        return memcmp(&(a.addr6), &(b.addr6), sizeof (struct in6_addr));
+    if (a.used == EN_DATA_TUPLE)
+        return compareTupleKeys(&(a.tupleKey), &(b.tupleKey), a.spec);
+    return 0;
+}
+
+void getAggregationEntry(struct t_aggregation *aggregation, uint32_t key, struct t_dataStruct *d)
+{
+    uint32_t p;
+
+    d->used = EN_DATA_UNUSED;
+    d->approximate = 0;
+    d->counted = aggregation->peers;
+    if (aggregation->summary != NULL)
+    {
+        struct t_summaryEntry *entry = &(aggregation->summary->entries[key]);
+        if (aggregation->summary->tuples)
+        {
+            d->tupleKey = entry->key;
+            d->spec = &(aggregation->spec);
+            d->used = EN_DATA_TUPLE;
+        }
+        else if (entry->key.family == 4)
+        {
+            d->addr4 = entry->key.src.s6_addr32[3];
+            d->used = EN_DATA_IP4;
+        }
+        else
+        {
+            d->addr6 = entry->key.src;
+            d->used = EN_DATA_IP6;
+        }
+        d->packets = entry->packets;
+        d->bytes = entry->bytes;
+        d->error = entry->error;
+        d->approximate = 1;
+        return;
+    }
+
+    if (aggregation->ports != NULL)
+    {
+        d->port = key;
+        d->packets = aggregation->ports->counters[key].packets;
+        d->bytes = aggregation->ports->counters[key].bytes;
+        d->peers = estimatePeers(getPeersAt(aggregation->ports->peers, key));
+        d->used = EN_DATA_PORT;
+        return;
+    }
+
+    for (p = 0; aggregation->ip4 != NULL && p < aggregation->parts; p++)
+    {
+        struct t_ip4Table *table = &(aggregation->ip4[p]);
+        if (key < table->capacity)
+        {
+            d->addr4 = table->slots[key].key;
+            d->packets = table->slots[key].packets;
+            d->bytes = table->slots[key].bytes;
+            d->peers = estimatePeers(getPeersAt(table->peers, key));
+            d->used = EN_DATA_IP4;
+            return;
+        }
+        key -= table->capacity;
+    }
+
+    for (p = 0; aggregation->ip6 != NULL && p < aggregation->parts; p++)
+    {
+        struct t_ip6Table *table = &(aggregation->ip6[p]);
+        if (key < table->capacity)
+        {
+            d->addr6 = table->slots[key].key;
+            d->packets = table->slots[key].packets;
+            d->bytes = table->slots[key].bytes;
+            d->peers = estimatePeers(getPeersAt(table->peers, key));
+            d->used = EN_DATA_IP6;
+            return;
+        }
+        key -= table->capacity;
+    }
+
+    for (p = 0; aggregation->tuples != NULL && p < aggregation->parts; p++)
+    {
+        struct t_tupleTable *table = &(aggregation->tuples[p]);
+        if (key < table->capacity)
+        {
+            d->tupleKey = table->slots[key].key;
+            d->spec = &(aggregation->spec);
+            d->packets = table->slots[key].packets;
+            d->bytes = table->slots[key].bytes;
+            d->peers = estimatePeers(getPeersAt(table->peers, key));
+            d->used = EN_DATA_TUPLE;
+            return;
+        }
+        key -= table->capacity;
+    }
+}
+
+void processFlows(const struct flow *fl, size_t count, void *data)
+{
+    struct t_aggContext *ctx = data;
+    size_t i;
+    int r;
+
+    /* Records are decoded and added by batches, every report reads the batch while it is cached */
+    for (i = 0; i < count; i += EN_DECODE_BATCH)
+    {
+        const struct flow *block = &fl[i];
+        size_t n = count - i < EN_DECODE_BATCH ? count - i : EN_DECODE_BATCH;
+
+        /* Rejected records are dropped before the decode, so they never reach the tables */
+        if (ctx->filter != NULL)
+        {
+            n = filterFlows(block, n, ctx->filter, ctx->accepted);
+            block = ctx->accepted;
+            if (n == 0)
+                continue;
+        }
+
+        for (r = 0; r < ctx->count; r++)
+        {
+            struct t_aggregation *aggregation = &(ctx->aggregations[r]);
+            decodeFlows(block, n, &(ctx->decoders[r]), ctx->batch);
+
+            /* Tables which could outgrow the memory limit by the batch are spilled and emptied first */
+            if (ctx->spills != NULL && ctx->spills[r] != NULL && isAggregationFull(aggregation, ctx->budget))
+                spillAggregation(ctx->spills[r], aggregation);
+
+            if (aggregation->summary != NULL)
+                addBatchSummary(ctx->batch, &(ctx->decoders[r]), aggregation->summary);
+            if (aggregation->ports != NULL)
+                addBatchPort(ctx->batch, aggregation->ports);
+            if (aggregation->ip4 != NULL)
+                addBatchIP4(ctx->batch, aggregation->ip4);
+            if (aggregation->ip6 != NULL)
+                addBatchIP6(ctx->batch, aggregation->ip6);
+            if (aggregation->tuples != NULL)
+                addBatchTuple(ctx->batch, aggregation->tuples);
+        }
+    }
+}
+
+int prepareWork(struct t_work *work, struct t_fileList *files, int threads)
+{
+    /* Split large files only if there is somebody to share them with */
+    off_t chunk = (EN_CHUNK_SIZE / sizeof (struct flow)) * sizeof (struct flow);
+    size_t count = 0;
+    size_t i;
+
+    for (i = 0; i < files->count; i++)
+    {
+        struct t_inputFile *file = &(files->files[i]);
+        off_t end = file->length < 0 ? file->size : file->offset + file->length;
+        if (threads > 1 && file->regular && !file->compressed && end - file->offset > chunk)
+            count += (end - file->offset + chunk - 1) / chunk;
+        else
+            count++;
+    }
+
+    work->units = malloc(count * sizeof (struct t_workUnit) + 1);
+    if (work->units == NULL)
+        return 1;
+
+    work->count = 0;
+    work->next = 0;
+    work->failed = 0;
+
+    for (i = 0; i < files->count; i++)
+    {
+        struct t_inputFile *file = &(files->files[i]);
+        off_t end = file->length < 0 ? file->size : file->offset + file->length;
+        if (threads > 1 && file->regular && !file->compressed && end - file->offset > chunk)
+        {
+            off_t offset;
+            for (offset = file->offset; offset < end; offset += chunk)
+            {
+                work->units[work->count].file = file->name;
+                work->units[work->count].source = file;
+                work->units[work->count].offset = offset;
+                /* The last range reads up to the current end of file, unless the file is bounded */
+                if (offset + chunk < end)
+                    work->units[work->count].length = chunk;
+                else
+                    work->units[work->count].length = file->length < 0 ? -1 : end - offset;
+                work->count++;
+            }
+        }
+        else
+        {
+            work->units[work->count].file = file->name;
+            work->units[work->count].source = file;
+            work->units[work->count].offset = file->offset;
+            work->units[work->count].length = file->length;
+            work->count++;
+        }
+    }
+
+    return 0;
+}
+
+void *aggregateWorker(void *arg)
+{
+    struct t_worker *worker = arg;
+    struct t_work *work = worker->work;
+    struct t_aggContext ctx;
+    struct t_decoder decoders[EN_MAX_REPORTS];
+    int r;
+    for (r = 0; r < work->nreports; r++)
+    {
+        initDecoder(&decoders[r], work->reports[r].aggkey, work->reports[r].mask, &(work->reports[r].spec), work->reports[r].peers);
+    }
+    ctx.aggregations = worker->aggregations;
+    ctx.decoders = decoders;
+    ctx.count = work->nreports;
+    ctx.batch = malloc(sizeof (struct t_decodeBatch));
+    ctx.filter = work->filter;
+    ctx.accepted = work->filter != NULL ? malloc(EN_DECODE_BATCH * sizeof (struct flow)) : NULL;
+    ctx.spills = work->spills;
+    ctx.budget = work->budget;
+    if (ctx.batch == NULL || (work->filter != NULL && ctx.accepted == NULL))
+    {
+        free(ctx.batch);
+        free(ctx.accepted);
+        work->failed = 1;
+        return NULL;
+    }
+
+    /* Take work units one by one until there is nothing left */
+    size_t i;
+    while (!work->failed && (i = __sync_fetch_and_add(&(work->next), 1)) < work->count)
+    {
+        struct t_workUnit *unit = &(work->units[i]);
+        if (work->prefetch != NULL)
+            notifyPrefetch(work->prefetch);
+
+        if (work->cache != NULL)
+        {
+            if (aggregateCachedFile(worker, unit->source, decoders, ctx.batch) != 0)
+                work->failed = 1;
+        }
+        else if (readFlowRange(unit->file, unit->offset, unit->length, processFlows, &ctx) != 0)
+        {
+            work->failed = 1;
+        }
+    }
+
+    free(ctx.batch);
+    free(ctx.accepted);
+
+    /* Tables are read by other threads from now on, finish their growth */
+    for (r = 0; r < ctx.count; r++)
+    {
+        settleAggregation(&(ctx.aggregations[r]));
+    }
+
+    collectCounters();
+    return NULL;
+}
+
+int aggregateCachedFile(struct t_worker *worker, const struct t_inputFile *file, struct t_decoder *decoders, struct t_decodeBatch *batch)
+{
+    struct t_work *work = worker->work;
+    struct t_aggregation partials[EN_MAX_REPORTS];
+    struct t_decoder missingDecoders[EN_MAX_REPORTS];
+    int missing[EN_MAX_REPORTS];
+    char *paths[EN_MAX_REPORTS];
+    int nmissing = 0;
+    int result = 0;
+    int r, i;
+
+    /* Partials stored for the current version of the file are added right away */
+    for (r = 0; r < work->nreports; r++)
+    {
+        paths[r] = getPartialFile(work->cache, file, work->reports[r].key);
+        if (loadPartial(paths[r], file, &(work->reports[r]), &(worker->aggregations[r])) != 0)
+        {
+            if (initAggregation(&partials[nmissing], work->reports[r].aggkey, &(work->reports[r].spec), 1, EN_TABLE_INIT) != 0 &&
+                result == 0)
+            {
+                printError("Unable to allocate aggregation tables!");
+                result = 1;
+            }
+            missingDecoders[nmissing] = decoders[r];
+            missing[nmissing++] = r;
+        }
+    }
+
+    /* The file is read only for the keys without a partial, which are stored then */
+    if (nmissing > 0)
+    {
+        struct t_aggContext ctx;
+        ctx.aggregations = partials;
+        ctx.decoders = missingDecoders;
+        ctx.count = nmissing;
+        ctx.batch = batch;
+        ctx.filter = NULL; //partials are stored for all records
+        ctx.accepted = NULL;
+        ctx.spills = NULL;
+        ctx.budget = 0;
+        if (result == 0)
+            result = readFlowRange(file->name, file->offset, file->length, processFlows, &ctx);
+
+        for (i = 0; i < nmissing; i++)
+        {
+            settleAggregation(&partials[i]);
+            if (isAggregationFailed(&partials[i]) && result == 0)
+            {
+                printError("Tables of the aggregation cannot grow, keys would be lost!");
+                result = 1;
+            }
+            if (result == 0)
+            {
+                storePartial(paths[missing[i]], file, &(work->reports[missing[i]]), &partials[i]);
+                addAggregation(&(worker->aggregations[missing[i]]), &partials[i]);
+            }
+            finishAggregation(&partials[i]);
+        }
+    }
+
+    for (r = 0; r < work->nreports; r++)
+    {
+        free(paths[r]);
+    }
+    return result;
+}
+
+void *mergeWorker(void *arg)
+{
+    struct t_mergeJob *job = arg;
+    struct t_aggregation *result = job->result;
+    int t;
+
+    /* Every partition is owned by a single thread, so no locking is needed */
+    if (result->ports != NULL)
+    {
+        /* Ports are summed into the table of the first worker by port ranges */
+        uint32_t from = (uint32_t) ((uint64_t) EN_PORT_COUNT * job->part / job->parts) & ~63u;
+        uint32_t to = (uint32_t) ((uint64_t) EN_PORT_COUNT * (job->part + 1) / job->parts) & ~63u;
+        if (job->part + 1 == job->parts)
+            to = EN_PORT_COUNT;
+
+        for (t = 1; t < job->nworkers; t++)
+        {
+            mergePortTable(result->ports, job->workers[t].aggregations[job->report].ports, from, to);
+        }
+        collectCounters();
+        return NULL;
+    }
+
+    for (t = 0; t < job->nworkers; t++)
+    {
+        struct t_aggregation *source = &(job->workers[t].aggregations[job->report]);
+        if (result->ip4 != NULL)
+            mergeIP4Table(&(result->ip4[job->part]), &(source->ip4[0]), job->part, job->parts);
+        if (result->ip6 != NULL)
+            mergeIP6Table(&(result->ip6[job->part]), &(source->ip6[0]), job->part, job->parts);
+        if (result->tuples != NULL)
+            mergeTupleTable(&(result->tuples[job->part]), &(source->tuples[0]), job->part, job->parts);
+    }
+
+    collectCounters();
+    return NULL;
+}
+
+int initAggregation(struct t_aggregation *aggregation, int aggkey, const struct t_tupleSpec *spec, uint32_t parts, uint32_t capacity)
+{
+    uint32_t p;
+    int result = 0;
+
+    aggregation->parts = parts;
+    aggregation->ip4 = NULL;
+    aggregation->ip6 = NULL;
+    aggregation->tuples = NULL;
+    aggregation->ports = NULL;
+    aggregation->summary = NULL;
+    aggregation->peers = 0;
+
+    /* Composite keys of both families share a single table */
+    if (aggkey == EN_AGG_TUPLE)
+    {
+        aggregation->spec = *spec;
+        aggregation->tuples = malloc(parts * sizeof (struct t_tupleTable));
+        for (p = 0; aggregation->tuples != NULL && p < parts; p++)
+        {
+            result |= initTupleTable(&(aggregation->tuples[p]), capacity);
+        }
+        result |= aggregation->tuples == NULL;
+    }
+
+    /* Only tables of address families used by the aggregation key */
+    else if (aggkey == EN_AGG_SRCPORT || aggkey == EN_AGG_DSTPORT)
+    {
+        aggregation->ports = initPortTable();
+        result = aggregation->ports == NULL;
+    }
+
+    else
+    {
+        if (aggkey != EN_AGG_SRCIP6 && aggkey != EN_AGG_DSTIP6)
+        {
+            aggregation->ip4 = malloc(parts * sizeof (struct t_ip4Table));
+            for (p = 0; aggregation->ip4 != NULL && p < parts; p++)
+            {
+                result |= initIP4Table(&(aggregation->ip4[p]), capacity);
+            }
+            result |= aggregation->ip4 == NULL;
+        }
+
+        if (aggkey != EN_AGG_SRCIP4 && aggkey != EN_AGG_DSTIP4)
+        {
+            aggregation->ip6 = malloc(parts * sizeof (struct t_ip6Table));
+            for (p = 0; aggregation->ip6 != NULL && p < parts; p++)
+            {
+                result |= initIP6Table(&(aggregation->ip6[p]), capacity);
+            }
+            result |= aggregation->ip6 == NULL;
+        }
+    }
+
+    /* Tables which failed to allocate are empty, all of them are released */
+    if (result != 0)
+        finishAggregation(aggregation);
+    return result;
+}
+
+int initApproxAggregation(struct t_aggregation *aggregation, struct t_report *report)
+{
+    /* No tables, a fixed number of counters only */
+    aggregation->parts = 1;
+    aggregation->ip4 = NULL;
+    aggregation->ip6 = NULL;
+    aggregation->tuples = NULL;
+    aggregation->ports = NULL;
+    aggregation->spec = report->spec;
+    aggregation->peers = 0;
+
+    aggregation->summary = initSummary(report->approx, report->sortkey == EN_SORT_BYTES, report->aggkey == EN_AGG_TUPLE);
+    return aggregation->summary == NULL ? 1 : 0;
+}
+
+int countPeersAggregation(struct t_aggregation *aggregation)
+{
+    uint32_t p;
+    int result = 0;
+    aggregation->peers = 1;
+    for (p = 0; aggregation->ip4 != NULL && p < aggregation->parts; p++)
+    {
+        result |= countPeersIP4Table(&(aggregation->ip4[p]));
+    }
+    for (p = 0; aggregation->ip6 != NULL && p < aggregation->parts; p++)
+    {
+        result |= countPeersIP6Table(&(aggregation->ip6[p]));
+    }
+    for (p = 0; aggregation->tuples != NULL && p < aggregation->parts; p++)
+    {
+        result |= countPeersTupleTable(&(aggregation->tuples[p]));
+    }
+    if (aggregation->ports != NULL && aggregation->ports->peers == NULL)
+    {
+        aggregation->ports->peers = calloc(EN_PORT_COUNT, sizeof (struct t_peers *));
+        result |= aggregation->ports->peers == NULL;
+    }
+    return result;
+}
+
+void settleAggregation(struct t_aggregation *aggregation)
+{
+    uint32_t p;
+    for (p = 0; aggregation->ip4 != NULL && p < aggregation->parts; p++)
+    {
+        settleIP4Table(&(aggregation->ip4[p]));
+    }
+    for (p = 0; aggregation->ip6 != NULL && p < aggregation->parts; p++)
+    {
+        settleIP6Table(&(aggregation->ip6[p]));
+    }
+    for (p = 0; aggregation->tuples != NULL && p < aggregation->parts; p++)
+    {
+        settleTupleTable(&(aggregation->tuples[p]));
+    }
+}
+
+void finishAggregation(struct t_aggregation *aggregation)
+{
+    uint32_t p;
+    for (p = 0; aggregation->ip4 != NULL && p < aggregation->parts; p++)
+    {
+        finishIP4Table(&(aggregation->ip4[p]));
+    }
+    for (p = 0; aggregation->ip6 != NULL && p < aggregation->parts; p++)
+    {
+        finishIP6Table(&(aggregation->ip6[p]));
+    }
+    for (p = 0; aggregation->tuples != NULL && p < aggregation->parts; p++)
+    {
+        finishTupleTable(&(aggregation->tuples[p]));
+    }
+    free(aggregation->ip4);
+    free(aggregation->ip6);
+    free(aggregation->tuples);
+    finishPortTable(aggregation->ports);
+    finishSummary(aggregation->summary);
+    aggregation->ip4 = NULL;
+    aggregation->ip6 = NULL;
+    aggregation->tuples = NULL;
+    aggregation->ports = NULL;
+    aggregation->summary = NULL;
+}
+
+int mergeAggregations(struct t_worker *workers, int threads, int report, int aggkey, struct t_aggregation *result)
+{
+    int i;
+
+    if (workers[0].aggregations[report].summary != NULL)
+    {
+        /* Summaries are merged one by one into the one of the first worker */
+        *result = workers[0].aggregations[report];
+        for (i = 1; i < threads; i++)
+        {
+            if (mergeSummary(result->summary, workers[i].aggregations[report].summary) != 0)
+                printError("Unable to merge approximate aggregations, keys of a worker are lost!");
+            finishAggregation(&(workers[i].aggregations[report]));
+        }
+        return 0;
+    }
+
+    if (aggkey == EN_AGG_SRCPORT || aggkey == EN_AGG_DSTPORT)
+    {
+        /* Port tables are summed into the table of the first worker */
+        result->parts = 1;
+        result->ip4 = NULL;
+        result->ip6 = NULL;
+        result->tuples = NULL;
+        result->ports = workers[0].aggregations[report].ports;
+        result->peers = workers[0].aggregations[report].peers;
+    }
+    else
+    {
+        /* Result tables are sized for the partition up front */
+        uint32_t total = 0;
+        for (i = 0; i < threads; i++)
+        {
+            total += getAggregationCount(&(workers[i].aggregations[report]));
+        }
+        int failed = initAggregation(result, aggkey, &(workers[0].aggregations[report].spec), threads, total / threads / 7 * 8);
+        if (failed == 0 && workers[0].aggregations[report].peers)
+            failed = countPeersAggregation(result);
+        if (failed != 0)
+        {
+            printError("Unable to allocate merged aggregation tables!");
+            finishAggregation(result);
+            for (i = 0; i < threads; i++)
+            {
+                finishAggregation(&(workers[i].aggregations[report]));
+            }
+            return 1;
+        }
+    }
+
+    /* Merge the private tables in parallel, partitioned by the key hash */
+    struct t_mergeJob *jobs = malloc(threads * sizeof (struct t_mergeJob));
+    int failed = (jobs == NULL);
+    int started = 0;
+    for (i = 0; !failed && i < threads; i++)
+    {
+        jobs[i].workers = workers;
+        jobs[i].nworkers = threads;
+        jobs[i].report = report;
+        jobs[i].part = i;
+        jobs[i].parts = threads;
+        jobs[i].result = result;
+        if (pthread_create(&(jobs[i].thread), NULL, mergeWorker, &jobs[i]) != 0)
+            failed = 1;
+        else
+            started++;
+    }
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(jobs[i].thread, NULL);
+    }
+    free(jobs);
+
+    /* The port table of the first worker lives on in the result */
+    workers[0].aggregations[report].ports = NULL;
+    if (failed)
+    {
+        printError("Unable to start merge threads!");
+        finishAggregation(result);
+    }
+    else
+        settleAggregation(result);
+    for (i = 0; i < threads; i++)
+    {
+        finishAggregation(&(workers[i].aggregations[report]));
+    }
+    return failed;
+}
+
+void addAggregation(struct t_aggregation *result, struct t_aggregation *source)
+{
+    /* Partitions of both aggregations are of the same hash ranges */
+    uint32_t p;
+    if (result->summary != NULL && mergeSummary(result->summary, source->summary) != 0)
+        printError("Unable to merge approximate aggregations, new keys are lost!");
+    if (result->ports != NULL)
+        mergePortTable(result->ports, source->ports, 0, EN_PORT_COUNT);
+    for (p = 0; result->ip4 != NULL && p < result->parts; p++)
+    {
+        mergeIP4Table(&(result->ip4[p]), &(source->ip4[p]), 0, 1);
+    }
+    for (p = 0; result->ip6 != NULL && p < result->parts; p++)
+    {
+        mergeIP6Table(&(result->ip6[p]), &(source->ip6[p]), 0, 1);
+    }
+    for (p = 0; result->tuples != NULL && p < result->parts; p++)
+    {
+        mergeTupleTable(&(result->tuples[p]), &(source->tuples[p]), 0, 1);
+    }
+}
+
+int rollupAggregation(struct t_aggregation *result, struct t_aggregation *source, int aggkey, int mask)
+{
+    /* Keys of the source are masked once more and summed by the coarser prefix */
+    int failed = initAggregation(result, aggkey, NULL, 1, getAggregationCount(source) / 7 * 8);
+    if (failed == 0 && source->peers)
+        failed = countPeersAggregation(result);
+    if (failed != 0)
+    {
+        printError("Unable to allocate rollup aggregation tables!");
+        finishAggregation(result);
+        return 1;
+    }
+
+    uint32_t p, i;
+    for (p = 0; source->ip4 != NULL && p < source->parts; p++)
+    {
+        struct t_ip4Table *table = &(source->ip4[p]);
+        for (i = 0; i < table->capacity; i++)
+        {
+            if (table->tags[i] != EN_TAG_EMPTY)
+            {
+                uint32_t key = table->slots[i].key & masks[mask];
+                struct t_peers **peers = addIP4Table(&(result->ip4[0]), &key, hashIP4(&key), table->slots[i].packets, table->slots[i].bytes);
+                mergePeers(peers, getPeersAt(table->peers, i));
+            }
+        }
+    }
+
+    for (p = 0; source->ip6 != NULL && p < source->parts; p++)
+    {
+        struct t_ip6Table *table = &(source->ip6[p]);
+        for (i = 0; i < table->capacity; i++)
+        {
+            if (table->tags[i] != EN_TAG_EMPTY)
+            {
+                struct in6_addr key = maskIPv6(&(table->slots[i].key), mask);
+                struct t_peers **peers = addIP6Table(&(result->ip6[0]), &key, hashIP6(&key), table->slots[i].packets, table->slots[i].bytes);
+                mergePeers(peers, getPeersAt(table->peers, i));
+            }
+        }
+    }
+
+    settleAggregation(result);
+    return 0;
+}
+
+uint32_t getPresizedCapacity(struct t_fileList *files, int aggkey, int mask, int threads)
+{
+    /* Every record may bring a new key at most */
+    uint64_t records = 0;
+    size_t i;
+    for (i = 0; i < files->count; i++)
+    {
+        records += files->files[i].size / sizeof (struct flow);
+    }
+    records = (records + threads - 1) / threads;
+
+    /* Masked keys cannot exceed the number of distinct prefixes */
+    if ((aggkey == EN_AGG_SRCIP4 || aggkey == EN_AGG_DSTIP4 ||
+        aggkey == EN_AGG_SRCIP6 || aggkey == EN_AGG_DSTIP6) && mask < 32 &&
+        records > ((uint64_t) 1 << mask))
+        records = (uint64_t) 1 << mask;
+
+    /* Keep the load under the growth limit */
+    uint64_t capacity = records / 7 * 8 + EN_TABLE_GROUP;
+    if (capacity < EN_TABLE_INIT)
+        return EN_TABLE_INIT;
+    if (capacity > EN_TABLE_MAX)
+        return EN_TABLE_MAX;
+    return (uint32_t) capacity;
+}
+
+/* Workers of given work with room for the aggregations of all reports, NULL if they cannot be allocated */
+struct t_worker *allocWorkers(struct t_work *work, int threads, int nreports)
+{
+    struct t_worker *workers = calloc(threads, sizeof (struct t_worker));
+    int i, failed = (workers == NULL);
+    for (i = 0; !failed && i < threads; i++)
+    {
+        workers[i].aggregations = malloc(nreports * sizeof (struct t_aggregation));
+        workers[i].work = work;
+        failed = (workers[i].aggregations == NULL);
+    }
+
+    if (failed)
+    {
+        printError("Unable to allocate workers!");
+        for (i = 0; workers != NULL && i < threads; i++)
+        {
+            free(workers[i].aggregations);
+        }
+        free(workers);
+        return NULL;
+    }
+    return workers;
+}
+
+/* Run the workers, in threads if there are more of them, a thread which does not start fails the work */
+void runWorkers(struct t_worker *workers, int threads, void *(*routine)(void *))
+{
+    if (threads == 1)
+    {
+        routine(&workers[0]);
+        return;
+    }
+
+    int i, started;
+    for (started = 0; started < threads; started++)
+    {
+        if (pthread_create(&(workers[started].thread), NULL, routine, &workers[started]) != 0)
+        {
+            printError("Unable to start worker threads!");
+            workers[0].work->failed = 1;
+            break;
+        }
+    }
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+}
+
+/* Merge private tables of the workers into the reports, or drop them if the aggregation failed */
+int collectWorkers(struct t_worker *workers, int threads, struct t_report *reports, int nreports, int failed)
+{
+    int i, r;
+    int lost = 0;
+
+    if (failed)
+    {
+        for (i = 0; i < threads; i++)
+        {
+            for (r = 0; r < nreports; r++)
+            {
+                finishAggregation(&(workers[i].aggregations[r]));
+            }
+            free(workers[i].aggregations);
+        }
+        free(workers);
+        return 1;
+    }
+
+    double start = getStatsTime();
+    for (r = 0; r < nreports; r++)
+    {
+        if (reports[r].spill != NULL && reports[r].spill->used)
+        {
+            /* Emptied tables of the first worker only describe the keys of the report */
+            reports[r].aggregation = workers[0].aggregations[r];
+            for (i = 1; i < threads; i++)
+            {
+                finishAggregation(&(workers[i].aggregations[r]));
+            }
+        }
+        else if (threads == 1)
+            reports[r].aggregation = workers[0].aggregations[r];
+        else if (mergeAggregations(workers, threads, r, reports[r].aggkey, &(reports[r].aggregation)) != 0)
+            failed = 1;
+        if (isAggregationFailed(&(reports[r].aggregation)))
+            lost = 1;
+    }
+    addPhaseTime(EN_PHASE_MERGE, start);
+
+    for (i = 0; i < threads; i++)
+    {
+        free(workers[i].aggregations);
+    }
+    free(workers);
+
+    /* Keys dropped by a table which could not grow would make the reports wrong */
+    if (lost)
+        printError("Tables of the aggregation cannot grow, keys would be lost!");
+    if (failed || lost)
+    {
+        for (r = 0; r < nreports; r++)
+        {
+            finishAggregation(&(reports[r].aggregation));
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/* Capacity of a table created for given keys, as the table rounds it up */
+static uint64_t getTableCapacity(uint32_t keys)
+{
+    uint64_t capacity = EN_TABLE_GROUP;
+    while (capacity < keys && capacity < EN_TABLE_MAX)
+    {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+/* Bytes of the tables of a report in all workers together with the tables mergeAggregations builds of them */
+static uint64_t getMergeBytes(struct t_worker *workers, int threads, int report)
+{
+    struct t_aggregation *first = &(workers[0].aggregations[report]);
+    uint64_t bytes = 0;
+    uint32_t total = 0;
+    int i;
+
+    for (i = 0; i < threads; i++)
+    {
+        struct t_aggregation *aggregation = &(workers[i].aggregations[report]);
+        if (aggregation->ip4 != NULL)
+            bytes += (uint64_t) aggregation->ip4->capacity * (1 + sizeof (struct t_ip4Slot));
+        if (aggregation->ip6 != NULL)
+            bytes += (uint64_t) aggregation->ip6->capacity * (1 + sizeof (struct t_ip6Slot));
+        if (aggregation->tuples != NULL)
+            bytes += (uint64_t) aggregation->tuples->capacity * (1 + sizeof (struct t_tupleSlot));
+        total += getAggregationCount(aggregation);
+    }
+
+    /* Every partition of the merged tables is sized for all the keys */
+    uint64_t capacity = getTableCapacity(total / threads / 7 * 8) * threads;
+    if (first->ip4 != NULL)
+        bytes += capacity * (1 + sizeof (struct t_ip4Slot));
+    if (first->ip6 != NULL)
+        bytes += capacity * (1 + sizeof (struct t_ip6Slot));
+    if (first->tuples != NULL)
+        bytes += capacity * (1 + sizeof (struct t_tupleSlot));
+    return bytes;
+}
+
+int aggregateFiles(struct t_fileList *files, struct t_report *reports, int nreports, int threads, char presize, char *cache,
+                   const struct t_filter *filter)
+{
+    struct t_work work;
+    work.reports = reports;
+    work.nreports = nreports;
+    work.cache = cache;
+    work.filter = filter;
+
+    /* Partials are kept per file, so cached files are never split */
+    if (prepareWork(&work, files, cache != NULL ? 1 : threads) != 0)
+    {
+        printError("Unable to allocate work units!");
+        return 1;
+    }
+
+    /* Every worker has private tables of all reports */
+    struct t_worker *workers = allocWorkers(&work, threads, nreports);
+    if (workers == NULL)
+    {
+        free(work.units);
+        return 1;
+    }
+    int i, r;
+    for (r = 0; r < nreports; r++)
+    {
+        uint32_t capacity = EN_TABLE_INIT;
+        if (presize)
+            capacity = getPresizedCapacity(files, reports[r].aggkey, reports[r].mask, threads);
+
+        for (i = 0; i < threads; i++)
+        {
+            /* Ports are counted exactly in a fixed table anyway */
+            if (reports[r].approx > 0 && reports[r].aggkey != EN_AGG_SRCPORT && reports[r].aggkey != EN_AGG_DSTPORT)
+            {
+                if (initApproxAggregation(&(workers[i].aggregations[r]), &reports[r]) != 0 && !work.failed)
+                {
+                    printError("Unable to allocate approximate aggregation!");
+                    work.failed = 1;
+                }
+            }
+            else
+            {
+                int result = initAggregation(&(workers[i].aggregations[r]), reports[r].aggkey, &(reports[r].spec), 1, capacity);
+                if (result == 0 && reports[r].peers)
+                    result = countPeersAggregation(&(workers[i].aggregations[r]));
+                if (result != 0 && !work.failed)
+                {
+                    printError("Unable to allocate aggregation tables!");
+                    work.failed = 1;
+                }
+            }
+        }
+    }
+
+    /* Memory limit is shared by the tables of all workers and spilled reports */
+    struct t_spill *spills[EN_MAX_REPORTS];
+    uint64_t tables = 0;
+    work.spills = NULL;
+    work.budget = 0;
+    for (r = 0; r < nreports; r++)
+    {
+        struct t_aggregation *aggregation = &(workers[0].aggregations[r]);
+        spills[r] = reports[r].spill;
+        if (spills[r] == NULL)
+            continue;
+        work.spills = spills;
+        tables += (aggregation->ip4 != NULL) + (aggregation->ip6 != NULL) + (aggregation->tuples != NULL);
+    }
+    if (tables > 0)
+        work.budget = reports[0].memLimit / threads / tables;
+
+    /* Following units are read into memory while the current ones are aggregated */
+    struct t_prefetch prefetch;
+    work.prefetch = NULL;
+    if (cache == NULL && work.count > (size_t) threads && startPrefetch(&prefetch, &work, threads) == 0)
+        work.prefetch = &prefetch;
+
+    /* Aggregate into private tables, all reports from a single pass over the files */
+    double start = getStatsTime();
+    runWorkers(workers, threads, aggregateWorker);
+
+    if (work.prefetch != NULL)
+        stopPrefetch(work.prefetch);
+    free(work.units);
+
+    /*
+     * Once a report spilled, the rest of its keys follows, it is built from
+     * the spill files. The merge holds the tables of the workers and the
+     * merged ones at once, so a report whose merge would exceed its share of
+     * the limit is spilled whole too.
+     */
+    for (r = 0; r < nreports && !work.failed; r++)
+    {
+        if (spills[r] == NULL)
+            continue;
+        struct t_aggregation *aggregation = &(workers[0].aggregations[r]);
+        uint64_t share = work.budget * threads *
+            ((aggregation->ip4 != NULL) + (aggregation->ip6 != NULL) + (aggregation->tuples != NULL));
+        if (!spills[r]->used && (threads == 1 || getMergeBytes(workers, threads, r) <= share))
+            continue;
+        for (i = 0; i < threads; i++)
+        {
+            spillAggregation(spills[r], &(workers[i].aggregations[r]));
+        }
+        if (spills[r]->failed)
+        {
+            printError("Unable to spill keys over the memory limit!");
+            work.failed = 1;
+        }
+    }
+    addPhaseTime(EN_PHASE_AGGREGATE, start);
+
+    return collectWorkers(workers, threads, reports, nreports, work.failed);
+}
+
+void *partialWorker(void *arg)
+{
+    struct t_worker *worker = arg;
+    struct t_work *work = worker->work;
+    int r;
+
+    /* Take partial files one by one until there is nothing left */
+    size_t i;
+    while (!work->failed && (i = __sync_fetch_and_add(&(work->next), 1)) < work->count)
+    {
+        if (mergePartial(work->units[i].file, work->reports, work->nreports, worker->aggregations) != 0)
+            work->failed = 1;
+    }
+
+    /* Tables are read by other threads from now on, finish their growth */
+    for (r = 0; r < work->nreports; r++)
+    {
+        settleAggregation(&(worker->aggregations[r]));
+    }
+
+    collectCounters();
+    return NULL;
+}
+
+int mergePartialFiles(char **paths, int count, struct t_report *reports, int nreports, int threads)
+{
+    struct t_work work;
+    work.units = malloc(count * sizeof (struct t_workUnit));
+    work.count = count;
+    work.next = 0;
+    work.failed = 0;
+    work.reports = reports;
+    work.nreports = nreports;
+    if (work.units == NULL)
+    {
+        printError("Unable to allocate work units!");
+        return 1;
+    }
+
+    int i, r;
+    for (i = 0; i < count; i++)
+    {
+        work.units[i].file = paths[i];
+    }
+
+    /* Every worker adds whole partials into private tables, as if it read the records */
+    if (threads > count)
+        threads = count;
+    struct t_worker *workers = allocWorkers(&work, threads, nreports);
+    if (workers == NULL)
+    {
+        free(work.units);
+        return 1;
+    }
+    for (i = 0; i < threads; i++)
+    {
+        for (r = 0; r < nreports; r++)
+        {
+            if (initAggregation(&(workers[i].aggregations[r]), reports[r].aggkey, &(reports[r].spec), 1, EN_TABLE_INIT) != 0 &&
+                !work.failed)
+            {
+                printError("Unable to allocate aggregation tables!");
+                work.failed = 1;
+            }
+        }
+    }
+
+    double start = getStatsTime();
+    runWorkers(workers, threads, partialWorker);
+    free(work.units);
+    addPhaseTime(EN_PHASE_AGGREGATE, start);
+
+    return collectWorkers(workers, threads, reports, nreports, work.failed);
+}
+
+int parseRollupKey(char *key, int *aggkey, int *rollupMasks)
+{
+    /* Rollup is a key of addresses with several masks, e.g. srcip4/8,16,24 */
+    char *p = strchr(key, '/');
+    if (p == NULL || strchr(p, ',') == NULL || strspn(p + 1, "0123456789,") != strlen(p + 1))
+        return 0;
+
+    char *tmpKey = strdup(key);
+    tmpKey[p - key] = '\0';
+
+    char single[32];
+    char *state;
+    char *value;
+    int count = 0;
+    for (value = strtok_r(tmpKey + (p - key) + 1, ",", &state); value != NULL; value = strtok_r(NULL, ",", &state))
+    {
+        int mask;
+        snprintf(single, sizeof (single), "%s/%s", tmpKey, value);
+        int result = parseAggKey(single, &mask);
+        if (result == EN_ERROR || count == EN_MAX_REPORTS)
+        {
+            count = EN_ERROR;
+            break;
+        }
+
+        *aggkey = result;
+        rollupMasks[count++] = mask;
+    }
+
+    free(tmpKey);
+    return count;
+}
+
+int findReport(char *key, struct t_report *reports, int nreports)
+{
+    int r;
+    for (r = 0; r < nreports; r++)
+    {
+        if (strcmp(reports[r].key, key) == 0)
+            return r;
+    }
+    return EN_ERROR;
+}
+
+int parseReports(char *key, struct t_report *reports, int *nreports, struct t_report *derived, int *nderived)
+{
+    int rollupMasks[EN_MAX_REPORTS];
+    struct t_tupleSpec spec;
+    int aggkey = EN_ERROR;
+    int mask = 0;
+    int count, i;
+
+    /* Unused fields are zero, the spec is a part of cached partials */
+    memset(&spec, 0, sizeof (spec));
+
+    if ((count = parseRollupKey(key, &aggkey, rollupMasks)) == 0)
+    {
+        if (strpbrk(key, "+,") != NULL)
+            aggkey = parseTupleKey(key, &spec);
+        else
+            aggkey = parseAggKey(key, &mask);
+        count = 1;
+        rollupMasks[0] = mask;
+    }
+
+    if (count == EN_ERROR || aggkey == EN_ERROR)
+    {
+        printError("Invalid aggregation key!");
+        return 1;
+    }
+    if (*nreports + *nderived + count > EN_MAX_REPORTS)
+    {
+        printError("Too many aggregation keys!");
+        return 1;
+    }
+
+    /* The finest mask is read from the data, coarser ones come from its table */
+    int finest = 0;
+    for (i = 1; i < count; i++)
+    {
+        if (rollupMasks[i] > rollupMasks[finest])
+            finest = i;
+    }
+
+    int source = *nreports;
+    for (i = 0; i < count; i++)
+    {
+        char *name = malloc(strlen(key) + 1);
+        if (count == 1)
+            strcpy(name, key);
+        else
+            sprintf(name, "%.*s/%d", (int) (strchr(key, '/') - key), key, rollupMasks[i]);
+
+        if (findReport(name, reports, *nreports) != EN_ERROR || findReport(name, derived, *nderived) != EN_ERROR)
+        {
+            printError("Duplicate aggregation key!");
+            free(name);
+            return 1;
+        }
+
+        struct t_report *report = (i == finest) ? &reports[(*nreports)++] : &derived[(*nderived)++];
+        report->key = name;
+        report->aggkey = aggkey;
+        report->mask = rollupMasks[i];
+        report->spec = spec;
+        report->file = NULL;
+        report->rollup = (i == finest) ? EN_ERROR : source;
+    }
+
+    return 0;
+}
+
+char *getReportFile(char *directory, char *key, char *suffix)
+{
+    /* Report of srcip4/24 goes to directory/srcip4_24.csv */
+    char *file = malloc(strlen(directory) + strlen(key) + strlen(suffix) + 2);
+    sprintf(file, "%s/%s%s", directory, key, suffix);
+
+    char *p;
+    for (p = file + strlen(directory) + 1; *p != '\0'; p++)
+    {
+        if (*p == '/')
+            *p = '_';
+    }
+    return file;
+}
+
+int writeReport(struct t_report *report, int sortkey, uint32_t topN, int threads)
+{
+    int aggkey = report->aggkey;
+    struct t_aggregation *aggregation = &(report->aggregation);
+
+    if (isAggregationFailed(aggregation))
+    {
+        printError("Tables of the aggregation cannot grow, keys would be lost!");
+        return 1;
+    }
+
+    if (report->binary)
+        return writeResult(report, sortkey, topN, threads);
+    if (report->partial)
+        return exportPartial(report);
+
+    /* Renamed over the previous report, so readers of a watched one never see it cut short */
+    int fd = STDOUT_FILENO;
+    char *tmpFile = NULL;
+    if (report->file != NULL)
+    {
+        tmpFile = malloc(strlen(report->file) + 32);
+        if (tmpFile == NULL)
+        {
+            printError("Unable to allocate file name!");
+            return 1;
+        }
+        sprintf(tmpFile, "%s.%ld.tmp", report->file, (long) getpid());
+        fd = open(tmpFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            fprintf(stderr, "ERR: %s: %s\n", tmpFile, strerror(errno));
+            free(tmpFile);
+            return 1;
+        }
+    }
+
+    /* The writer thread writes a full buffer while the next one is formatted */
+    struct t_output out;
+    if (initOutput(&out, fd, threads > 1) != 0)
+    {
+        printError("Allocation of the output buffer failed!");
+        if (report->file != NULL)
+        {
+            close(fd);
+            unlink(tmpFile);
+            free(tmpFile);
+        }
+        return 1;
     }
 
     /* Print header */
-    if (aggkey == EN_AGG_SRCIP ||
+    if (aggkey == EN_AGG_TUPLE)
+    {
+        static char *names[] = {NULL, "srcip", "dstip", "srcport", "dstport"};
+        int f;
+        for (f = 0; f < report->spec.count; f++)
+        {
+            writeOutput(&out, f == 0 ? "#" : ",");
+            writeOutput(&out, names[report->spec.fields[f]]);
+        }
+        writeOutput(&out, ",packets,bytes");
+    }
+    else if (aggkey == EN_AGG_SRCIP ||
         aggkey == EN_AGG_SRCIP4 ||
         aggkey == EN_AGG_SRCIP6)
-        printf("#srcip,packets,bytes\n");
+        writeOutput(&out, "#srcip,packets,bytes");
     else if (aggkey == EN_AGG_DSTIP ||
         aggkey == EN_AGG_DSTIP4 ||
         aggkey == EN_AGG_DSTIP6)
-        printf("#dstip,packets,bytes\n");
+        writeOutput(&out, "#dstip,packets,bytes");
     else if (aggkey == EN_AGG_SRCPORT)
-        printf("#srcport,packets,bytes\n");
+        writeOutput(&out, "#srcport,packets,bytes");
     else if (aggkey == EN_AGG_DSTPORT)
-        printf("#dstport,packets,bytes\n");
+        writeOutput(&out, "#dstport,packets,bytes");
 
-    /* Sort the internal structure */
-    if (aggkey == EN_AGG_SRCIP ||
-        aggkey == EN_AGG_DSTIP ||
-        aggkey == EN_AGG_SRCIP6 ||
-        aggkey == EN_AGG_DSTIP6 ||
-        aggkey == EN_AGG_SRCIP4 ||
-        aggkey == EN_AGG_DSTIP4)
+    /* Estimated peers and the error of approximate counters follow */
+    if (aggregation->peers)
+        writeOutput(&out, ",peers");
+    writeOutput(&out, aggregation->summary != NULL ? ",error\n" : "\n");
+
+    /* Keys spilled over the memory limit are sorted by partitions and merged */
+    int failed = 0;
+    double start;
+    if (report->spill != NULL && report->spill->used)
+    {
+        failed = writeSpilledReport(report, sortkey, topN, threads, &out);
+        start = getStatsTime();
+    }
+    else
     {
         /* Fill the internal sort structure */
-        struct t_sortStruct *hashTableArray = malloc(hashTable->count * sizeof (struct t_sortStruct));
-        uint32_t n = sortHashArray(hashTableArray, hashTable, sortkey);
+        start = getStatsTime();
+        struct t_sortArray array;
+        if (initSortArray(&array, getAggregationCount(aggregation), topN) != 0)
+        {
+            printError("Unable to allocate the sort array!");
+            failed = 1;
+        }
+        else
+            sortAggregation(&array, aggregation, sortkey, threads);
+        addPhaseTime(EN_PHASE_SORT, start);
 
         /* Print the sorted internal structure */
+        start = getStatsTime();
+        struct t_dataStruct d;
         uint32_t i;
-        for (i = 0; i < n; i++)
+        for (i = 0; i < array.count; i++)
         {
-            printData(&(hashTable->data[hashTableArray[i].key]));
+            getAggregationEntry(aggregation, array.items[i].key, &d);
+            printData(&out, &d);
         }
 
         /* Free the structure */
-        free(hashTableArray);
+        finishSortArray(&array);
+    }
+
+    int result = finishOutput(&out);
+    if (report->file != NULL)
+    {
+        if (close(fd) != 0)
+            result = 1;
+        if (result != 0 || failed != 0 || rename(tmpFile, report->file) != 0)
+        {
+            unlink(tmpFile);
+            result = 1;
+        }
+        free(tmpFile);
+    }
+    addPhaseTime(EN_PHASE_PRINT, start);
+    if (result != 0)
+    {
+        if (report->file != NULL)
+            fprintf(stderr, "ERR: %s: Writing of the report failed!\n", report->file);
+        else
+            printError("Writing of the output failed!");
+    }
+
+    return result | failed;
+}
+
+int main(int argc, char *argv[])
+{
+    char *directory = NULL;
+    char *outputDirectory = NULL;
+    char *cacheDirectory = NULL;
+    int interval = 0;
+    uint32_t approx = 0;
+    uint64_t memLimit = 0;
+    int sortkey = EN_ERROR;
+    int threads = 1;
+    char presize = 0;
+    char peers = 0;
+    char binary = 0;
+    char partial = 0;
+    char merge = 0;
+    uint32_t topN = 0;
+    struct t_report reports[EN_MAX_REPORTS];
+    struct t_report derived[EN_MAX_REPORTS]; //coarser masks of rollups
+    int nreports = 0;
+    int nderived = 0;
+    int r;
+    struct t_filter filter;
+    initFilter(&filter);
+
+    static struct option longOptions[] = {
+        {"help", no_argument, NULL, 'h'},
+        {"presize", no_argument, NULL, 'p'},
+        {"huge-pages", no_argument, NULL, 'g'},
+        {"peers", no_argument, NULL, 'd'},
+        {"binary", no_argument, NULL, 'b'},
+        {"partial", no_argument, NULL, 'P'},
+        {"merge", no_argument, NULL, 'M'},
+        {"stats", no_argument, NULL, 't'},
+        {"cache", required_argument, NULL, 'c'},
+        {"watch", required_argument, NULL, 'w'},
+        {"approx", required_argument, NULL, 'x'},
+        {"mem-limit", required_argument, NULL, 'm'},
+        {"filter", required_argument, NULL, 'e'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "hf:a:s:j:pgdbPMtn:o:c:w:x:e:m:", longOptions, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'h':
+            /* Help requested */
+            printHelp(argv[0]);
+            return (EXIT_SUCCESS);
+        case 'f':
+            directory = optarg; /* Will be checked by openning */
+            break;
+        case 'a':
+            /* Every aggregation key adds a report, a rollup one per mask */
+            if (parseReports(optarg, reports, &nreports, derived, &nderived) != 0)
+            {
+                printHelp(argv[0]);
+                return (EXIT_FAILURE);
+            }
+            break;
+        case 's':
+            /* Check sortkey */
+            if ((sortkey = parseSortKey(optarg)) == EN_ERROR)
+            {
+                printError("Invalid sort key!");
+                printHelp(argv[0]);
+                return (EXIT_FAILURE);
+            }
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            if (threads < 1 || threads > EN_MAX_THREADS)
+            {
+                printError("Invalid number of threads!");
+                printHelp(argv[0]);
+                return (EXIT_FAILURE);
+            }
+            break;
+        case 'p':
+            presize = 1;
+            break;
+        case 'g':
+            setArenaHugePages(1);
+            break;
+        case 'd':
+            peers = 1;
+            break;
+        case 'b':
+            binary = 1;
+            break;
+        case 'P':
+            partial = 1;
+            break;
+        case 'M':
+            merge = 1;
+            break;
+        case 't':
+            stats.enabled = 1;
+            break;
+        case 'n':
+            if (atoi(optarg) < 1)
+            {
+                printError("Invalid number of top entries!");
+                printHelp(argv[0]);
+                return (EXIT_FAILURE);
+            }
+            topN = atoi(optarg);
+            break;
+        case 'o':
+            outputDirectory = optarg;
+            break;
+        case 'c':
+            cacheDirectory = optarg;
+            break;
+        case 'x':
+            if (atoi(optarg) < 1 || atoi(optarg) > EN_APPROX_MAX)
+            {
+                printError("Invalid number of approximately tracked keys!");
+                printHelp(argv[0]);
+                return (EXIT_FAILURE);
+            }
+            approx = atoi(optarg);
+            break;
+        case 'm':
+            if ((memLimit = parseSize(optarg)) == 0)
+            {
+                printError("Invalid memory limit!");
+                printHelp(argv[0]);
+                return (EXIT_FAILURE);
+            }
+            break;
+        case 'e':
+            if (parseFilter(&filter, optarg) != 0)
+            {
+                printError("Invalid filter expression!");
+                printHelp(argv[0]);
+                return (EXIT_FAILURE);
+            }
+            break;
+        case 'w':
+            if ((interval = atoi(optarg)) < 1)
+            {
+                printError("Invalid watch interval!");
+                printHelp(argv[0]);
+                return (EXIT_FAILURE);
+            }
+            break;
+        default:
+            printHelp(argv[0]);
+            return (EXIT_FAILURE);
+        }
+    }
+
+    /* Merge mode reads partial aggregates given as arguments instead of a directory, partials need no sort key */
+    int inputs = merge ? directory == NULL && optind < argc : directory != NULL && optind == argc;
+    if (!inputs || nreports == 0 || (sortkey == EN_ERROR && !partial))
+    {
+        /* Invalid parameters! */
+        printError("Invalid parameters!");
+        printHelp(argv[0]);
+        return (EXIT_FAILURE);
+    }
+
+    /* Approximate counters cannot be rolled up or stored as exact partials */
+    if (approx > 0 && (nderived > 0 || cacheDirectory != NULL))
+    {
+        printError("Approximate aggregation cannot be used with rollups or with the cache!");
+        printHelp(argv[0]);
+        return (EXIT_FAILURE);
+    }
+
+    /* Partials are stored for all records of a file */
+    if (filter.active && cacheDirectory != NULL)
+    {
+        printError("Filtered records cannot be aggregated with the cache!");
+        printHelp(argv[0]);
+        return (EXIT_FAILURE);
+    }
+
+    /* Sketches of peers are neither approximate counters nor a part of partials */
+    if (sortkey == EN_SORT_PEERS)
+        peers = 1;
+    if (peers && (approx > 0 || cacheDirectory != NULL))
+    {
+        printError("Peers cannot be counted by approximate aggregation or with the cache!");
+        printHelp(argv[0]);
+        return (EXIT_FAILURE);
+    }
+    for (r = 0; peers && r < nreports; r++)
+    {
+        if (getPeerField(reports[r].aggkey, &(reports[r].spec)) == EN_ERROR)
+        {
+            printError("Composite key including both a field and its counterpart has no peers!");
+            printHelp(argv[0]);
+            return (EXIT_FAILURE);
+        }
+    }
+
+    /* Partials are exact counters of all keys, merged as if the records were aggregated at once */
+    if (partial && (binary || approx > 0 || peers || memLimit > 0 || topN > 0))
+    {
+        printError("Partial aggregates cannot be written as binary reports, by approximate aggregation, with peers, top entries or the memory limit!");
+        printHelp(argv[0]);
+        return (EXIT_FAILURE);
+    }
+    if (merge && (approx > 0 || peers || memLimit > 0 || filter.active || cacheDirectory != NULL || interval > 0 || presize))
+    {
+        printError("Partial aggregates cannot be merged by approximate aggregation, with peers, the memory limit, filters, the cache, watching or presized tables!");
+        printHelp(argv[0]);
+        return (EXIT_FAILURE);
+    }
+
+    /* Spilled keys are exact counters of whole records, sorted and written as CSV once */
+    if (memLimit > 0 && (approx > 0 || peers || binary || nderived > 0 || cacheDirectory != NULL || interval > 0 || presize))
+    {
+        printError("Memory limit cannot be used with approximate aggregation, peers, binary reports, rollups, the cache, watching or presized tables!");
+        printHelp(argv[0]);
+        return (EXIT_FAILURE);
+    }
+
+    /* Reports derived from others follow the reports read from the data */
+    int nscanned = nreports;
+    for (r = 0; r < nderived; r++)
+    {
+        reports[nreports++] = derived[r];
+    }
+    for (r = 0; r < nreports; r++)
+    {
+        reports[r].approx = approx;
+        reports[r].sortkey = sortkey;
+        reports[r].peers = peers;
+        reports[r].binary = binary;
+        reports[r].partial = partial;
+        reports[r].memLimit = memLimit;
+        reports[r].spill = NULL;
+
+        /* Ports are counted in a fixed table which never grows */
+        if (memLimit > 0 && reports[r].aggkey != EN_AGG_SRCPORT && reports[r].aggkey != EN_AGG_DSTPORT)
+        {
+            reports[r].spill = malloc(sizeof (struct t_spill));
+            if (reports[r].spill == NULL)
+            {
+                printError("Unable to allocate spill files!");
+                return (EXIT_FAILURE);
+            }
+            initSpill(reports[r].spill);
+        }
+    }
+
+    /* Several reports cannot share the standard output */
+    if (nreports > 1 && outputDirectory == NULL)
+    {
+        printError("Output directory is required for several aggregation keys!");
+        printHelp(argv[0]);
+        return (EXIT_FAILURE);
+    }
+    if (outputDirectory != NULL)
+    {
+        if (mkdir(outputDirectory, 0755) != 0 && errno != EEXIST)
+        {
+            fprintf(stderr, "ERR: %s: %s\n", outputDirectory, strerror(errno));
+            return (EXIT_FAILURE);
+        }
+        for (r = 0; r < nreports; r++)
+        {
+            reports[r].file = getReportFile(outputDirectory, reports[r].key, binary ? ".bin" : partial ? ".part" : ".csv");
+        }
+    }
+    if (cacheDirectory != NULL && mkdir(cacheDirectory, 0755) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "ERR: %s: %s\n", cacheDirectory, strerror(errno));
+        return (EXIT_FAILURE);
+    }
+
+    /* Watched directory is aggregated again and again, the reports are rewritten */
+    if (interval > 0)
+    {
+        int result = watchReports(directory, reports, nscanned, nreports, sortkey, topN, threads, presize, cacheDirectory,
+                                  filter.active ? &filter : NULL, interval);
+        for (r = 0; r < nreports; r++)
+        {
+            free(reports[r].key);
+            free(reports[r].file);
+        }
+        finishFilter(&filter);
+        releaseArena();
+        if (stats.enabled)
+            printStats(stderr);
+        return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    /* Collect the files of given directory recursively, or merge the partials of other runs */
+    struct t_fileList files;
+    initFileList(&files);
+    int result = EXIT_FAILURE;
+    int aggregated;
+    double start = getStatsTime();
+    if (merge)
+        aggregated = mergePartialFiles(&argv[optind], argc - optind, reports, nscanned, threads);
+    else if (walkDirectory(directory, &files) == 0)
+    {
+        addPhaseTime(EN_PHASE_WALK, start);
+        aggregated = aggregateFiles(&files, reports, nscanned, threads, presize, cacheDirectory, filter.active ? &filter : NULL);
     }
     else
+        aggregated = 1;
+    if (aggregated == 0)
     {
-        /* Fill the internal sort structure */
-        struct t_sortStruct *hashTableArray = malloc(hashTable->count * sizeof (struct t_sortStruct));
-        uint32_t n = sortHashArray(hashTableArray, hashTable, sortkey);
+        /* Coarser masks of rollups are aggregated from the table of the finest one */
+        int rolled = 1;
+        start = getStatsTime();
+        for (r = nscanned; r < nreports; r++)
+        {
+            struct t_report *source = &reports[reports[r].rollup];
+            if (rollupAggregation(&(reports[r].aggregation), &(source->aggregation), reports[r].aggkey, reports[r].mask) != 0)
+                rolled = 0;
+        }
+        addPhaseTime(EN_PHASE_ROLLUP, start);
 
-        /* Print the sorted internal structure */
-        uint32_t i;
-        for (i = 0; i < n; i++)
+        /* Write the reports one by one, none if a rollup is missing */
+        result = rolled ? EXIT_SUCCESS : EXIT_FAILURE;
+        for (r = 0; r < nreports && rolled; r++)
         {
-            printData(&(hashTable->data[hashTableArray[i].key]));
+            if (stats.enabled)
+                printReportStats(stderr, reports[r].key, getAggregationCount(&(reports[r].aggregation)),
+                                 getAggregationCapacity(&(reports[r].aggregation)));
+            if (writeReport(&reports[r], sortkey, topN, threads) != 0)
+                result = EXIT_FAILURE;
         }
 
-        /* Free the structure */
-        free(hashTableArray);
+        /* Free the tables */
+        for (r = 0; r < nreports; r++)
+        {
+            finishAggregation(&(reports[r].aggregation));
+        }
     }
+    finishFileList(&files);
+    finishFilter(&filter);
+    releaseArena();
 
-    /* Free the hash tables */
-    finishHashTable(hashTable);
-    return (EXIT_SUCCESS);
+    for (r = 0; r < nreports; r++)
+    {
+        free(reports[r].key);
+        free(reports[r].file);
+        if (reports[r].spill != NULL)
+        {
+            finishSpill(reports[r].spill);
+            free(reports[r].spill);
+        }
+    }
+    if (stats.enabled)
+        printStats(stderr);
+    return (result);
 }
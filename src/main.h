@@ -8,11 +8,21 @@
 #define	MAIN_H
 
 
+#include <pthread.h>
+#include <sys/types.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/ip6.h>
+#include "table.h"
+#include "sort.h"
+#include "output.h"
+#include "decode.h"
+#include "approx.h"
 
 
+/* Number of distinct port values */
+#define EN_PORT_COUNT 65536
+
 struct flow
 {
     uint32_t sa_family;
@@ -31,34 +41,139 @@ struct t_dataStruct
         uint16_t port; //in order
         uint32_t addr4; //in order
         struct in6_addr addr6; //uint32_t[4]
+        struct t_tupleKey tupleKey;
     } _union_dataStruct;
 #define port _union_dataStruct.port
 #define addr4 _union_dataStruct.addr4
 #define addr6 _union_dataStruct.addr6
+#define tupleKey _union_dataStruct.tupleKey
+    const struct t_tupleSpec *spec; //fields of a composite key
 
     uint64_t packets;
     uint64_t bytes;
+    uint64_t error; //maximal overestimate of the sort counter
+    uint64_t peers; //estimated number of distinct counterparts
+    char approximate; //the error is printed after the counters
+    char counted; //peers are printed after the counters
     char used;
 };
 
-struct t_sortStruct
+/* Counters of a single port */
+struct t_portCounter
+{
+    uint64_t packets;
+    uint64_t bytes;
+};
+
+/* Port aggregation indexed directly by the port number */
+struct t_portTable
+{
+    uint64_t used[EN_PORT_COUNT / 64]; //bitmap of touched ports
+    struct t_portCounter counters[EN_PORT_COUNT];
+    struct t_peers **peers; //sketches of distinct counterparts by ports, NULL if not counted
+};
+
+/* Aggregated data of one aggregation key */
+struct t_aggregation
+{
+    uint32_t parts; //number of merge partitions
+    struct t_ip4Table *ip4; //IPv4 keys, one table per partition
+    struct t_ip6Table *ip6; //IPv6 keys, one table per partition
+    struct t_tupleTable *tuples; //composite keys, one table per partition
+    struct t_tupleSpec spec; //fields of composite keys
+    struct t_portTable *ports; //port keys
+    struct t_summary *summary; //keys of approximate aggregation, instead of the tables
+    char peers; //distinct counterparts of the keys are counted
+};
+
+/* One requested report: aggregation key, its output and its results */
+struct t_report
+{
+    char *key; //aggregation key as given on the command line
+    int aggkey;
+    int mask;
+    struct t_tupleSpec spec; //fields of a composite key
+    char *file; //output file, NULL for the standard output
+    int rollup; //report of the finest mask this one is derived from, -1 if read from the data
+    uint32_t approx; //keys tracked by approximate aggregation, 0 for the exact one
+    int sortkey; //counter approximate aggregation is kept by
+    char peers; //count distinct counterparts of the keys
+    char binary; //written in the binary result format instead of CSV
+    char partial; //written as an unsorted partial aggregate to be merged, instead of CSV
+    uint64_t memLimit; //bytes of tables aggregating the data, 0 for no limit
+    struct t_spill *spill; //keys spilled over the memory limit, NULL if never spilled
+    struct t_aggregation aggregation;
+};
+
+struct t_filter;
+struct t_prefetch;
+struct t_spill;
+
+/* Aggregation parameters handed over to the block handler */
+struct t_aggContext
+{
+    struct t_aggregation *aggregations; //one per report
+    struct t_decoder *decoders;
+    int count;
+    struct t_decodeBatch *batch;
+    const struct t_filter *filter; //records aggregated, NULL for all
+    struct flow *accepted; //records of a batch accepted by the filter
+    struct t_spill * const *spills; //spills by reports, NULL without the memory limit
+    uint64_t budget; //bytes of a single table before it is spilled
+};
+
+struct t_inputFile;
+
+/* Part of an input file processed by a single worker */
+struct t_workUnit
+{
+    char *file;
+    const struct t_inputFile *source; //input file the part belongs to
+    off_t offset;
+    off_t length; //-1 reads up to the end of file
+};
+
+/* Work shared by all aggregation workers */
+struct t_work
 {
-    uint32_t key;
-    uint64_t value;
+    struct t_workUnit *units;
+    size_t count;
+    volatile size_t next; //next unit to be taken
+    volatile int failed;
+    struct t_report *reports;
+    int nreports;
+    char *cache; //directory of partial aggregates, NULL without the cache
+    const struct t_filter *filter; //records aggregated, NULL for all
+    struct t_prefetch *prefetch; //read-ahead of the following units, NULL without it
+    struct t_spill **spills; //spills by reports, NULL without the memory limit
+    uint64_t budget; //bytes of a single table of a worker before it is spilled
 };
 
+struct t_worker
+{
+    pthread_t thread;
+    struct t_work *work;
+    struct t_aggregation *aggregations; //private tables of the worker, one per report
+};
 
-struct t_hashTable
+/* Merge of one hash range of all private tables into the result */
+struct t_mergeJob
 {
-    uint32_t size;
-    uint32_t count;
-    uint32_t limit; //limit is precomputed by 0.8*size;
-    struct t_dataStruct * data;
+    pthread_t thread;
+    struct t_worker *workers;
+    int nworkers;
+    int report;
+    uint32_t part;
+    uint32_t parts;
+    struct t_aggregation *result;
 };
 
+struct t_fileList;
+
 /* Sort key values */
 #define EN_SORT_PACKETS 1
 #define EN_SORT_BYTES 2
+#define EN_SORT_PEERS 3
 
 /* Aggregation key values */
 #define EN_AGG_SRCIP 1
@@ -69,83 +184,83 @@ struct t_hashTable
 #define EN_AGG_DSTIP6 6
 #define EN_AGG_SRCPORT 7
 #define EN_AGG_DSTPORT 8
+#define EN_AGG_TUPLE 9
 
 /* Other values */
 #define EN_ERROR -1
-#define EN_HASH_INIT_IP 16384
-#define EN_HASH_INIT_PORT 16384
-#define EN_HASH_STEP 13
+#define EN_APPROX_MAX 268435456 //keys tracked by approximate aggregation
+#define EN_MAX_THREADS 256
+#define EN_MAX_REPORTS 32
 
 /* Data types */
 #define EN_DATA_UNUSED 0
 #define EN_DATA_PORT 2
 #define EN_DATA_IP4 4
 #define EN_DATA_IP6 6
+#define EN_DATA_TUPLE 8
 
 #define SA_FAMILY_IPV6 167772160
 #define SA_FAMILY_IPV4 33554432
 #define IPV4_FULL_MASK 4294967295 //address 255.255.255.255
 
 /* IPv4 masks */
-static uint32_t masks[] = {
-    0,
-    128, //address 128.0.0.0
-    192, //address 192.0.0.0
-    224, //address 224.0.0.0
-    240, //address 240.0.0.0
-    248, //address 248.0.0.0
-    252, //address 252.0.0.0
-    254, //address 254.0.0.0
-    255, //address 255.0.0.0
-    33023, //address 255.128.0.0
-    49407, //address 255.192.0.0
-    57599, //address 255.224.0.0
-    61695, //address 255.240.0.0
-    63743, //address 255.248.0.0
-    64767, //address 255.252.0.0
-    65279, //address 255.254.0.0
-    65535, //address 255.255.0.0
-    8454143, //address 255.255.128.0
-    12648447, //address 255.255.192.0
-    14745599, //address 255.255.224.0
-    15794175, //address 255.255.240.0
-    16318463, //address 255.255.248.0
-    16580607, //address 255.255.252.0
-    16711679, //address 255.255.254.0
-    16777215, //address 255.255.255.0
-    2164260863, //address 255.255.255.128
-    3238002687, //address 255.255.255.196
-    3774873599, //address 255.255.255.224
-    4043309055, //address 255.255.255.240
-    4177526783, //address 255.255.255.248
-    4244635647, //address 255.255.255.252
-    4278190079, //address 255.255.255.254
-    4294967295, //address 255.255.255.255
-};
+extern uint32_t masks[];
 
 
 /* Prototypes */
 void print_flow(struct flow *fl);
 void printHelp(char *name);
 void printError(char *msg);
-void printData(struct t_dataStruct *d);
-int processDirectory(char *directory, struct t_hashTable *hashTable, int aggkey, int mask);
+void printData(struct t_output *out, struct t_dataStruct *d);
+void processFlows(const struct flow *fl, size_t count, void *data);
+int prepareWork(struct t_work *work, struct t_fileList *files, int threads);
+void *aggregateWorker(void *arg);
+int aggregateCachedFile(struct t_worker *worker, const struct t_inputFile *file, struct t_decoder *decoders, struct t_decodeBatch *batch);
+void *mergeWorker(void *arg);
+int initAggregation(struct t_aggregation *aggregation, int aggkey, const struct t_tupleSpec *spec, uint32_t parts, uint32_t capacity);
+int initApproxAggregation(struct t_aggregation *aggregation, struct t_report *report);
+int countPeersAggregation(struct t_aggregation *aggregation);
+void settleAggregation(struct t_aggregation *aggregation);
+void finishAggregation(struct t_aggregation *aggregation);
+int mergeAggregations(struct t_worker *workers, int threads, int report, int aggkey, struct t_aggregation *result);
+void addAggregation(struct t_aggregation *result, struct t_aggregation *source);
+int rollupAggregation(struct t_aggregation *result, struct t_aggregation *source, int aggkey, int mask);
+uint32_t getPresizedCapacity(struct t_fileList *files, int aggkey, int mask, int threads);
+struct t_worker *allocWorkers(struct t_work *work, int threads, int nreports);
+void runWorkers(struct t_worker *workers, int threads, void *(*routine)(void *));
+int collectWorkers(struct t_worker *workers, int threads, struct t_report *reports, int nreports, int failed);
+int aggregateFiles(struct t_fileList *files, struct t_report *reports, int nreports, int threads, char presize, char *cache,
+                   const struct t_filter *filter);
+void *partialWorker(void *arg);
+int mergePartialFiles(char **paths, int count, struct t_report *reports, int nreports, int threads);
+int writeReport(struct t_report *report, int sortkey, uint32_t topN, int threads);
+char *getReportFile(char *directory, char *key, char *suffix);
 
-char equals_in6_addr(struct in6_addr *i1, struct in6_addr *i2);
 struct in6_addr maskIPv6(struct in6_addr* addr, int mask);
-int compareSortStruct(const void * a, const void * b);
-int sortHashArray(struct t_sortStruct *hashArray, struct t_hashTable *hashTable, int sortkey);
+uint32_t getAggregationCount(struct t_aggregation *aggregation);
+uint64_t getAggregationCapacity(struct t_aggregation *aggregation);
+int isAggregationFailed(const struct t_aggregation *aggregation);
+void sortAggregation(struct t_sortArray *array, struct t_aggregation *aggregation, int sortkey, int threads);
+void getAggregationEntry(struct t_aggregation *aggregation, uint32_t key, struct t_dataStruct *d);
+int compareAggregationKeys(uint32_t keyA, uint32_t keyB, void *data);
+uint32_t getTupleRank(const struct t_tupleKey *key, const struct t_tupleSpec *spec);
+int compareTupleKeys(const struct t_tupleKey *a, const struct t_tupleKey *b, const struct t_tupleSpec *spec);
+char *formatTuple(char *dst, const struct t_tupleKey *key, const struct t_tupleSpec *spec);
 
 int parseSortKey(char *key);
+uint64_t parseSize(char *size);
 int parseAggKey(char *key, int * mask);
-void addRecordIP(struct flow *fl, int aggkey, int mask, struct t_hashTable *hashTable4);
-void addRecordIP4(struct flow *fl, int aggkey, int mask, struct t_hashTable *hashTable);
-void addRecordIP6(struct flow *fl, int aggkey, int mask, struct t_hashTable *hashTable);
-void addRecordPort(struct flow *fl, int aggkey, struct t_hashTable *hashTable);
-
-uint32_t hashFunction(const uint32_t input, uint32_t tableSize);
-uint32_t hashFunction6(const struct in6_addr input, uint32_t tableSize);
-void initHashTable(struct t_hashTable *hashTable, uint32_t tableSize);
-void doubleHashTable(struct t_hashTable *hashTable, int aggkey);
-void finishHashTable(struct t_hashTable *hashTable);
-#endif /* MAIN_H */
\ No newline at end of file
+int parseTupleKey(char *key, struct t_tupleSpec *spec);
+int parseRollupKey(char *key, int *aggkey, int *rollupMasks);
+int parseReports(char *key, struct t_report *reports, int *nreports, struct t_report *derived, int *nderived);
+int findReport(char *key, struct t_report *reports, int nreports);
+void addBatchIP4(const struct t_decodeBatch *batch, struct t_ip4Table *table);
+void addBatchIP6(const struct t_decodeBatch *batch, struct t_ip6Table *table);
+void addBatchTuple(const struct t_decodeBatch *batch, struct t_tupleTable *table);
+void addBatchSummary(const struct t_decodeBatch *batch, const struct t_decoder *decoder, struct t_summary *summary);
+void addBatchPort(const struct t_decodeBatch *batch, struct t_portTable *ports);
+
+struct t_portTable *initPortTable(void);
+void finishPortTable(struct t_portTable *ports);
+void mergePortTable(struct t_portTable *result, struct t_portTable *source, uint32_t from, uint32_t to);
+#endif /* MAIN_H */
@@ -0,0 +1,333 @@
+/*
+ * File:    output.c
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "output.h"
+
+/* Decimal digits of all numbers below 100 */
+static const char digitPairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static const char hexDigits[] = "0123456789abcdef";
+
+/* Write whole data, short writes are continued */
+static void writeAll(struct t_output *out, const char *data, size_t size)
+{
+    while (size > 0 && !out->failed)
+    {
+        ssize_t written = write(out->fd, data, size);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            out->failed = 1;
+            return;
+        }
+        data += written;
+        size -= written;
+    }
+}
+
+void *outputWorker(void *arg)
+{
+    struct t_output *out = (struct t_output *) arg;
+
+    pthread_mutex_lock(&out->lock);
+    for (;;)
+    {
+        while (!out->busy && !out->done)
+        {
+            pthread_cond_wait(&out->cond, &out->lock);
+        }
+        if (!out->busy)
+            break;
+
+        /* The pending buffer belongs to this thread until busy is cleared */
+        pthread_mutex_unlock(&out->lock);
+        writeAll(out, out->pending, out->pendingUsed);
+        pthread_mutex_lock(&out->lock);
+
+        out->busy = 0;
+        pthread_cond_signal(&out->cond);
+    }
+    pthread_mutex_unlock(&out->lock);
+
+    return NULL;
+}
+
+int initOutput(struct t_output *out, int fd, char threaded)
+{
+    out->fd = fd;
+    out->used = 0;
+    out->threaded = 0;
+    out->pending = NULL;
+    out->pendingUsed = 0;
+    out->busy = 0;
+    out->done = 0;
+    out->failed = 0;
+
+    out->buffer = malloc(EN_OUTPUT_BUFFER);
+    if (out->buffer == NULL)
+        return 1;
+
+    /* Without the second buffer or the thread the output stays synchronous */
+    if (threaded)
+    {
+        out->pending = malloc(EN_OUTPUT_BUFFER);
+        if (out->pending == NULL)
+            return 0;
+
+        pthread_mutex_init(&out->lock, NULL);
+        pthread_cond_init(&out->cond, NULL);
+        if (pthread_create(&out->thread, NULL, outputWorker, out) != 0)
+        {
+            pthread_mutex_destroy(&out->lock);
+            pthread_cond_destroy(&out->cond);
+            free(out->pending);
+            out->pending = NULL;
+            return 0;
+        }
+        out->threaded = 1;
+    }
+
+    return 0;
+}
+
+void flushOutput(struct t_output *out)
+{
+    if (out->used == 0)
+        return;
+
+    if (!out->threaded)
+    {
+        writeAll(out, out->buffer, out->used);
+        out->used = 0;
+        return;
+    }
+
+    /* Wait for the previous buffer, then swap the buffers */
+    pthread_mutex_lock(&out->lock);
+    while (out->busy)
+    {
+        pthread_cond_wait(&out->cond, &out->lock);
+    }
+
+    char *tmp = out->pending;
+    out->pending = out->buffer;
+    out->pendingUsed = out->used;
+    out->buffer = tmp;
+    out->used = 0;
+
+    out->busy = 1;
+    pthread_cond_signal(&out->cond);
+    pthread_mutex_unlock(&out->lock);
+}
+
+int finishOutput(struct t_output *out)
+{
+    flushOutput(out);
+
+    if (out->threaded)
+    {
+        /* The writer finishes the pending buffer before it ends */
+        pthread_mutex_lock(&out->lock);
+        out->done = 1;
+        pthread_cond_signal(&out->cond);
+        pthread_mutex_unlock(&out->lock);
+        pthread_join(out->thread, NULL);
+
+        pthread_mutex_destroy(&out->lock);
+        pthread_cond_destroy(&out->cond);
+        out->threaded = 0;
+    }
+
+    free(out->buffer);
+    free(out->pending);
+    out->buffer = NULL;
+    out->pending = NULL;
+
+    return out->failed ? 1 : 0;
+}
+
+void writeOutput(struct t_output *out, const char *str)
+{
+    size_t size = strlen(str);
+    while (size > 0)
+    {
+        size_t chunk = size < EN_OUTPUT_BUFFER ? size : EN_OUTPUT_BUFFER;
+        char *dst = reserveOutput(out, chunk);
+        memcpy(dst, str, chunk);
+        commitOutput(out, dst + chunk);
+        str += chunk;
+        size -= chunk;
+    }
+}
+
+char *formatUint(char *dst, uint64_t value)
+{
+    /* Digits are produced from the end, two at once */
+    char tmp[20];
+    char *p = tmp + sizeof (tmp);
+
+    while (value >= 100)
+    {
+        uint32_t pair = (uint32_t) (value % 100) * 2;
+        value /= 100;
+        *--p = digitPairs[pair + 1];
+        *--p = digitPairs[pair];
+    }
+    if (value >= 10)
+    {
+        *--p = digitPairs[value * 2 + 1];
+        *--p = digitPairs[value * 2];
+    }
+    else
+    {
+        *--p = '0' + value;
+    }
+
+    size_t size = tmp + sizeof (tmp) - p;
+    memcpy(dst, p, size);
+    return dst + size;
+}
+
+/* Format a single byte of a dotted address */
+static inline char *formatOctet(char *dst, uint8_t value)
+{
+    if (value >= 100)
+    {
+        *dst++ = '0' + value / 100;
+        value %= 100;
+        *dst++ = digitPairs[value * 2];
+        *dst++ = digitPairs[value * 2 + 1];
+    }
+    else if (value >= 10)
+    {
+        *dst++ = digitPairs[value * 2];
+        *dst++ = digitPairs[value * 2 + 1];
+    }
+    else
+    {
+        *dst++ = '0' + value;
+    }
+    return dst;
+}
+
+char *formatIP4(char *dst, uint32_t addr)
+{
+    /* Address is in network order, so bytes go in memory order */
+    const uint8_t *bytes = (const uint8_t *) &addr;
+
+    dst = formatOctet(dst, bytes[0]);
+    *dst++ = '.';
+    dst = formatOctet(dst, bytes[1]);
+    *dst++ = '.';
+    dst = formatOctet(dst, bytes[2]);
+    *dst++ = '.';
+    dst = formatOctet(dst, bytes[3]);
+    return dst;
+}
+
+/* Format a 16 bit word in hexadecimal without leading zeros */
+static inline char *formatHexWord(char *dst, uint16_t value)
+{
+    if (value >= 0x1000)
+        *dst++ = hexDigits[value >> 12];
+    if (value >= 0x100)
+        *dst++ = hexDigits[(value >> 8) & 0xf];
+    if (value >= 0x10)
+        *dst++ = hexDigits[(value >> 4) & 0xf];
+    *dst++ = hexDigits[value & 0xf];
+    return dst;
+}
+
+char *formatIP6(char *dst, const struct in6_addr *addr)
+{
+    /*
+     * Same text as inet_ntop() of glibc: the first longest run of at least
+     * two zero words is compressed to "::", addresses with 96 zero bits or
+     * mapped IPv4 addresses end with the dotted IPv4 address.
+     */
+    uint16_t words[8];
+    int bestBase = -1, bestLen = 0;
+    int curBase = -1, curLen = 0;
+    int i;
+
+    for (i = 0; i < 8; i++)
+    {
+        words[i] = (addr->s6_addr[i * 2] << 8) | addr->s6_addr[i * 2 + 1];
+        if (words[i] == 0)
+        {
+            if (curBase == -1)
+            {
+                curBase = i;
+                curLen = 1;
+            }
+            else
+                curLen++;
+        }
+        else if (curBase != -1)
+        {
+            if (curLen > bestLen)
+            {
+                bestBase = curBase;
+                bestLen = curLen;
+            }
+            curBase = -1;
+        }
+    }
+    if (curBase != -1 && curLen > bestLen)
+    {
+        bestBase = curBase;
+        bestLen = curLen;
+    }
+    if (bestLen < 2)
+        bestBase = -1;
+
+    for (i = 0; i < 8; i++)
+    {
+        /* Inside the compressed run */
+        if (bestBase != -1 && i >= bestBase && i < bestBase + bestLen)
+        {
+            if (i == bestBase)
+                *dst++ = ':';
+            continue;
+        }
+
+        if (i != 0)
+            *dst++ = ':';
+
+        /* Encapsulated IPv4 address */
+        if (i == 6 && bestBase == 0 && (bestLen == 6 || (bestLen == 5 && words[5] == 0xffff)))
+        {
+            return formatIP4(dst, addr->s6_addr32[3]);
+        }
+
+        dst = formatHexWord(dst, words[i]);
+    }
+
+    /* Trailing run of zeros */
+    if (bestBase != -1 && bestBase + bestLen == 8)
+        *dst++ = ':';
+
+    return dst;
+}
@@ -0,0 +1,71 @@
+/*
+ * File:    output.h
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#ifndef OUTPUT_H
+#define	OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+/*
+ * Buffered output of the results. Rows are formatted right into a large
+ * buffer, which is written by a single write() once it fills up. A threaded
+ * output has two buffers; a writer thread writes one of them while the
+ * other is being filled.
+ */
+
+/* Size of an output buffer */
+#define EN_OUTPUT_BUFFER (1024 * 1024)
+
+/* Space reserved for a single row, more than the longest one needs */
+#define EN_OUTPUT_LINE 256
+
+struct t_output
+{
+    int fd;
+    char *buffer; //buffer being filled
+    size_t used;
+
+    /* Buffer handed over to the writer thread */
+    char threaded;
+    char *pending;
+    size_t pendingUsed;
+    char busy; //pending buffer waits to be written
+    char done;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    volatile int failed;
+};
+
+/* Prototypes */
+int initOutput(struct t_output *out, int fd, char threaded);
+int finishOutput(struct t_output *out);
+void flushOutput(struct t_output *out);
+void *outputWorker(void *arg);
+void writeOutput(struct t_output *out, const char *str);
+char *formatUint(char *dst, uint64_t value);
+char *formatIP4(char *dst, uint32_t addr);
+char *formatIP6(char *dst, const struct in6_addr *addr);
+
+/* Space for at least given number of bytes at the end of the buffer */
+static inline char *reserveOutput(struct t_output *out, size_t size)
+{
+    if (out->used + size > EN_OUTPUT_BUFFER)
+        flushOutput(out);
+    return out->buffer + out->used;
+}
+
+/* Mark bytes up to given end of the reserved space as used */
+static inline void commitOutput(struct t_output *out, char *end)
+{
+    out->used = end - out->buffer;
+}
+
+#endif /* OUTPUT_H */
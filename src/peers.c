@@ -0,0 +1,160 @@
+/*
+ * File:    peers.c
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "peers.h"
+
+static inline size_t getPeersSize(const struct t_peers *peers)
+{
+    if (peers->size == 0)
+        return sizeof (struct t_peers) + EN_PEERS_REGISTERS;
+    return sizeof (struct t_peers) + peers->size * sizeof (uint16_t);
+}
+
+/* Replace a full sparse list by the array of all registers */
+static int densePeers(struct t_peers **peers)
+{
+    struct t_peers *dense = calloc(1, sizeof (struct t_peers) + EN_PEERS_REGISTERS);
+    if (dense == NULL)
+        return 1;
+
+    uint8_t *registers = (uint8_t *) dense->sparse;
+    uint32_t i;
+    for (i = 0; i < (*peers)->count; i++)
+    {
+        registers[(*peers)->sparse[i] >> 6] = (*peers)->sparse[i] & 63;
+    }
+
+    free(*peers);
+    *peers = dense;
+    return 0;
+}
+
+void setPeerRegister(struct t_peers **peers, uint32_t reg, uint8_t rank)
+{
+    struct t_peers *sketch = *peers;
+    uint32_t i;
+
+    if (sketch == NULL)
+    {
+        sketch = malloc(sizeof (struct t_peers) + EN_PEERS_INIT * sizeof (uint16_t));
+        if (sketch == NULL)
+            return;
+        sketch->count = 0;
+        sketch->size = EN_PEERS_INIT;
+        *peers = sketch;
+    }
+
+    if (sketch->size == 0)
+    {
+        uint8_t *registers = (uint8_t *) sketch->sparse;
+        if (registers[reg] < rank)
+            registers[reg] = rank;
+        return;
+    }
+
+    /* A register is listed at most once */
+    for (i = 0; i < sketch->count; i++)
+    {
+        if ((uint32_t) (sketch->sparse[i] >> 6) == reg)
+        {
+            if ((sketch->sparse[i] & 63) < rank)
+                sketch->sparse[i] = (uint16_t) (reg << 6 | rank);
+            return;
+        }
+    }
+
+    if (sketch->count == sketch->size)
+    {
+        /* Lost memory only makes the estimate lower */
+        if (sketch->size >= EN_PEERS_SPARSE)
+        {
+            if (densePeers(peers) == 0)
+                setPeerRegister(peers, reg, rank);
+            return;
+        }
+
+        struct t_peers *grown = realloc(sketch, sizeof (struct t_peers) + 2 * sketch->size * sizeof (uint16_t));
+        if (grown == NULL)
+            return;
+        sketch = grown;
+        sketch->size *= 2;
+        *peers = sketch;
+    }
+
+    sketch->sparse[sketch->count++] = (uint16_t) (reg << 6 | rank);
+}
+
+void mergePeers(struct t_peers **result, const struct t_peers *source)
+{
+    if (result == NULL || source == NULL)
+        return;
+
+    /* The first sketch of a key is copied as a whole */
+    if (*result == NULL)
+    {
+        struct t_peers *copy = malloc(getPeersSize(source));
+        if (copy != NULL)
+            memcpy(copy, source, getPeersSize(source));
+        *result = copy;
+        return;
+    }
+
+    uint32_t i;
+    if (source->size == 0)
+    {
+        const uint8_t *registers = (const uint8_t *) source->sparse;
+        for (i = 0; i < EN_PEERS_REGISTERS; i++)
+        {
+            if (registers[i] != 0)
+                setPeerRegister(result, i, registers[i]);
+        }
+    }
+    else
+    {
+        for (i = 0; i < source->count; i++)
+        {
+            setPeerRegister(result, source->sparse[i] >> 6, source->sparse[i] & 63);
+        }
+    }
+}
+
+uint64_t estimatePeers(const struct t_peers *peers)
+{
+    const double m = EN_PEERS_REGISTERS;
+
+    if (peers == NULL)
+        return 0;
+
+    /* Few set registers are counted linearly by the empty ones */
+    if (peers->size != 0)
+        return (uint64_t) (m * log(m / (m - peers->count)) + 0.5);
+
+    const uint8_t *registers = (const uint8_t *) peers->sparse;
+    double sum = 0;
+    uint32_t zeros = 0;
+    uint32_t i;
+    for (i = 0; i < EN_PEERS_REGISTERS; i++)
+    {
+        sum += ldexp(1.0, -registers[i]);
+        zeros += (registers[i] == 0);
+    }
+
+    /* Bias of small cardinalities is avoided the same way */
+    double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    if (estimate <= 2.5 * m && zeros > 0)
+        estimate = m * log(m / zeros);
+    return (uint64_t) (estimate + 0.5);
+}
+
+void finishPeers(struct t_peers *peers)
+{
+    free(peers);
+}
@@ -0,0 +1,68 @@
+/*
+ * File:    peers.h
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#ifndef PEERS_H
+#define	PEERS_H
+
+#include <stdint.h>
+
+/*
+ * Number of distinct counterparts of a key (destinations of a source,
+ * source ports of a destination port, ...) estimated by HyperLogLog. The
+ * hash of a counterpart selects a register by its top bits and the rank
+ * of the first set bit of the rest is kept as the register maximum.
+ * Most keys see few counterparts, so a sketch starts as a short list of
+ * set registers and turns into the array of all registers only when the
+ * list would be about as large. Sketches of the same key are merged by
+ * register maxima, the result is the sketch of the union.
+ */
+
+/* Registers of a sketch, the standard error is 1.04 / sqrt(registers) */
+#define EN_PEERS_BITS 10
+#define EN_PEERS_REGISTERS (1 << EN_PEERS_BITS)
+
+/* Entries of the sparse form, initially and at most */
+#define EN_PEERS_INIT 4
+#define EN_PEERS_SPARSE 128
+
+struct t_peers
+{
+    uint16_t count; //set registers in the sparse form
+    uint16_t size; //allocated sparse entries, 0 in the dense form
+    uint16_t sparse[]; //register << 6 | rank, or one byte rank per register in the dense form
+};
+
+/* Prototypes */
+void setPeerRegister(struct t_peers **peers, uint32_t reg, uint8_t rank);
+void mergePeers(struct t_peers **result, const struct t_peers *source);
+uint64_t estimatePeers(const struct t_peers *peers);
+void finishPeers(struct t_peers *peers);
+
+/* Add a counterpart by its 64 bit hash, the sketch is allocated by the first one */
+static inline void addPeer(struct t_peers **peers, uint64_t hash)
+{
+    uint32_t reg = (uint32_t) (hash >> (64 - EN_PEERS_BITS));
+    uint64_t rest = hash << EN_PEERS_BITS;
+    uint8_t rank = rest != 0 ? __builtin_clzll(rest) + 1 : 64 - EN_PEERS_BITS + 1;
+
+    /* Registers of a dense sketch are updated in place */
+    if (*peers != NULL && (*peers)->size == 0)
+    {
+        uint8_t *registers = (uint8_t *) (*peers)->sparse;
+        if (registers[reg] < rank)
+            registers[reg] = rank;
+        return;
+    }
+    setPeerRegister(peers, reg, rank);
+}
+
+/* Sketch of i-th slot of an array which may not be allocated */
+static inline const struct t_peers *getPeersAt(struct t_peers * const *peers, uint32_t i)
+{
+    return peers != NULL ? peers[i] : NULL;
+}
+
+#endif /* PEERS_H */
@@ -0,0 +1,109 @@
+/*
+ * File:    prefetch.c
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "prefetch.h"
+#include "reader.h"
+
+/* Bytes a unit reads */
+static off_t getUnitLength(const struct t_workUnit *unit)
+{
+    if (unit->length >= 0)
+        return unit->length;
+    return unit->source->size > unit->offset ? unit->source->size - unit->offset : 0;
+}
+
+/* Start reading a unit into the page cache without waiting for it */
+static void adviseUnit(const struct t_workUnit *unit)
+{
+    /* Streams cannot be read twice */
+    if (!unit->source->regular)
+        return;
+
+    int fd = open(unit->file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    posix_fadvise(fd, unit->offset, unit->length < 0 ? 0 : unit->length, POSIX_FADV_WILLNEED);
+    close(fd);
+}
+
+static void *prefetchWorker(void *arg)
+{
+    struct t_prefetch *prefetch = arg;
+    struct t_work *work = prefetch->work;
+    size_t advised = prefetch->skip; //units below are advised or taken already
+
+    pthread_mutex_lock(&(prefetch->lock));
+    while (!prefetch->stop && !work->failed)
+    {
+        /* Units taken by workers are read by them */
+        size_t next = __atomic_load_n(&(work->next), __ATOMIC_RELAXED);
+        if (advised < next)
+            advised = next;
+        if (advised >= work->count)
+            break;
+
+        off_t ahead = 0;
+        size_t i;
+        for (i = next; i < advised; i++)
+        {
+            ahead += getUnitLength(&(work->units[i]));
+        }
+
+        if (advised > next && ahead + getUnitLength(&(work->units[advised])) > EN_PREFETCH_AHEAD)
+        {
+            pthread_cond_wait(&(prefetch->taken), &(prefetch->lock));
+            continue;
+        }
+
+        /* Advice may block on a busy disk, workers are not held meanwhile */
+        pthread_mutex_unlock(&(prefetch->lock));
+        adviseUnit(&(work->units[advised++]));
+        pthread_mutex_lock(&(prefetch->lock));
+    }
+    pthread_mutex_unlock(&(prefetch->lock));
+
+    return NULL;
+}
+
+int startPrefetch(struct t_prefetch *prefetch, struct t_work *work, size_t skip)
+{
+    prefetch->work = work;
+    prefetch->skip = skip;
+    prefetch->stop = 0;
+    pthread_mutex_init(&(prefetch->lock), NULL);
+    pthread_cond_init(&(prefetch->taken), NULL);
+
+    if (pthread_create(&(prefetch->thread), NULL, prefetchWorker, prefetch) != 0)
+    {
+        pthread_mutex_destroy(&(prefetch->lock));
+        pthread_cond_destroy(&(prefetch->taken));
+        return 1;
+    }
+    return 0;
+}
+
+void notifyPrefetch(struct t_prefetch *prefetch)
+{
+    pthread_mutex_lock(&(prefetch->lock));
+    pthread_cond_signal(&(prefetch->taken));
+    pthread_mutex_unlock(&(prefetch->lock));
+}
+
+void stopPrefetch(struct t_prefetch *prefetch)
+{
+    pthread_mutex_lock(&(prefetch->lock));
+    prefetch->stop = 1;
+    pthread_cond_signal(&(prefetch->taken));
+    pthread_mutex_unlock(&(prefetch->lock));
+
+    pthread_join(prefetch->thread, NULL);
+    pthread_mutex_destroy(&(prefetch->lock));
+    pthread_cond_destroy(&(prefetch->taken));
+}
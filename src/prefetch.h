@@ -0,0 +1,41 @@
+/*
+ * File:    prefetch.h
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#ifndef PREFETCH_H
+#define	PREFETCH_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include "main.h"
+
+/*
+ * Read-ahead across work units. Workers read ahead only within the unit
+ * they aggregate, so without this the disk would wait for the hashing at
+ * the start of every file. A thread follows the units taken by workers
+ * and asks the kernel to read the following ones into the page cache
+ * (posix_fadvise), keeping a bounded amount of data ahead. The data is
+ * then mapped or read by the workers from memory.
+ */
+
+/* Bytes of units advised ahead of the workers, at least one unit is */
+#define EN_PREFETCH_AHEAD (128 * 1024 * 1024)
+
+struct t_prefetch
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t taken; //a worker took a unit or the work ended
+    struct t_work *work;
+    size_t skip; //first units taken by the workers right away
+    char stop;
+};
+
+/* Prototypes */
+int startPrefetch(struct t_prefetch *prefetch, struct t_work *work, size_t skip);
+void notifyPrefetch(struct t_prefetch *prefetch);
+void stopPrefetch(struct t_prefetch *prefetch);
+
+#endif /* PREFETCH_H */
@@ -0,0 +1,353 @@
+/*
+ * File:    reader.c
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "reader.h"
+#include "compress.h"
+#include "stats.h"
+
+/* Handler of a read range wrapped to count what it receives */
+struct t_countedHandler
+{
+    t_flowHandler handler;
+    void *data;
+    double handled; //seconds spent in the handler
+};
+
+static void printFileWarning(char *file, char *msg)
+{
+    fprintf(stderr, "WARN: %s: %s\n", file, msg);
+}
+
+static void printFileError(char *file, char *msg)
+{
+    fprintf(stderr, "ERR: %s: %s\n", file, msg);
+}
+
+/*
+ * Hand the mapped range to the handler window by window. The next window is
+ * announced to the kernel before the current one is aggregated, so the disk
+ * reads ahead while the CPU hashes.
+ */
+static int readMappedFile(char *file, int fd, off_t offset, size_t size, char last, t_flowHandler handler, void *data)
+{
+    /* Mapping has to start at a page boundary */
+    off_t start = offset & ~((off_t) sysconf(_SC_PAGESIZE) - 1);
+    size_t lead = offset - start;
+
+    char *map = mmap(NULL, lead + size, PROT_READ, MAP_PRIVATE, fd, start);
+    if (map == MAP_FAILED)
+        return 1;
+
+    madvise(map, lead + size, MADV_SEQUENTIAL);
+
+    /* Window is a multiple of the record size, so records never straddle */
+    size_t window = (EN_READ_WINDOW / sizeof (struct flow)) * sizeof (struct flow);
+    size_t records = size / sizeof (struct flow);
+    size_t end = lead + records * sizeof (struct flow);
+    size_t pos;
+
+    madvise(map, end - lead < window ? end : lead + window, MADV_WILLNEED);
+
+    for (pos = lead; pos < end; pos += window)
+    {
+        size_t length = end - pos < window ? end - pos : window;
+
+        if (pos + length < end)
+        {
+            /* Page align the start of the following window for madvise */
+            size_t next = (pos + length) & ~((size_t) sysconf(_SC_PAGESIZE) - 1);
+            size_t nextLength = end - next < window ? end - next : window;
+            madvise(map + next, nextLength, MADV_WILLNEED);
+        }
+
+        handler((const struct flow *) (map + pos), length / sizeof (struct flow), data);
+    }
+
+    if (last && records * sizeof (struct flow) != size)
+        printFileWarning(file, "Truncated trailing record ignored!");
+
+    munmap(map, lead + size);
+    return 0;
+}
+
+/*
+ * Fallback for pipes, devices and file systems without mmap support. The
+ * input is read in large chunks, handing over only complete records; a
+ * negative length reads until the end of the input.
+ */
+static int readBufferedFile(char *file, int fd, off_t length, t_flowHandler handler, void *data)
+{
+    size_t capacity = EN_READ_BUFFER_RECORDS * sizeof (struct flow);
+    struct flow *buffer = malloc(capacity);
+    size_t filled = 0;
+    ssize_t n;
+
+    if (buffer == NULL)
+    {
+        printFileError(file, "Unable to allocate read buffer!");
+        return 1;
+    }
+
+    if (length >= 0 && (size_t) length < capacity)
+        capacity = length;
+
+    while (capacity > filled && (n = read(fd, (char *) buffer + filled, capacity - filled)) != 0)
+    {
+        if (n < 0)
+        {
+            printFileError(file, "Unable to read file!");
+            free(buffer);
+            return 1;
+        }
+
+        filled += n;
+        if (length >= 0)
+            length -= n;
+
+        /* Keep reading until the buffer is full or the input ends */
+        if (filled < capacity)
+            continue;
+
+        handler(buffer, filled / sizeof (struct flow), data);
+
+        /* Move an incomplete record to the beginning of the buffer */
+        size_t rest = filled % sizeof (struct flow);
+        memmove(buffer, (char *) buffer + filled - rest, rest);
+        filled = rest;
+
+        if (length >= 0 && (size_t) length < capacity - filled)
+            capacity = filled + length;
+    }
+
+    if (filled >= sizeof (struct flow))
+        handler(buffer, filled / sizeof (struct flow), data);
+
+    if (filled % sizeof (struct flow) != 0)
+        printFileWarning(file, "Truncated trailing record ignored!");
+
+    free(buffer);
+    return 0;
+}
+
+int readFlowFile(char *file, t_flowHandler handler, void *data)
+{
+    return readFlowRange(file, 0, -1, handler, data);
+}
+
+static void countFlows(const struct flow *fl, size_t count, void *data)
+{
+    struct t_countedHandler *counted = data;
+    double start = getStatsTime();
+    counted->handler(fl, count, counted->data);
+    counted->handled += getStatsTime() - start;
+    counters.records += count;
+}
+
+static int readCountedRange(char *file, off_t offset, off_t length, t_flowHandler handler, void *data)
+{
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        printFileError(file, "Unable to open file!");
+        return 1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        printFileError(file, "Unable to stat file!");
+        close(fd);
+        return 1;
+    }
+
+    int result;
+    int compression = S_ISREG(st.st_mode) ? detectCompression(fd) : EN_COMPRESS_NONE;
+    if (compression != EN_COMPRESS_NONE)
+    {
+        /* Offsets of records in a compressed file are unknown until it is decompressed */
+        if (offset != 0 || length >= 0)
+        {
+            printFileError(file, "Byte ranges of compressed files cannot be read!");
+            result = 1;
+        }
+        else
+            result = readCompressedFile(file, fd, compression, handler, data);
+    }
+    else if (S_ISREG(st.st_mode))
+    {
+        /* Clamp the range to the current file size */
+        if (offset > st.st_size)
+            offset = st.st_size;
+        if (length < 0 || offset + length > st.st_size)
+            length = st.st_size - offset;
+
+        char last = (offset + length == st.st_size);
+
+        if (length == 0)
+            result = 0;
+        else if (readMappedFile(file, fd, offset, length, last, handler, data) == 0)
+            result = 0;
+        else if (lseek(fd, offset, SEEK_SET) == offset)
+            result = readBufferedFile(file, fd, length, handler, data);
+        else
+        {
+            printFileError(file, "Unable to seek in file!");
+            result = 1;
+        }
+    }
+    else
+    {
+        /* Byte ranges make no sense on streams, read the whole input */
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        result = readBufferedFile(file, fd, -1, handler, data);
+    }
+
+    close(fd);
+    return result;
+}
+
+/* Time spent in the handler is aggregation, the rest of the range is reading */
+int readFlowRange(char *file, off_t offset, off_t length, t_flowHandler handler, void *data)
+{
+    struct t_countedHandler counted = {handler, data, 0};
+    double start = getStatsTime();
+    int result = readCountedRange(file, offset, length, countFlows, &counted);
+
+    if (offset == 0)
+        counters.files++;
+    counters.read += getStatsTime() - start - counted.handled;
+    counters.aggregate += counted.handled;
+    return result;
+}
+
+int addInputFile(struct t_fileList *list, char *name, struct stat *st)
+{
+    if (list->count == list->size)
+    {
+        size_t newSize = list->size ? list->size * 2 : 64;
+        struct t_inputFile *files = realloc(list->files, newSize * sizeof (struct t_inputFile));
+        if (files == NULL)
+            return 1;
+
+        list->files = files;
+        list->size = newSize;
+    }
+
+    list->files[list->count].name = name;
+    list->files[list->count].size = st->st_size;
+    list->files[list->count].regular = S_ISREG(st->st_mode);
+    list->files[list->count].compressed = 0;
+    list->files[list->count].offset = 0;
+    list->files[list->count].length = -1;
+    list->files[list->count].device = st->st_dev;
+    list->files[list->count].inode = st->st_ino;
+    list->files[list->count].mtime = st->st_mtim;
+
+    /* Streams are never probed, their first bytes would be lost */
+    int fd;
+    if (S_ISREG(st->st_mode) && (fd = open(name, O_RDONLY | O_CLOEXEC)) >= 0)
+    {
+        list->files[list->count].compressed = (detectCompression(fd) != EN_COMPRESS_NONE);
+        close(fd);
+    }
+
+    list->count++;
+    return 0;
+}
+
+int walkDirectory(char *directory, struct t_fileList *list)
+{
+    DIR *dir;
+    struct dirent *ent;
+    if ((dir = opendir(directory)) == NULL)
+    {
+        /* Unable to open directory */
+        printFileError(directory, "Unable to open given directory!");
+        return 1;
+    }
+
+    while ((ent = readdir(dir)) != NULL)
+    {
+        /* Skip special unix files . and .. */
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+
+        /* Get file name */
+        char * file = malloc(strlen(ent->d_name) + strlen(directory) + 1 + 1);
+        strcpy(file, directory);
+        strcat(file, "/");
+        strcat(file, ent->d_name);
+
+        /* File size is needed to split large files among workers, links to files are followed */
+        struct stat st;
+        char link = 0;
+        if (lstat(file, &st) != 0 || ((link = S_ISLNK(st.st_mode)) && stat(file, &st) != 0))
+        {
+            printFileError(file, "Unable to stat file!");
+            free(file);
+            closedir(dir);
+            return 1;
+        }
+
+        /* Links to directories are skipped, they could loop or count a directory twice */
+        if (link && S_ISDIR(st.st_mode))
+        {
+            free(file);
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode))
+        {
+            /* Recursively process directory */
+            int result = walkDirectory(file, list);
+            free(file);
+            if (result != 0)
+            {
+                closedir(dir);
+                return 1;
+            }
+        }
+        else if (addInputFile(list, file, &st) != 0)
+        {
+            printFileError(file, "Unable to allocate file list!");
+            free(file);
+            closedir(dir);
+            return 1;
+        }
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+void initFileList(struct t_fileList *list)
+{
+    list->files = NULL;
+    list->count = 0;
+    list->size = 0;
+}
+
+void finishFileList(struct t_fileList *list)
+{
+    size_t i;
+    for (i = 0; i < list->count; i++)
+    {
+        free(list->files[i].name);
+    }
+    free(list->files);
+    initFileList(list);
+}
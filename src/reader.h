@@ -0,0 +1,56 @@
+/*
+ * File:    reader.h
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#ifndef READER_H
+#define	READER_H
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "main.h"
+
+/* Size of a window handed over to the aggregation at once (mapped files) */
+#define EN_READ_WINDOW (16 * 1024 * 1024)
+
+/* Number of records read at once from files which cannot be mapped */
+#define EN_READ_BUFFER_RECORDS 65536
+
+/* Files larger than this are split into byte ranges among workers */
+#define EN_CHUNK_SIZE (64 * 1024 * 1024)
+
+struct t_inputFile
+{
+    char *name;
+    off_t size;
+    char regular; //byte ranges can be read only from regular files
+    char compressed; //decompressed as a whole, never split
+    off_t offset; //range of the file to be read
+    off_t length; //-1 reads up to the end of file
+    dev_t device; //identity of the file for cached partial aggregates
+    ino_t inode;
+    struct timespec mtime;
+};
+
+struct t_fileList
+{
+    struct t_inputFile *files;
+    size_t count;
+    size_t size;
+};
+
+/* Callback receiving a block of complete flow records */
+typedef void (*t_flowHandler)(const struct flow *fl, size_t count, void *data);
+
+/* Prototypes */
+int readFlowFile(char *file, t_flowHandler handler, void *data);
+int readFlowRange(char *file, off_t offset, off_t length, t_flowHandler handler, void *data);
+int addInputFile(struct t_fileList *list, char *name, struct stat *st);
+int walkDirectory(char *directory, struct t_fileList *list);
+void initFileList(struct t_fileList *list);
+void finishFileList(struct t_fileList *list);
+
+#endif /* READER_H */
@@ -0,0 +1,208 @@
+/*
+ * File:    result.c
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "result.h"
+#include "stats.h"
+
+/* Offset aligned for the next column */
+static inline uint64_t alignResult(uint64_t offset)
+{
+    return (offset + 7) & ~(uint64_t) 7;
+}
+
+/* Type of keys of given aggregation key, addresses of both families share IPv6 keys */
+static void getResultKey(int aggkey, uint32_t *type, uint32_t *size)
+{
+    if (aggkey == EN_AGG_SRCPORT || aggkey == EN_AGG_DSTPORT)
+    {
+        *type = EN_DATA_PORT;
+        *size = sizeof (uint16_t);
+    }
+    else if (aggkey == EN_AGG_SRCIP4 || aggkey == EN_AGG_DSTIP4)
+    {
+        *type = EN_DATA_IP4;
+        *size = sizeof (uint32_t);
+    }
+    else if (aggkey == EN_AGG_TUPLE)
+    {
+        *type = EN_DATA_TUPLE;
+        *size = sizeof (struct t_tupleKey);
+    }
+    else
+    {
+        *type = EN_DATA_IP6;
+        *size = sizeof (struct in6_addr);
+    }
+}
+
+/* Copy the key of an entry to its column */
+static void putResultKey(char *dst, const struct t_dataStruct *d, uint32_t type)
+{
+    struct in6_addr mapped;
+    switch (d->used)
+    {
+    case EN_DATA_PORT:
+        memcpy(dst, &(d->port), sizeof (uint16_t));
+        break;
+    case EN_DATA_IP4:
+        if (type == EN_DATA_IP4)
+        {
+            memcpy(dst, &(d->addr4), sizeof (uint32_t));
+            break;
+        }
+        memset(&mapped, 0, sizeof (mapped));
+        mapped.s6_addr32[2] = htonl(0xffff);
+        mapped.s6_addr32[3] = d->addr4;
+        memcpy(dst, &mapped, sizeof (mapped));
+        break;
+    case EN_DATA_IP6:
+        memcpy(dst, &(d->addr6), sizeof (struct in6_addr));
+        break;
+    case EN_DATA_TUPLE:
+        memcpy(dst, &(d->tupleKey), sizeof (struct t_tupleKey));
+        break;
+    }
+}
+
+static int writeAll(int fd, const char *buffer, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t n = write(fd, buffer, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        buffer += n;
+        size -= n;
+    }
+    return 0;
+}
+
+int writeResult(struct t_report *report, int sortkey, uint32_t topN, int threads)
+{
+    struct t_aggregation *aggregation = &(report->aggregation);
+
+    double start = getStatsTime();
+    struct t_sortArray array;
+    if (initSortArray(&array, getAggregationCount(aggregation), topN) != 0)
+    {
+        printError("Unable to allocate the sort array!");
+        return 1;
+    }
+    sortAggregation(&array, aggregation, sortkey, threads);
+    addPhaseTime(EN_PHASE_SORT, start);
+    start = getStatsTime();
+
+    /* Columns follow the header one by one */
+    struct t_resultHeader header;
+    memset(&header, 0, sizeof (header));
+    memcpy(header.magic, EN_RESULT_MAGIC, sizeof (header.magic));
+    header.version = EN_RESULT_VERSION;
+    header.order = EN_RESULT_ORDER;
+    header.aggkey = report->aggkey;
+    header.mask = report->mask;
+    header.sortkey = sortkey;
+    header.spec = aggregation->spec;
+    header.count = array.count;
+    getResultKey(report->aggkey, &(header.keyType), &(header.keySize));
+
+    uint64_t size = alignResult(sizeof (header));
+    header.keys = size;
+    size = alignResult(size + header.count * header.keySize);
+    header.packets = size;
+    size += header.count * sizeof (uint64_t);
+    header.bytes = size;
+    size += header.count * sizeof (uint64_t);
+    if (aggregation->peers)
+    {
+        header.columns |= EN_RESULT_PEERS;
+        header.peers = size;
+        size += header.count * sizeof (uint64_t);
+    }
+    if (aggregation->summary != NULL)
+    {
+        header.columns |= EN_RESULT_ERROR;
+        header.error = size;
+        size += header.count * sizeof (uint64_t);
+    }
+
+    /* The whole result is built in memory and written at once */
+    char *buffer = calloc(1, size);
+    if (buffer == NULL)
+    {
+        printError("Unable to allocate binary result!");
+        finishSortArray(&array);
+        return 1;
+    }
+    memcpy(buffer, &header, sizeof (header));
+
+    struct t_dataStruct d;
+    uint32_t i;
+    for (i = 0; i < array.count; i++)
+    {
+        getAggregationEntry(aggregation, array.items[i].key, &d);
+        putResultKey(buffer + header.keys + (uint64_t) i * header.keySize, &d, header.keyType);
+        memcpy(buffer + header.packets + (uint64_t) i * sizeof (uint64_t), &(d.packets), sizeof (uint64_t));
+        memcpy(buffer + header.bytes + (uint64_t) i * sizeof (uint64_t), &(d.bytes), sizeof (uint64_t));
+        if (header.peers != 0)
+            memcpy(buffer + header.peers + (uint64_t) i * sizeof (uint64_t), &(d.peers), sizeof (uint64_t));
+        if (header.error != 0)
+            memcpy(buffer + header.error + (uint64_t) i * sizeof (uint64_t), &(d.error), sizeof (uint64_t));
+    }
+    finishSortArray(&array);
+
+    if (report->file == NULL)
+    {
+        int result = writeAll(STDOUT_FILENO, buffer, size);
+        if (result != 0)
+            printError("Writing of the output failed!");
+        free(buffer);
+        addPhaseTime(EN_PHASE_PRINT, start);
+        return result;
+    }
+
+    /* Renamed over the previous result, so readers which mapped it are never cut short */
+    char *tmpFile = malloc(strlen(report->file) + 32);
+    if (tmpFile == NULL)
+    {
+        printError("Unable to allocate file name!");
+        free(buffer);
+        return 1;
+    }
+    sprintf(tmpFile, "%s.%ld.tmp", report->file, (long) getpid());
+    int fd = open(tmpFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "ERR: %s: %s\n", tmpFile, strerror(errno));
+        free(tmpFile);
+        free(buffer);
+        return 1;
+    }
+
+    int result = writeAll(fd, buffer, size);
+    if (close(fd) != 0)
+        result = 1;
+    if (result != 0 || rename(tmpFile, report->file) != 0)
+    {
+        fprintf(stderr, "ERR: %s: Writing of the report failed!\n", report->file);
+        unlink(tmpFile);
+        result = 1;
+    }
+
+    free(tmpFile);
+    free(buffer);
+    addPhaseTime(EN_PHASE_PRINT, start);
+    return result;
+}
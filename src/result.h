@@ -0,0 +1,61 @@
+/*
+ * File:    result.h
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#ifndef RESULT_H
+#define	RESULT_H
+
+#include <stdint.h>
+#include "main.h"
+
+/*
+ * Binary result format, an alternative to the CSV report meant to be
+ * mapped into memory and used as it is. The header is followed by the
+ * columns of all entries in the sorted order: fixed width keys, packets,
+ * bytes and optionally estimated peers and approximation errors. Offsets
+ * of the columns are given by the header and aligned to 8 bytes. Numbers
+ * are in the byte order of the writer, which the header tells; addresses
+ * are in network order.
+ *
+ * Keys by their type:
+ *   EN_DATA_PORT   uint16_t port
+ *   EN_DATA_IP4    4 bytes of IPv4 address (keys srcip4 and dstip4)
+ *   EN_DATA_IP6    16 bytes of IPv6 address, IPv4 address mapped to
+ *                  ::ffff:0:0/96 (keys srcip, dstip, srcip6 and dstip6)
+ *   EN_DATA_TUPLE  struct t_tupleKey, fields are given by the spec
+ */
+
+#define EN_RESULT_MAGIC "FLOWRSLT"
+#define EN_RESULT_VERSION 1
+#define EN_RESULT_ORDER 0x01020304u
+
+/* Optional columns */
+#define EN_RESULT_PEERS 1
+#define EN_RESULT_ERROR 2
+
+struct t_resultHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t order; //EN_RESULT_ORDER as written
+    int32_t aggkey;
+    int32_t mask;
+    int32_t sortkey;
+    uint32_t keyType; //EN_DATA_* value
+    uint32_t keySize; //bytes of a key
+    uint32_t columns; //optional columns present
+    struct t_tupleSpec spec; //fields of composite keys
+    uint64_t count; //number of entries
+    uint64_t keys; //offsets of the columns in the file
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t peers; //0 without the column
+    uint64_t error; //0 without the column
+};
+
+/* Prototypes */
+int writeResult(struct t_report *report, int sortkey, uint32_t topN, int threads);
+
+#endif /* RESULT_H */
@@ -0,0 +1,301 @@
+/*
+ * File:    sort.c
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "sort.h"
+
+int compareSortStruct(const void * a, const void * b, void *array)
+{
+    if (precedesSortStruct(array, a, b))
+        return -1;
+    else if (precedesSortStruct(array, b, a))
+        return 1;
+    else
+        return 0;
+}
+
+int initSortArray(struct t_sortArray *array, uint32_t count, uint32_t limit)
+{
+    /* The array never holds more than the limit */
+    if (limit != 0 && limit < count)
+        count = limit;
+
+    array->items = malloc(count * sizeof (struct t_sortStruct) + 1);
+    array->count = 0;
+    array->limit = limit;
+    array->tie = NULL;
+    array->tieData = NULL;
+    return array->items == NULL ? 1 : 0;
+}
+
+void finishSortArray(struct t_sortArray *array)
+{
+    free(array->items);
+    array->items = NULL;
+    array->count = 0;
+}
+
+/* Restore the heap below given position, the last entry of output on top */
+static void siftDown(struct t_sortArray *array, uint32_t count, uint32_t i)
+{
+    struct t_sortStruct *heap = array->items;
+    struct t_sortStruct item = heap[i];
+
+    for (;;)
+    {
+        uint32_t child = 2 * i + 1;
+        if (child >= count)
+            break;
+        if (child + 1 < count && precedesSortStruct(array, &heap[child], &heap[child + 1]))
+            child++;
+        if (!precedesSortStruct(array, &item, &heap[child]))
+            break;
+
+        heap[i] = heap[child];
+        i = child;
+    }
+
+    heap[i] = item;
+}
+
+void pushTopN(struct t_sortArray *array, const struct t_sortStruct *item)
+{
+    /* Sift the new entry up from the end of the heap */
+    uint32_t i = array->count++;
+    while (i > 0 && precedesSortStruct(array, &(array->items[(i - 1) / 2]), item))
+    {
+        array->items[i] = array->items[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+
+    array->items[i] = *item;
+}
+
+void replaceTopN(struct t_sortArray *array, const struct t_sortStruct *item)
+{
+    /* The last of the top entries drops out */
+    array->items[0] = *item;
+    siftDown(array, array->count, 0);
+}
+
+/*
+ * Radix digit of an entry. Digits 0-3 are bytes of the rank, digits 4-11
+ * bytes of the negated value, so ascending order of the digits is the
+ * output order and the least significant digit comes first.
+ */
+static inline uint32_t getRadixDigit(const struct t_sortStruct *item, int digit)
+{
+    if (digit < 4)
+        return (item->rank >> (digit * 8)) & 0xff;
+    else
+        return (~item->value >> ((digit - 4) * 8)) & 0xff;
+}
+
+void *radixWorker(void *arg)
+{
+    struct t_radixJob *job = (struct t_radixJob *) arg;
+    struct t_radixSort *sort = job->sort;
+    uint32_t from = (uint64_t) sort->count * job->id / sort->threads;
+    uint32_t to = (uint64_t) sort->count * (job->id + 1) / sort->threads;
+    struct t_sortStruct *src = sort->items;
+    struct t_sortStruct *dst = sort->buffer;
+    uint32_t *counts = sort->counts[job->id];
+
+    /* The barrier counts on all threads, none may enter it if some did not start */
+    pthread_mutex_lock(&sort->lock);
+    while (sort->state == 0)
+    {
+        pthread_cond_wait(&sort->started, &sort->lock);
+    }
+    int state = sort->state;
+    pthread_mutex_unlock(&sort->lock);
+    if (state < 0)
+        return NULL;
+
+    int p;
+    for (p = 0; p < sort->npasses; p++)
+    {
+        int digit = sort->passes[p];
+        uint32_t i;
+
+        /* Count digits of own range of entries */
+        memset(counts, 0, 256 * sizeof (uint32_t));
+        for (i = from; i < to; i++)
+        {
+            counts[getRadixDigit(&src[i], digit)]++;
+        }
+        pthread_barrier_wait(&sort->barrier);
+
+        /* Turn counts into offsets; threads follow each other in a digit, which keeps the sort stable */
+        if (job->id == 0)
+        {
+            uint32_t offset = 0;
+            uint32_t d, t;
+            for (d = 0; d < 256; d++)
+            {
+                for (t = 0; t < sort->threads; t++)
+                {
+                    uint32_t count = sort->counts[t][d];
+                    sort->counts[t][d] = offset;
+                    offset += count;
+                }
+            }
+        }
+        pthread_barrier_wait(&sort->barrier);
+
+        for (i = from; i < to; i++)
+        {
+            dst[counts[getRadixDigit(&src[i], digit)]++] = src[i];
+        }
+        pthread_barrier_wait(&sort->barrier);
+
+        struct t_sortStruct *tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+    /* After an odd number of passes the entries are in the buffer */
+    if (src != sort->items)
+    {
+        memcpy(sort->items + from, src + from, (to - from) * sizeof (struct t_sortStruct));
+    }
+
+    return NULL;
+}
+
+void radixSortArray(struct t_sortStruct *items, uint32_t count, int threads)
+{
+    struct t_sortArray plain = {items, count, 0, NULL, NULL}; //no tie function
+    struct t_radixSort sort;
+    uint32_t histogram[12][256];
+    uint32_t i;
+    int d;
+
+    /* Digits which are the same in all entries would not move anything */
+    memset(histogram, 0, sizeof (histogram));
+    for (i = 0; i < count; i++)
+    {
+        for (d = 0; d < 12; d++)
+        {
+            histogram[d][getRadixDigit(&items[i], d)]++;
+        }
+    }
+
+    sort.npasses = 0;
+    for (d = 0; d < 12; d++)
+    {
+        if (histogram[d][getRadixDigit(&items[0], d)] != count)
+            sort.passes[sort.npasses++] = d;
+    }
+    if (sort.npasses == 0)
+        return;
+
+    /* Small ranges are not worth a thread */
+    if (threads < 1)
+        threads = 1;
+    if ((uint32_t) threads > count / 65536 + 1)
+        threads = count / 65536 + 1;
+
+    sort.items = items;
+    sort.buffer = malloc(count * sizeof (struct t_sortStruct));
+    sort.count = count;
+    sort.threads = threads;
+    sort.counts = malloc(threads * sizeof (*sort.counts));
+    if (sort.buffer == NULL || sort.counts == NULL)
+    {
+        /* Fall back to the comparison sort without the memory */
+        free(sort.buffer);
+        free(sort.counts);
+        qsort_r(items, count, sizeof (struct t_sortStruct), compareSortStruct, &plain);
+        return;
+    }
+    pthread_barrier_init(&sort.barrier, NULL, threads);
+    pthread_mutex_init(&sort.lock, NULL);
+    pthread_cond_init(&sort.started, NULL);
+    sort.state = 0;
+
+    struct t_radixJob jobs[threads];
+    int t;
+    for (t = 0; t < threads; t++)
+    {
+        jobs[t].sort = &sort;
+        jobs[t].id = t;
+    }
+
+    /* The calling thread sorts the first range itself */
+    int started;
+    for (started = 1; started < threads; started++)
+    {
+        if (pthread_create(&(jobs[started].thread), NULL, radixWorker, &jobs[started]) != 0)
+            break;
+    }
+    pthread_mutex_lock(&sort.lock);
+    sort.state = started == threads ? 1 : -1;
+    pthread_cond_broadcast(&sort.started);
+    pthread_mutex_unlock(&sort.lock);
+
+    if (sort.state > 0)
+        radixWorker(&jobs[0]);
+    for (t = 1; t < started; t++)
+    {
+        pthread_join(jobs[t].thread, NULL);
+    }
+
+    pthread_cond_destroy(&sort.started);
+    pthread_mutex_destroy(&sort.lock);
+    pthread_barrier_destroy(&sort.barrier);
+    free(sort.buffer);
+    free(sort.counts);
+
+    /* Fall back to the comparison sort without the threads */
+    if (started < threads)
+        qsort_r(items, count, sizeof (struct t_sortStruct), compareSortStruct, &plain);
+}
+
+void sortSortArray(struct t_sortArray *array, int threads)
+{
+    if (array->limit == 0)
+    {
+        if (array->count < EN_RADIX_MIN)
+        {
+            qsort_r(array->items, array->count, sizeof (struct t_sortStruct), compareSortStruct, array);
+            return;
+        }
+        radixSortArray(array->items, array->count, threads);
+
+        /* Runs of equal value and rank are ordered by the tie function */
+        uint32_t from = 0, to;
+        while (array->tie != NULL && from < array->count)
+        {
+            to = from + 1;
+            while (to < array->count &&
+                array->items[to].value == array->items[from].value &&
+                array->items[to].rank == array->items[from].rank)
+            {
+                to++;
+            }
+            if (to - from > 1)
+                qsort_r(array->items + from, to - from, sizeof (struct t_sortStruct), compareSortStruct, array);
+            from = to;
+        }
+        return;
+    }
+
+    /* Heapsort leaves the entries in the output order */
+    uint32_t n = array->count;
+    while (n > 1)
+    {
+        struct t_sortStruct tmp = array->items[0];
+        n--;
+        array->items[0] = array->items[n];
+        array->items[n] = tmp;
+        siftDown(array, n, 0);
+    }
+}
@@ -0,0 +1,107 @@
+/*
+ * File:    sort.h
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#ifndef SORT_H
+#define	SORT_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Entry of the sorted output. Entries are ordered by value, descending;
+ * entries of equal value by rank, ascending, and entries of equal rank by
+ * the tie function of the array. Rank is the port number for ports, the
+ * IPv4 address and the first 32 bits of the IPv6 address for addresses,
+ * all in host order; the tie function orders the rest of the key.
+ */
+struct t_sortStruct
+{
+    uint32_t key;
+    uint32_t rank;
+    uint64_t value;
+};
+
+/*
+ * Entries to be sorted. With a limit set, only the limit first entries are
+ * kept in a min-heap while the entries are pushed, so selecting the top
+ * entries costs O(count log limit). All entries are sorted by radix sort.
+ */
+/* Order of two keys of equal value and rank, negative if a goes first */
+typedef int (*t_sortTie)(uint32_t keyA, uint32_t keyB, void *data);
+
+struct t_sortArray
+{
+    struct t_sortStruct *items;
+    uint32_t count;
+    uint32_t limit; //number of top entries to keep, 0 keeps all
+    t_sortTie tie; //NULL if rank is the whole key
+    void *tieData;
+};
+
+/* Entries below this count are sorted by qsort() instead of radix sort */
+#define EN_RADIX_MIN 256
+
+/* Radix sort shared by all sorting threads */
+struct t_radixSort
+{
+    struct t_sortStruct *items;
+    struct t_sortStruct *buffer;
+    uint32_t count;
+    uint32_t threads;
+    int passes[12]; //digits which are not the same in all entries
+    int npasses;
+    uint32_t (*counts)[256]; //digit counts, then offsets of every thread
+    pthread_barrier_t barrier;
+
+    /* Threads start sorting only once all of them are running */
+    pthread_mutex_t lock;
+    pthread_cond_t started;
+    int state; //0 while threads are started, 1 to sort, -1 if some did not start
+};
+
+struct t_radixJob
+{
+    pthread_t thread;
+    struct t_radixSort *sort;
+    uint32_t id;
+};
+
+/* Prototypes */
+int compareSortStruct(const void * a, const void * b, void *array);
+int initSortArray(struct t_sortArray *array, uint32_t count, uint32_t limit);
+void finishSortArray(struct t_sortArray *array);
+void pushTopN(struct t_sortArray *array, const struct t_sortStruct *item);
+void replaceTopN(struct t_sortArray *array, const struct t_sortStruct *item);
+void sortSortArray(struct t_sortArray *array, int threads);
+void *radixWorker(void *arg);
+void radixSortArray(struct t_sortStruct *items, uint32_t count, int threads);
+
+/* Whether entry a precedes entry b in the output */
+static inline int precedesSortStruct(const struct t_sortArray *array, const struct t_sortStruct *a, const struct t_sortStruct *b)
+{
+    if (a->value != b->value)
+        return a->value > b->value;
+    if (a->rank != b->rank)
+        return a->rank < b->rank;
+    return array->tie != NULL && array->tie(a->key, b->key, array->tieData) < 0;
+}
+
+static inline void pushSortArray(struct t_sortArray *array, uint64_t value, uint32_t key, uint32_t rank)
+{
+    struct t_sortStruct item;
+    item.key = key;
+    item.rank = rank;
+    item.value = value;
+
+    if (array->limit == 0)
+        array->items[array->count++] = item;
+    else if (array->count < array->limit)
+        pushTopN(array, &item);
+    else if (precedesSortStruct(array, &item, &(array->items[0])))
+        replaceTopN(array, &item);
+}
+
+#endif /* SORT_H */
@@ -0,0 +1,483 @@
+/*
+ * File:    spill.c
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+
+#include "spill.h"
+#include "stats.h"
+
+/* Sorted run of a single partition and its position while the runs are merged */
+struct t_run
+{
+    off_t offset; //first entry in the file of runs
+    uint32_t count;
+    uint32_t next; //next entry to be read from the file
+    struct t_runEntry *buffer;
+    uint32_t buffered;
+    uint32_t head; //first entry of the buffer not merged yet
+};
+
+static uint64_t hashIP4Slot(const void *slot)
+{
+    return hashIP4(&(((const struct t_ip4Slot *) slot)->key));
+}
+
+static uint64_t hashIP6Slot(const void *slot)
+{
+    return hashIP6(&(((const struct t_ip6Slot *) slot)->key));
+}
+
+static uint64_t hashTupleSlot(const void *slot)
+{
+    return hashTuple(&(((const struct t_tupleSlot *) slot)->key));
+}
+
+/* Anonymous temporary file, removed as soon as it is closed */
+static int createTempFile(void)
+{
+    const char *directory = getenv("TMPDIR");
+    if (directory == NULL || directory[0] == '\0')
+        directory = "/tmp";
+
+    char *path = malloc(strlen(directory) + 32);
+    if (path == NULL)
+        return -1;
+    sprintf(path, "%s/flow-spill-XXXXXX", directory);
+
+    int fd = mkostemp(path, O_CLOEXEC);
+    if (fd < 0)
+        fprintf(stderr, "ERR: %s: %s\n", directory, strerror(errno));
+    else
+        unlink(path);
+    free(path);
+    return fd;
+}
+
+static int writeAllAt(int fd, const char *buffer, size_t size, off_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t n = pwrite(fd, buffer, size, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        buffer += n;
+        offset += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int readAllAt(int fd, char *buffer, size_t size, off_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t n = pread(fd, buffer, size, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        buffer += n;
+        offset += n;
+        size -= n;
+    }
+    return 0;
+}
+
+void initSpill(struct t_spill *spill)
+{
+    int k, p;
+    for (k = 0; k < EN_SPILL_KINDS; k++)
+    {
+        for (p = 0; p < EN_SPILL_PARTS; p++)
+        {
+            spill->files[k][p].fd = -1;
+            spill->files[k][p].size = 0;
+        }
+    }
+    pthread_mutex_init(&(spill->lock), NULL);
+    spill->used = 0;
+    spill->failed = 0;
+}
+
+void finishSpill(struct t_spill *spill)
+{
+    int k, p;
+    for (k = 0; k < EN_SPILL_KINDS; k++)
+    {
+        for (p = 0; p < EN_SPILL_PARTS; p++)
+        {
+            if (spill->files[k][p].fd >= 0)
+                close(spill->files[k][p].fd);
+            spill->files[k][p].fd = -1;
+        }
+    }
+    pthread_mutex_destroy(&(spill->lock));
+}
+
+/* Files of all partitions of a kind, created by the first spill of the kind */
+static struct t_spillFile *openSpillFiles(struct t_spill *spill, int kind)
+{
+    struct t_spillFile *files = spill->files[kind];
+    int p;
+
+    pthread_mutex_lock(&(spill->lock));
+    for (p = 0; p < EN_SPILL_PARTS && !spill->failed; p++)
+    {
+        if (files[p].fd < 0 && (files[p].fd = createTempFile()) < 0)
+            spill->failed = 1;
+    }
+    spill->used = 1;
+    pthread_mutex_unlock(&(spill->lock));
+
+    return spill->failed ? NULL : files;
+}
+
+/* Append to a file shared by the workers, the range is reserved first */
+static int appendSpill(struct t_spillFile *file, const char *buffer, size_t size)
+{
+    off_t offset = __sync_fetch_and_add(&(file->size), (off_t) size);
+    return writeAllAt(file->fd, buffer, size, offset);
+}
+
+/* Append used slots of a settled table to the files of their partitions */
+static int spillTable(struct t_spill *spill, int kind, const uint8_t *tags, const char *slots, uint32_t capacity,
+                      size_t slotSize, uint64_t (*hash)(const void *slot))
+{
+    struct t_spillFile *files = openSpillFiles(spill, kind);
+    char *buffers = malloc(EN_SPILL_PARTS * EN_SPILL_BUFFER);
+    size_t used[EN_SPILL_PARTS];
+    int result = (files == NULL || buffers == NULL);
+    uint32_t i;
+    int p;
+
+    memset(used, 0, sizeof (used));
+    for (i = 0; i < capacity && result == 0; i++)
+    {
+        if (tags[i] == EN_TAG_EMPTY)
+            continue;
+
+        const char *slot = slots + (size_t) i * slotSize;
+        p = partitionHash(hash(slot), EN_SPILL_PARTS);
+        char *buffer = buffers + (size_t) p * EN_SPILL_BUFFER;
+        memcpy(buffer + used[p], slot, slotSize);
+        used[p] += slotSize;
+
+        if (used[p] + slotSize > EN_SPILL_BUFFER)
+        {
+            result = appendSpill(&files[p], buffer, used[p]);
+            used[p] = 0;
+        }
+    }
+
+    for (p = 0; p < EN_SPILL_PARTS && result == 0; p++)
+    {
+        if (used[p] > 0)
+            result = appendSpill(&files[p], buffers + (size_t) p * EN_SPILL_BUFFER, used[p]);
+    }
+
+    free(buffers);
+    if (result != 0)
+        spill->failed = 1;
+    return result;
+}
+
+int spillAggregation(struct t_spill *spill, struct t_aggregation *aggregation)
+{
+    int result = 0;
+    uint32_t p;
+
+    for (p = 0; p < aggregation->parts; p++)
+    {
+        if (aggregation->ip4 != NULL)
+        {
+            struct t_ip4Table *table = &(aggregation->ip4[p]);
+            settleIP4Table(table);
+            result |= spillTable(spill, EN_SPILL_IP4, table->tags, (const char *) table->slots, table->capacity,
+                                 sizeof (struct t_ip4Slot), hashIP4Slot);
+            clearIP4Table(table);
+        }
+        if (aggregation->ip6 != NULL)
+        {
+            struct t_ip6Table *table = &(aggregation->ip6[p]);
+            settleIP6Table(table);
+            result |= spillTable(spill, EN_SPILL_IP6, table->tags, (const char *) table->slots, table->capacity,
+                                 sizeof (struct t_ip6Slot), hashIP6Slot);
+            clearIP6Table(table);
+        }
+        if (aggregation->tuples != NULL)
+        {
+            struct t_tupleTable *table = &(aggregation->tuples[p]);
+            settleTupleTable(table);
+            result |= spillTable(spill, EN_SPILL_TUPLE, table->tags, (const char *) table->slots, table->capacity,
+                                 sizeof (struct t_tupleSlot), hashTupleSlot);
+            clearTupleTable(table);
+        }
+    }
+
+    counters.spills++;
+    return result;
+}
+
+/* Aggregate the spilled slots of a partition of all kinds */
+static int loadSpillPartition(struct t_spill *spill, int part, struct t_aggregation *aggregation)
+{
+    static const size_t slotSizes[EN_SPILL_KINDS] = {
+        sizeof (struct t_ip4Slot), sizeof (struct t_ip6Slot), sizeof (struct t_tupleSlot)
+    };
+    char *buffer = malloc(EN_SPILL_BUFFER);
+    int result = (buffer == NULL);
+    int k;
+
+    for (k = 0; k < EN_SPILL_KINDS && result == 0; k++)
+    {
+        struct t_spillFile *file = &(spill->files[k][part]);
+        size_t chunk = EN_SPILL_BUFFER / slotSizes[k] * slotSizes[k];
+        off_t offset;
+        if (file->fd < 0)
+            continue;
+
+        for (offset = 0; offset < file->size && result == 0; offset += chunk)
+        {
+            size_t size = file->size - offset < (off_t) chunk ? (size_t) (file->size - offset) : chunk;
+            if (readAllAt(file->fd, buffer, size, offset) != 0)
+            {
+                result = 1;
+                break;
+            }
+
+            size_t i;
+            for (i = 0; i < size / slotSizes[k]; i++)
+            {
+                if (k == EN_SPILL_IP4)
+                {
+                    const struct t_ip4Slot *slot = (const struct t_ip4Slot *) buffer + i;
+                    addIP4Table(&(aggregation->ip4[0]), &(slot->key), hashIP4(&(slot->key)), slot->packets, slot->bytes);
+                }
+                else if (k == EN_SPILL_IP6)
+                {
+                    const struct t_ip6Slot *slot = (const struct t_ip6Slot *) buffer + i;
+                    addIP6Table(&(aggregation->ip6[0]), &(slot->key), hashIP6(&(slot->key)), slot->packets, slot->bytes);
+                }
+                else
+                {
+                    const struct t_tupleSlot *slot = (const struct t_tupleSlot *) buffer + i;
+                    addTupleTable(&(aggregation->tuples[0]), &(slot->key), hashTuple(&(slot->key)), slot->packets, slot->bytes);
+                }
+            }
+        }
+    }
+
+    free(buffer);
+    return result;
+}
+
+/* Rank of an entry, the same as the rank of its key in the sort array */
+static uint32_t getEntryRank(const struct t_dataStruct *d, const struct t_tupleSpec *spec)
+{
+    switch (d->used)
+    {
+    case EN_DATA_PORT:
+        return d->port;
+    case EN_DATA_IP4:
+        return ntohl(d->addr4);
+    case EN_DATA_IP6:
+        return ntohl(d->addr6.s6_addr32[0]);
+    default:
+        return getTupleRank(&(d->tupleKey), spec);
+    }
+}
+
+/* Whether entry a precedes entry b in the report, the order of sortAggregation() */
+static int precedesRunEntry(const struct t_runEntry *a, const struct t_runEntry *b, const struct t_tupleSpec *spec)
+{
+    if (a->value != b->value)
+        return a->value > b->value;
+
+    uint32_t rankA = getEntryRank(&(a->d), spec);
+    uint32_t rankB = getEntryRank(&(b->d), spec);
+    if (rankA != rankB)
+        return rankA < rankB;
+
+    if (a->d.used != b->d.used)
+        return a->d.used < b->d.used;
+    if (a->d.used == EN_DATA_IP6)
+        return memcmp(&(a->d.addr6), &(b->d.addr6), sizeof (struct in6_addr)) < 0;
+    if (a->d.used == EN_DATA_TUPLE)
+        return compareTupleKeys(&(a->d.tupleKey), &(b->d.tupleKey), spec) < 0;
+    return 0;
+}
+
+/* Aggregate, sort and store every partition as a sorted run */
+static int writeRuns(struct t_report *report, int sortkey, uint32_t topN, int threads, int fd, struct t_run *runs)
+{
+    struct t_runEntry *buffer = malloc(EN_SPILL_RUN * sizeof (struct t_runEntry));
+    off_t offset = 0;
+    int result = (buffer == NULL);
+    int p;
+
+    for (p = 0; p < EN_SPILL_PARTS && result == 0; p++)
+    {
+        double start = getStatsTime();
+        struct t_aggregation part;
+        result = initAggregation(&part, report->aggkey, &(report->spec), 1, EN_TABLE_INIT);
+        if (result == 0)
+            result = loadSpillPartition(report->spill, p, &part) | isAggregationFailed(&part);
+        addPhaseTime(EN_PHASE_MERGE, start);
+
+        start = getStatsTime();
+        struct t_sortArray array;
+        if (initSortArray(&array, getAggregationCount(&part), topN) != 0)
+            result = 1;
+        else
+            sortAggregation(&array, &part, sortkey, threads);
+
+        runs[p].offset = offset;
+        runs[p].count = array.count;
+        uint32_t i, n = 0;
+        for (i = 0; i < array.count && result == 0; i++)
+        {
+            struct t_runEntry *entry = &buffer[n++];
+            getAggregationEntry(&part, array.items[i].key, &(entry->d));
+            entry->value = sortkey == EN_SORT_BYTES ? entry->d.bytes : entry->d.packets;
+            if (n == EN_SPILL_RUN || i + 1 == array.count)
+            {
+                result = writeAllAt(fd, (const char *) buffer, n * sizeof (struct t_runEntry), offset);
+                offset += n * sizeof (struct t_runEntry);
+                n = 0;
+            }
+        }
+
+        finishSortArray(&array);
+        finishAggregation(&part);
+        addPhaseTime(EN_PHASE_SORT, start);
+    }
+
+    free(buffer);
+    return result;
+}
+
+/* Entry at the head of a run, NULL once the run is merged */
+static struct t_runEntry *getRunHead(struct t_run *run, int fd, int *failed)
+{
+    if (run->head == run->buffered)
+    {
+        uint32_t n = run->count - run->next < EN_SPILL_RUN ? run->count - run->next : EN_SPILL_RUN;
+        if (n == 0)
+            return NULL;
+        if (readAllAt(fd, (char *) run->buffer, n * sizeof (struct t_runEntry),
+                      run->offset + (off_t) run->next * sizeof (struct t_runEntry)) != 0)
+        {
+            *failed = 1;
+            return NULL;
+        }
+        run->next += n;
+        run->buffered = n;
+        run->head = 0;
+    }
+    return &(run->buffer[run->head]);
+}
+
+static void siftRunHeap(struct t_run **heap, struct t_runEntry **heads, int count, int i, const struct t_tupleSpec *spec)
+{
+    for (;;)
+    {
+        int first = i;
+        int left = 2 * i + 1, right = 2 * i + 2;
+        if (left < count && precedesRunEntry(heads[left], heads[first], spec))
+            first = left;
+        if (right < count && precedesRunEntry(heads[right], heads[first], spec))
+            first = right;
+        if (first == i)
+            return;
+
+        struct t_run *run = heap[i];
+        struct t_runEntry *head = heads[i];
+        heap[i] = heap[first];
+        heads[i] = heads[first];
+        heap[first] = run;
+        heads[first] = head;
+        i = first;
+    }
+}
+
+/* Merge the sorted runs into the report, a heap keeps the run with the next entry on top */
+static int mergeRuns(struct t_report *report, uint32_t topN, int fd, struct t_run *runs, struct t_output *out)
+{
+    struct t_run *heap[EN_SPILL_PARTS];
+    struct t_runEntry *heads[EN_SPILL_PARTS];
+    int failed = 0;
+    int count = 0;
+    int p;
+
+    for (p = 0; p < EN_SPILL_PARTS; p++)
+    {
+        runs[p].buffer = malloc(EN_SPILL_RUN * sizeof (struct t_runEntry));
+        runs[p].next = 0;
+        runs[p].buffered = 0;
+        runs[p].head = 0;
+        if (runs[p].buffer == NULL)
+            failed = 1;
+        else if ((heads[count] = getRunHead(&runs[p], fd, &failed)) != NULL)
+            heap[count++] = &runs[p];
+    }
+    for (p = count / 2 - 1; p >= 0 && !failed; p--)
+    {
+        siftRunHeap(heap, heads, count, p, &(report->spec));
+    }
+
+    uint32_t printed = 0;
+    while (count > 0 && !failed && (topN == 0 || printed < topN))
+    {
+        struct t_dataStruct *d = &(heads[0]->d);
+        d->spec = &(report->spec);
+        printData(out, d);
+        printed++;
+
+        heap[0]->head++;
+        if ((heads[0] = getRunHead(heap[0], fd, &failed)) == NULL)
+        {
+            heap[0] = heap[--count];
+            heads[0] = heads[count];
+        }
+        siftRunHeap(heap, heads, count, 0, &(report->spec));
+    }
+
+    for (p = 0; p < EN_SPILL_PARTS; p++)
+    {
+        free(runs[p].buffer);
+    }
+    return failed;
+}
+
+int writeSpilledReport(struct t_report *report, int sortkey, uint32_t topN, int threads, struct t_output *out)
+{
+    struct t_run runs[EN_SPILL_PARTS];
+    int fd = createTempFile();
+    if (fd < 0)
+        return 1;
+
+    int result = writeRuns(report, sortkey, topN, threads, fd, runs);
+    if (result == 0)
+    {
+        double start = getStatsTime();
+        result = mergeRuns(report, topN, fd, runs, out);
+        addPhaseTime(EN_PHASE_PRINT, start);
+    }
+    if (result != 0)
+        printError("Spilled keys cannot be read back!");
+
+    close(fd);
+    return result;
+}
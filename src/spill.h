@@ -0,0 +1,91 @@
+/*
+ * File:    spill.h
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#ifndef SPILL_H
+#define	SPILL_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "main.h"
+
+/*
+ * Aggregation within a memory limit (grace hash). A table which would grow
+ * beyond its share of the limit is spilled instead: its slots are appended
+ * to spill files by the partition of their hash and the table is emptied.
+ * Once the input is read, the rest of the tables of all workers is spilled
+ * too and the report is built partition by partition. Every partition has
+ * a fraction of the keys, it is aggregated in memory, sorted and stored as
+ * a sorted run; the runs of all partitions are finally merged into the
+ * report.
+ *
+ * Spill files are anonymous temporary files in TMPDIR (/tmp by default),
+ * shared by all workers, which append to them at atomically reserved
+ * offsets.
+ */
+
+/* Partitions of the keys, every one has to fit into memory */
+#define EN_SPILL_PARTS 64
+
+/* Kinds of spilled tables */
+#define EN_SPILL_IP4 0
+#define EN_SPILL_IP6 1
+#define EN_SPILL_TUPLE 2
+#define EN_SPILL_KINDS 3
+
+/* Bytes buffered for every partition while a table is spilled */
+#define EN_SPILL_BUFFER (64 * 1024)
+
+/* Entries of a sorted run read at once while the runs are merged */
+#define EN_SPILL_RUN 1024
+
+struct t_spillFile
+{
+    int fd; //-1 until the first spill of the kind
+    volatile off_t size; //bytes appended so far
+};
+
+/* Spilled keys of a single report */
+struct t_spill
+{
+    struct t_spillFile files[EN_SPILL_KINDS][EN_SPILL_PARTS];
+    pthread_mutex_t lock; //creation of the files
+    volatile int used; //some table was spilled
+    volatile int failed;
+};
+
+/* Entry of a sorted run */
+struct t_runEntry
+{
+    uint64_t value;
+    struct t_dataStruct d;
+};
+
+/* Whether a table of given capacity would exceed the budget by growing, with the old arrays kept meanwhile */
+static inline int isTableFull(uint32_t count, uint32_t limit, uint32_t capacity, size_t slotSize, uint64_t budget)
+{
+    return count + EN_DECODE_BATCH > limit && (uint64_t) capacity * 3 * (1 + slotSize) > budget;
+}
+
+/* Whether adding a next batch of records to the aggregation could exceed the budget of its tables */
+static inline int isAggregationFull(const struct t_aggregation *aggregation, uint64_t budget)
+{
+    const struct t_ip4Table *ip4 = aggregation->ip4;
+    const struct t_ip6Table *ip6 = aggregation->ip6;
+    const struct t_tupleTable *tuples = aggregation->tuples;
+
+    return (ip4 != NULL && isTableFull(ip4->count, ip4->limit, ip4->capacity, sizeof (struct t_ip4Slot), budget)) ||
+        (ip6 != NULL && isTableFull(ip6->count, ip6->limit, ip6->capacity, sizeof (struct t_ip6Slot), budget)) ||
+        (tuples != NULL && isTableFull(tuples->count, tuples->limit, tuples->capacity, sizeof (struct t_tupleSlot), budget));
+}
+
+/* Prototypes */
+void initSpill(struct t_spill *spill);
+void finishSpill(struct t_spill *spill);
+int spillAggregation(struct t_spill *spill, struct t_aggregation *aggregation);
+int writeSpilledReport(struct t_report *report, int sortkey, uint32_t topN, int threads, struct t_output *out);
+
+#endif /* SPILL_H */
@@ -0,0 +1,86 @@
+/*
+ * File:    stats.c
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "stats.h"
+#include "main.h"
+
+struct t_stats stats;
+__thread struct t_counters counters;
+
+static pthread_mutex_t countersLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Monotonic time in seconds */
+double getStatsTime(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Add the time elapsed since the start to given phase */
+void addPhaseTime(int phase, double start)
+{
+    if (stats.enabled)
+        stats.phases[phase] += getStatsTime() - start;
+}
+
+/* Add the counters of the calling thread to the totals and clear them */
+void collectCounters(void)
+{
+    struct t_counters *total = &(stats.total);
+
+    pthread_mutex_lock(&countersLock);
+    total->files += counters.files;
+    total->records += counters.records;
+    total->resizes += counters.resizes;
+    total->spills += counters.spills;
+    total->lookups += counters.lookups;
+    total->probes += counters.probes;
+    if (counters.maxProbe > total->maxProbe)
+        total->maxProbe = counters.maxProbe;
+    total->read += counters.read;
+    total->aggregate += counters.aggregate;
+    total->resize += counters.resize;
+    pthread_mutex_unlock(&countersLock);
+
+    memset(&counters, 0, sizeof (counters));
+}
+
+void printStats(FILE *f)
+{
+    static const char *names[EN_PHASES] = {"walk", "aggregate", "merge", "rollup", "sort", "print"};
+    int i;
+    for (i = 0; i < EN_PHASES; i++)
+    {
+        fprintf(f, "STAT: time.%s %.6f\n", names[i], stats.phases[i]);
+    }
+
+    /* The main thread has not been collected yet */
+    collectCounters();
+    struct t_counters *total = &(stats.total);
+    fprintf(f, "STAT: threads.read %.6f\n", total->read);
+    fprintf(f, "STAT: threads.aggregate %.6f\n", total->aggregate);
+    fprintf(f, "STAT: threads.resize %.6f\n", total->resize);
+    fprintf(f, "STAT: files %llu\n", (unsigned long long) total->files);
+    fprintf(f, "STAT: records %llu\n", (unsigned long long) total->records);
+    fprintf(f, "STAT: bytes %llu\n", (unsigned long long) (total->records * sizeof (struct flow)));
+    fprintf(f, "STAT: resizes %llu\n", (unsigned long long) total->resizes);
+    fprintf(f, "STAT: spills %llu\n", (unsigned long long) total->spills);
+    fprintf(f, "STAT: lookups %llu\n", (unsigned long long) total->lookups);
+    fprintf(f, "STAT: probe.avg %.3f\n", total->lookups > 0 ? (double) total->probes / total->lookups : 0.0);
+    fprintf(f, "STAT: probe.max %llu\n", (unsigned long long) total->maxProbe);
+}
+
+void printReportStats(FILE *f, const char *key, uint32_t count, uint64_t capacity)
+{
+    fprintf(f, "STAT: report.%s keys %u capacity %llu load %.3f\n", key, count,
+            (unsigned long long) capacity, capacity > 0 ? (double) count / capacity : 0.0);
+}
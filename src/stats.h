@@ -0,0 +1,72 @@
+/*
+ * File:    stats.h
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#ifndef STATS_H
+#define	STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Run statistics printed by --stats. Phases are timed by the main thread
+ * only, so the times of the parallel phases are their wall times.
+ *
+ * Counters of the hot paths are kept by every thread in its own copy, so
+ * they cost a few increments of cached memory and are always on. A thread
+ * adds its copy to the totals when it finishes its work.
+ */
+
+/* Phases of a run */
+#define EN_PHASE_WALK 0
+#define EN_PHASE_AGGREGATE 1
+#define EN_PHASE_MERGE 2
+#define EN_PHASE_ROLLUP 3
+#define EN_PHASE_SORT 4
+#define EN_PHASE_PRINT 5
+#define EN_PHASES 6
+
+/* Counters of a single thread */
+struct t_counters
+{
+    uint64_t files; //input files read, not the cached ones
+    uint64_t records; //records handed over to the aggregation
+    uint64_t resizes; //tables grown
+    uint64_t spills; //tables spilled over the memory limit
+    uint64_t lookups; //keys added to the tables
+    uint64_t probes; //groups of slots probed by the lookups
+    uint64_t maxProbe; //groups probed by the longest lookup
+    double read; //seconds spent reading input, summed over threads
+    double aggregate; //seconds spent aggregating read records
+    double resize; //seconds spent growing tables beyond incremental migration
+};
+
+struct t_stats
+{
+    char enabled;
+    double phases[EN_PHASES]; //seconds spent in every phase
+    struct t_counters total; //counters of all finished threads
+};
+
+extern struct t_stats stats;
+extern __thread struct t_counters counters;
+
+/* Count a lookup which probed given number of groups */
+static inline void countProbes(uint64_t probes)
+{
+    counters.lookups++;
+    counters.probes += probes;
+    if (probes > counters.maxProbe)
+        counters.maxProbe = probes;
+}
+
+/* Prototypes */
+double getStatsTime(void);
+void addPhaseTime(int phase, double start);
+void collectCounters(void);
+void printStats(FILE *f);
+void printReportStats(FILE *f, const char *key, uint32_t count, uint64_t capacity);
+
+#endif /* STATS_H */
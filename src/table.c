@@ -0,0 +1,15 @@
+/*
+ * File:    table.c
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "stats.h"
+
+/* Emit the bodies of all specialized tables here */
+#define TABLE_IMPLEMENTATION
+#include "table.h"
@@ -0,0 +1,206 @@
+/*
+ * File:    table.h
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#ifndef TABLE_H
+#define	TABLE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <netinet/in.h>
+#include "peers.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Open addressing tables specialized by the key type. Every table keeps a
+ * compact array of one byte tags next to the array of slots. A tag is zero
+ * for an empty slot, or 0x80 with 7 bits of the key hash for a used one.
+ * Slots are probed by groups of 16 tags compared at once, so the slots
+ * themselves are touched almost only when the key really matches.
+ *
+ * A full table does not rehash at once. The grown arrays are allocated and
+ * every following add moves a few old slots, so the cost of growth is
+ * spread evenly over the records. Old slots not moved yet are searched
+ * after the current ones; settle finishes the migration before a table is
+ * iterated.
+ *
+ * Tables counting distinct peers keep an array of sketch pointers next to
+ * the slots, so the slots of other tables stay as small as they were.
+ */
+
+/* Number of slots probed at once */
+#define EN_TABLE_GROUP 16
+
+/* Initial and maximal number of slots of a table */
+#define EN_TABLE_INIT 16384
+#define EN_TABLE_MAX 2147483648u
+
+/* Old slots migrated on every add while a table grows */
+#define EN_TABLE_MIGRATE 32
+
+/* Tag values */
+#define EN_TAG_EMPTY 0
+#define EN_TAG_MOVED 1 //slot migrated to the grown table
+#define EN_TAG_USED 128
+
+struct t_ip4Slot
+{
+    uint32_t key; //in order
+    uint64_t packets;
+    uint64_t bytes;
+};
+
+struct t_ip6Slot
+{
+    struct in6_addr key;
+    uint64_t packets;
+    uint64_t bytes;
+};
+
+/* Composite key, fields which are not part of the key are zero */
+struct t_tupleKey
+{
+    struct in6_addr src; //IPv4 address in the last word
+    struct in6_addr dst;
+    uint16_t srcPort; //in order
+    uint16_t dstPort;
+    uint32_t family; //4 or 6, 0 for keys of ports only
+};
+
+struct t_tupleSlot
+{
+    struct t_tupleKey key;
+    uint64_t packets;
+    uint64_t bytes;
+};
+
+/* Final mixing step of MurmurHash3, all output bits depend on all input bits */
+static inline uint64_t mixHash(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* FNV-1a of a string, for names rather than for keys */
+static inline uint64_t hashString(const char *str)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (; *str != '\0'; str++)
+    {
+        h = (h ^ (uint8_t) *str) * 0x100000001b3ULL;
+    }
+    return mixHash(h);
+}
+
+static inline uint64_t hashIP4(const uint32_t *addr)
+{
+    return mixHash(*addr);
+}
+
+static inline uint64_t hashIP6(const struct in6_addr *addr)
+{
+    uint64_t high = ((uint64_t) addr->s6_addr32[0] << 32) | addr->s6_addr32[1];
+    uint64_t low = ((uint64_t) addr->s6_addr32[2] << 32) | addr->s6_addr32[3];
+    return mixHash(mixHash(high) ^ low);
+}
+
+static inline uint64_t hashTuple(const struct t_tupleKey *key)
+{
+    /* All five words of the key are folded in before the final mix */
+    uint64_t words[sizeof (struct t_tupleKey) / sizeof (uint64_t)];
+    memcpy(words, key, sizeof (words));
+
+    uint64_t h = 0x9e3779b97f4a7c15ULL;
+    unsigned i;
+    for (i = 0; i < sizeof (words) / sizeof (uint64_t); i++)
+    {
+        h = (h ^ words[i]) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    return mixHash(h);
+}
+
+static inline int equalsIP4(const uint32_t *a, const uint32_t *b)
+{
+    return *a == *b;
+}
+
+static inline int equalsIP6(const struct in6_addr *a, const struct in6_addr *b)
+{
+    return a->s6_addr32[0] == b->s6_addr32[0] &&
+        a->s6_addr32[1] == b->s6_addr32[1] &&
+        a->s6_addr32[2] == b->s6_addr32[2] &&
+        a->s6_addr32[3] == b->s6_addr32[3];
+}
+
+static inline int equalsTuple(const struct t_tupleKey *a, const struct t_tupleKey *b)
+{
+    return memcmp(a, b, sizeof (struct t_tupleKey)) == 0;
+}
+
+/* Tag of a used slot holding a key of given hash */
+static inline uint8_t getTag(uint64_t hash)
+{
+    return EN_TAG_USED | (hash & 0x7f);
+}
+
+/* Bit mask of positions in a group holding given tag */
+static inline uint32_t matchTags(const uint8_t *group, uint8_t tag)
+{
+#ifdef __SSE2__
+    __m128i tags = _mm_loadu_si128((const __m128i *) group);
+    return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(tags, _mm_set1_epi8((char) tag)));
+#else
+    uint32_t result = 0;
+    int i;
+    for (i = 0; i < EN_TABLE_GROUP; i++)
+    {
+        if (group[i] == tag)
+            result |= 1u << i;
+    }
+    return result;
+#endif
+}
+
+/* Partition of a key hash, high bits are independent of the slot position */
+static inline uint32_t partitionHash(uint64_t hash, uint32_t parts)
+{
+    return (uint32_t) (((hash >> 32) * parts) >> 32);
+}
+
+/* IPv4 keys */
+#define TABLE_TYPE t_ip4Table
+#define TABLE_SLOT t_ip4Slot
+#define TABLE_KEY uint32_t
+#define TABLE_SUFFIX IP4Table
+#define TABLE_HASH hashIP4
+#define TABLE_EQUALS equalsIP4
+#include "table_tmpl.h"
+
+/* IPv6 keys */
+#define TABLE_TYPE t_ip6Table
+#define TABLE_SLOT t_ip6Slot
+#define TABLE_KEY struct in6_addr
+#define TABLE_SUFFIX IP6Table
+#define TABLE_HASH hashIP6
+#define TABLE_EQUALS equalsIP6
+#include "table_tmpl.h"
+
+/* Composite keys */
+#define TABLE_TYPE t_tupleTable
+#define TABLE_SLOT t_tupleSlot
+#define TABLE_KEY struct t_tupleKey
+#define TABLE_SUFFIX TupleTable
+#define TABLE_HASH hashTuple
+#define TABLE_EQUALS equalsTuple
+#include "table_tmpl.h"
+
+#endif /* TABLE_H */
@@ -0,0 +1,418 @@
+/*
+ * File:    table_tmpl.h
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ *
+ * Template of a hash table specialized by the key type, included once per
+ * key type by table.h. Expects these macros to be defined:
+ *   TABLE_TYPE    name of the table structure
+ *   TABLE_SLOT    name of the slot structure (with key, packets and bytes)
+ *   TABLE_KEY     type of the key
+ *   TABLE_SUFFIX  suffix of the function names
+ *   TABLE_HASH    function returning 64 bit hash of a key pointer
+ *   TABLE_EQUALS  function comparing two key pointers
+ * Function bodies are emitted only if TABLE_IMPLEMENTATION is defined, they
+ * take arrays from arena.h and count probes and growth into the counters of
+ * stats.h.
+ */
+
+#define TABLE_CONCAT_(a, b) a ## b
+#define TABLE_CONCAT(a, b) TABLE_CONCAT_(a, b)
+#define TABLE_FN(name) TABLE_CONCAT(name, TABLE_SUFFIX)
+
+struct TABLE_TYPE
+{
+    uint32_t capacity; //number of slots, power of two
+    uint32_t count; //keys in both current and old slots
+    uint32_t limit; //limit is precomputed by 7/8 of capacity
+    uint8_t *tags;
+    struct TABLE_SLOT *slots;
+    struct t_peers **peers; //sketches of distinct counterparts by slots, NULL if not counted
+    char failed; //new keys were dropped, the table cannot grow any more
+
+    /* Slots of the previous capacity which are still being migrated */
+    uint32_t oldCapacity;
+    uint32_t migrated; //old slots below this index are moved already
+    uint8_t *oldTags;
+    struct TABLE_SLOT *oldSlots;
+    struct t_peers **oldPeers;
+};
+
+int TABLE_FN(init)(struct TABLE_TYPE *table, uint32_t capacity);
+void TABLE_FN(finish)(struct TABLE_TYPE *table);
+struct t_peers **TABLE_FN(add)(struct TABLE_TYPE *table, const TABLE_KEY *key, uint64_t hash, uint64_t packets, uint64_t bytes);
+int TABLE_FN(grow)(struct TABLE_TYPE *table);
+void TABLE_FN(settle)(struct TABLE_TYPE *table);
+void TABLE_FN(reserve)(struct TABLE_TYPE *table, uint64_t keys);
+void TABLE_FN(clear)(struct TABLE_TYPE *table);
+void TABLE_FN(merge)(struct TABLE_TYPE *result, struct TABLE_TYPE *source, uint32_t part, uint32_t parts);
+int TABLE_FN(countPeers)(struct TABLE_TYPE *table);
+
+/* Fetch tags of the first group probed for a hash ahead of an add */
+static inline void TABLE_FN(prefetch)(const struct TABLE_TYPE *table, uint64_t hash)
+{
+    uint32_t groupMask = table->capacity / EN_TABLE_GROUP - 1;
+    uint32_t group = (uint32_t) (hash >> 7) & groupMask;
+    __builtin_prefetch(table->tags + group * EN_TABLE_GROUP);
+}
+
+#ifdef TABLE_IMPLEMENTATION
+
+/* New arrays of the table, it is left untouched if they cannot be allocated */
+static int TABLE_FN(allocate)(struct TABLE_TYPE *table, uint32_t capacity, char peers)
+{
+    /* Capacity is a power of two of whole groups */
+    uint32_t size = EN_TABLE_GROUP;
+    while (size < capacity && size < EN_TABLE_MAX)
+    {
+        size *= 2;
+    }
+
+    /* Zeroed tags mark all slots empty, slots need no initialization */
+    uint8_t *tags = allocArena(size * sizeof (uint8_t), 1);
+    struct TABLE_SLOT *slots = allocArena(size * sizeof (struct TABLE_SLOT), 0);
+    struct t_peers **sketches = peers ? allocArena(size * sizeof (struct t_peers *), 1) : NULL;
+    if (tags == NULL || slots == NULL || (peers && sketches == NULL))
+    {
+        freeArena(tags, size * sizeof (uint8_t));
+        freeArena(slots, size * sizeof (struct TABLE_SLOT));
+        freeArena(sketches, size * sizeof (struct t_peers *));
+        return 1;
+    }
+
+    table->capacity = size;
+    table->limit = size / 8 * 7;
+    table->tags = tags;
+    table->slots = slots;
+    table->peers = sketches;
+    return 0;
+}
+
+int TABLE_FN(init)(struct TABLE_TYPE *table, uint32_t capacity)
+{
+    /* A table which failed to allocate is empty, so it can still be finished */
+    table->capacity = 0;
+    table->limit = 0;
+    table->tags = NULL;
+    table->slots = NULL;
+    table->peers = NULL;
+    table->count = 0;
+    table->failed = 0;
+    table->oldCapacity = 0;
+    table->migrated = 0;
+    table->oldTags = NULL;
+    table->oldSlots = NULL;
+    table->oldPeers = NULL;
+    return TABLE_FN(allocate)(table, capacity, 0);
+}
+
+/* Sketches are allocated by the first counterpart of every key */
+int TABLE_FN(countPeers)(struct TABLE_TYPE *table)
+{
+    if (table->peers == NULL)
+        table->peers = allocArena(table->capacity * sizeof (struct t_peers *), 1);
+    return table->peers == NULL ? 1 : 0;
+}
+
+/* Sketches of all slots of an array, moved ones are cleared by the migration */
+static void TABLE_FN(finishPeers)(struct t_peers **peers, uint32_t capacity)
+{
+    uint32_t i;
+    for (i = 0; peers != NULL && i < capacity; i++)
+    {
+        finishPeers(peers[i]);
+    }
+    freeArena(peers, capacity * sizeof (struct t_peers *));
+}
+
+void TABLE_FN(finish)(struct TABLE_TYPE *table)
+{
+    TABLE_FN(finishPeers)(table->peers, table->capacity);
+    TABLE_FN(finishPeers)(table->oldPeers, table->oldCapacity);
+    freeArena(table->tags, table->capacity * sizeof (uint8_t));
+    freeArena(table->slots, table->capacity * sizeof (struct TABLE_SLOT));
+    freeArena(table->oldTags, table->oldCapacity * sizeof (uint8_t));
+    freeArena(table->oldSlots, table->oldCapacity * sizeof (struct TABLE_SLOT));
+    table->tags = NULL;
+    table->slots = NULL;
+    table->oldTags = NULL;
+    table->oldSlots = NULL;
+    table->peers = NULL;
+    table->oldPeers = NULL;
+    table->capacity = 0;
+    table->oldCapacity = 0;
+    table->count = 0;
+}
+
+/* Store a key which is known not to be in the table yet */
+static void TABLE_FN(place)(struct TABLE_TYPE *table, struct TABLE_SLOT *slot, struct t_peers *peers, uint64_t hash)
+{
+    uint32_t groupMask = table->capacity / EN_TABLE_GROUP - 1;
+    uint32_t group = (uint32_t) (hash >> 7) & groupMask;
+    uint32_t empty;
+
+    while ((empty = matchTags(table->tags + group * EN_TABLE_GROUP, EN_TAG_EMPTY)) == 0)
+    {
+        group = (group + 1) & groupMask;
+    }
+
+    uint32_t i = group * EN_TABLE_GROUP + __builtin_ctz(empty);
+    table->tags[i] = getTag(hash);
+    table->slots[i] = *slot;
+    if (table->peers != NULL)
+        table->peers[i] = peers;
+}
+
+/*
+ * Move next few old slots to the current arrays. A moved slot keeps a
+ * tombstone, so probe sequences in the old slots still pass through it.
+ */
+static void TABLE_FN(migrate)(struct TABLE_TYPE *table, uint32_t slots)
+{
+    uint32_t end = table->migrated + slots;
+    if (end > table->oldCapacity)
+        end = table->oldCapacity;
+
+    uint32_t i;
+    for (i = table->migrated; i < end; i++)
+    {
+        if (table->oldTags[i] & EN_TAG_USED)
+        {
+            struct t_peers *peers = NULL;
+            if (table->oldPeers != NULL)
+            {
+                peers = table->oldPeers[i];
+                table->oldPeers[i] = NULL;
+            }
+            TABLE_FN(place)(table, &(table->oldSlots[i]), peers, TABLE_HASH(&(table->oldSlots[i].key)));
+            table->oldTags[i] = EN_TAG_MOVED;
+        }
+    }
+    table->migrated = end;
+
+    /* Old slots are released as soon as the last one is moved */
+    if (table->migrated == table->oldCapacity)
+    {
+        freeArena(table->oldTags, table->oldCapacity * sizeof (uint8_t));
+        freeArena(table->oldSlots, table->oldCapacity * sizeof (struct TABLE_SLOT));
+        freeArena(table->oldPeers, table->oldCapacity * sizeof (struct t_peers *));
+        table->oldTags = NULL;
+        table->oldSlots = NULL;
+        table->oldPeers = NULL;
+        table->oldCapacity = 0;
+        table->migrated = 0;
+    }
+}
+
+/* Find a key among old slots not migrated yet */
+static struct TABLE_SLOT *TABLE_FN(findOld)(struct TABLE_TYPE *table, const TABLE_KEY *key, uint64_t hash)
+{
+    uint32_t groupMask = table->oldCapacity / EN_TABLE_GROUP - 1;
+    uint32_t group = (uint32_t) (hash >> 7) & groupMask;
+    uint8_t tag = getTag(hash);
+
+    for (;;)
+    {
+        uint8_t *tags = table->oldTags + group * EN_TABLE_GROUP;
+        struct TABLE_SLOT *slots = table->oldSlots + group * EN_TABLE_GROUP;
+
+        uint32_t match = matchTags(tags, tag);
+        while (match)
+        {
+            struct TABLE_SLOT *slot = &slots[__builtin_ctz(match)];
+            if (TABLE_EQUALS(&(slot->key), key))
+                return slot;
+            match &= match - 1;
+        }
+
+        if (matchTags(tags, EN_TAG_EMPTY))
+            return NULL;
+
+        group = (group + 1) & groupMask;
+    }
+}
+
+/* Sketch of the key counted in a slot, NULL if the table does not count peers */
+static inline struct t_peers **TABLE_FN(peersOf)(struct t_peers **peers, const struct TABLE_SLOT *slots, const struct TABLE_SLOT *slot)
+{
+    return peers != NULL ? &peers[slot - slots] : NULL;
+}
+
+struct t_peers **TABLE_FN(add)(struct TABLE_TYPE *table, const TABLE_KEY *key, uint64_t hash, uint64_t packets, uint64_t bytes)
+{
+    /* Growth is paid off by a constant amount of work on every record */
+    if (table->oldTags != NULL)
+    {
+        TABLE_FN(migrate)(table, EN_TABLE_MIGRATE);
+    }
+
+    uint32_t groupMask = table->capacity / EN_TABLE_GROUP - 1;
+    uint32_t group = (uint32_t) (hash >> 7) & groupMask;
+    uint8_t tag = getTag(hash);
+    uint32_t probes = 1;
+
+    for (;;)
+    {
+        uint8_t *tags = table->tags + group * EN_TABLE_GROUP;
+        struct TABLE_SLOT *slots = table->slots + group * EN_TABLE_GROUP;
+
+        /* Compare keys only in slots with the same tag */
+        uint32_t match = matchTags(tags, tag);
+        while (match)
+        {
+            struct TABLE_SLOT *slot = &slots[__builtin_ctz(match)];
+            if (TABLE_EQUALS(&(slot->key), key))
+            {
+                slot->packets += packets;
+                slot->bytes += bytes;
+                countProbes(probes);
+                return TABLE_FN(peersOf)(table->peers, table->slots, slot);
+            }
+            match &= match - 1;
+        }
+
+        /* An empty slot ends the probe sequence, the key is not there */
+        uint32_t empty = matchTags(tags, EN_TAG_EMPTY);
+        if (empty)
+        {
+            countProbes(probes);
+
+            /* The key may still wait for migration among the old slots */
+            if (table->oldTags != NULL)
+            {
+                struct TABLE_SLOT *old = TABLE_FN(findOld)(table, key, hash);
+                if (old != NULL)
+                {
+                    old->packets += packets;
+                    old->bytes += bytes;
+                    return TABLE_FN(peersOf)(table->oldPeers, table->oldSlots, old);
+                }
+            }
+
+            /* A table which cannot grow drops new keys, it would fill up and never end a probe otherwise */
+            if (table->count > table->limit)
+            {
+                table->failed = 1;
+                return NULL;
+            }
+
+            uint32_t i = __builtin_ctz(empty);
+            tags[i] = tag;
+            slots[i].key = *key;
+            slots[i].packets = packets;
+            slots[i].bytes = bytes;
+            table->count++;
+
+            /* The sketch stays valid when the arrays become the old ones */
+            struct t_peers **peers = TABLE_FN(peersOf)(table->peers, table->slots, &slots[i]);
+
+            /* Check the size of the table and double it if necessary */
+            if (table->count > table->limit && TABLE_FN(grow)(table) != 0)
+                table->failed = 1;
+            return peers;
+        }
+
+        group = (group + 1) & groupMask;
+        probes++;
+    }
+}
+
+int TABLE_FN(grow)(struct TABLE_TYPE *table)
+{
+    if (table->capacity >= EN_TABLE_MAX)
+        return 1;
+
+    /* Previous growth has to be finished before the next one starts */
+    double start = getStatsTime();
+    if (table->oldTags != NULL)
+    {
+        TABLE_FN(migrate)(table, table->oldCapacity - table->migrated);
+    }
+
+    /* Current slots become old ones and migrate during following adds */
+    uint32_t capacity = table->capacity;
+    uint8_t *tags = table->tags;
+    struct TABLE_SLOT *slots = table->slots;
+    struct t_peers **peers = table->peers;
+    if (TABLE_FN(allocate)(table, capacity * 2, peers != NULL) != 0)
+        return 1;
+    table->oldCapacity = capacity;
+    table->oldTags = tags;
+    table->oldSlots = slots;
+    table->oldPeers = peers;
+    table->migrated = 0;
+
+    counters.resizes++;
+    counters.resize += getStatsTime() - start;
+    return 0;
+}
+
+void TABLE_FN(settle)(struct TABLE_TYPE *table)
+{
+    if (table->oldTags != NULL)
+    {
+        double start = getStatsTime();
+        TABLE_FN(migrate)(table, table->oldCapacity - table->migrated);
+        counters.resize += getStatsTime() - start;
+    }
+}
+
+/*
+ * Grow the table to hold given number of keys up front. Keys of another
+ * table come in the order of its slots, an added run of them would fill
+ * a smaller table group by group and probe ever longer.
+ */
+void TABLE_FN(reserve)(struct TABLE_TYPE *table, uint64_t keys)
+{
+    while (table->limit < keys)
+    {
+        if (TABLE_FN(grow)(table) != 0)
+            break;
+    }
+    TABLE_FN(settle)(table);
+}
+
+/* Drop all keys of a settled table, its capacity is kept */
+void TABLE_FN(clear)(struct TABLE_TYPE *table)
+{
+    uint32_t i;
+    for (i = 0; table->peers != NULL && i < table->capacity; i++)
+    {
+        finishPeers(table->peers[i]);
+        table->peers[i] = NULL;
+    }
+    memset(table->tags, EN_TAG_EMPTY, table->capacity * sizeof (uint8_t));
+    table->count = 0;
+}
+
+void TABLE_FN(merge)(struct TABLE_TYPE *result, struct TABLE_TYPE *source, uint32_t part, uint32_t parts)
+{
+    /* Take only keys of given hash partition, source has to be settled */
+    uint32_t i;
+    result->failed |= source->failed;
+    for (i = 0; i < source->capacity; i++)
+    {
+        if (source->tags[i] != EN_TAG_EMPTY)
+        {
+            struct TABLE_SLOT *slot = &(source->slots[i]);
+            uint64_t hash = TABLE_HASH(&(slot->key));
+            if (partitionHash(hash, parts) == part)
+            {
+                struct t_peers **peers = TABLE_FN(add)(result, &(slot->key), hash, slot->packets, slot->bytes);
+                mergePeers(peers, getPeersAt(source->peers, i));
+            }
+        }
+    }
+}
+
+#endif /* TABLE_IMPLEMENTATION */
+
+#undef TABLE_FN
+#undef TABLE_CONCAT
+#undef TABLE_CONCAT_
+#undef TABLE_TYPE
+#undef TABLE_SLOT
+#undef TABLE_KEY
+#undef TABLE_SUFFIX
+#undef TABLE_HASH
+#undef TABLE_EQUALS
@@ -0,0 +1,523 @@
+/*
+ * File:    watch.c
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "watch.h"
+#include "compress.h"
+#include "stats.h"
+
+/* Events of the watched directories */
+#define EN_WATCH_MASK (IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO | IN_CREATE)
+
+static volatile sig_atomic_t stopWatch = 0;
+
+static void handleStop(int sig)
+{
+    (void) sig;
+    stopWatch = 1;
+}
+
+static void printWatchError(char *file, char *msg)
+{
+    fprintf(stderr, "ERR: %s: %s\n", file, msg);
+}
+
+/* Grow the file index to keep it at most half full */
+static int growWatchIndex(struct t_watch *watch)
+{
+    uint32_t size = watch->indexSize ? watch->indexSize * 2 : EN_WATCH_INDEX;
+    uint32_t *index = calloc(size, sizeof (uint32_t));
+    if (index == NULL)
+        return 1;
+
+    size_t f;
+    for (f = 0; f < watch->nfiles; f++)
+    {
+        uint32_t pos = (uint32_t) hashString(watch->files[f].name) & (size - 1);
+        while (index[pos] != 0)
+        {
+            pos = (pos + 1) & (size - 1);
+        }
+        index[pos] = f + 1;
+    }
+
+    free(watch->index);
+    watch->index = index;
+    watch->indexSize = size;
+    return 0;
+}
+
+/* Number of the file of given name, a new file is added */
+static long getWatchedFile(struct t_watch *watch, const char *name)
+{
+    if ((watch->nfiles + 1) * 2 > watch->indexSize && growWatchIndex(watch) != 0)
+        return EN_ERROR;
+
+    uint32_t pos = (uint32_t) hashString(name) & (watch->indexSize - 1);
+    while (watch->index[pos] != 0)
+    {
+        uint32_t f = watch->index[pos] - 1;
+        if (strcmp(watch->files[f].name, name) == 0)
+            return f;
+        pos = (pos + 1) & (watch->indexSize - 1);
+    }
+
+    if (watch->nfiles == watch->filesSize)
+    {
+        size_t size = watch->filesSize ? watch->filesSize * 2 : EN_WATCH_INDEX;
+        struct t_watchedFile *files = realloc(watch->files, size * sizeof (struct t_watchedFile));
+        if (files == NULL)
+            return EN_ERROR;
+        watch->files = files;
+
+        uint32_t *dirty = realloc(watch->dirty, size * sizeof (uint32_t));
+        if (dirty == NULL)
+            return EN_ERROR;
+        watch->dirty = dirty;
+
+        uint32_t *pending = realloc(watch->pending, size * sizeof (uint32_t));
+        if (pending == NULL)
+            return EN_ERROR;
+        watch->pending = pending;
+        watch->filesSize = size;
+    }
+
+    struct t_watchedFile *file = &(watch->files[watch->nfiles]);
+    if ((file->name = strdup(name)) == NULL)
+        return EN_ERROR;
+    file->read = 0;
+    file->pending = 0;
+    file->dirty = 0;
+    file->compressed = 0;
+    watch->index[pos] = ++watch->nfiles;
+    return watch->nfiles - 1;
+}
+
+/* Remember a changed file for the following pass */
+static int markWatchedFile(struct t_watch *watch, const char *name)
+{
+    long f = getWatchedFile(watch, name);
+    if (f == EN_ERROR)
+    {
+        printError("Unable to allocate watched files!");
+        return 1;
+    }
+
+    if (!watch->files[f].dirty)
+    {
+        watch->files[f].dirty = 1;
+        watch->dirty[watch->ndirty++] = f;
+    }
+    return 0;
+}
+
+/* Watch given directory and all directories below it */
+static int addWatchTree(struct t_watch *watch, char *directory)
+{
+    int wd = inotify_add_watch(watch->fd, directory, EN_WATCH_MASK | IN_ONLYDIR);
+    if (wd < 0)
+    {
+        printWatchError(directory, strerror(errno));
+        return 1;
+    }
+
+    /* Directory watched already keeps its descriptor */
+    size_t d;
+    for (d = 0; d < watch->ndirs && watch->dirs[d].wd != wd; d++)
+        ;
+    if (d == watch->ndirs)
+    {
+        if (watch->ndirs == watch->dirsSize)
+        {
+            size_t size = watch->dirsSize ? watch->dirsSize * 2 : 64;
+            struct t_watchedDir *dirs = realloc(watch->dirs, size * sizeof (struct t_watchedDir));
+            if (dirs == NULL)
+            {
+                printError("Unable to allocate watched directories!");
+                return 1;
+            }
+            watch->dirs = dirs;
+            watch->dirsSize = size;
+        }
+        watch->dirs[d].wd = wd;
+        watch->dirs[d].name = NULL;
+        watch->ndirs++;
+    }
+    free(watch->dirs[d].name);
+    watch->dirs[d].name = strdup(directory);
+
+    DIR *dir = opendir(directory);
+    if (dir == NULL)
+    {
+        printWatchError(directory, "Unable to open given directory!");
+        return 1;
+    }
+
+    struct dirent *ent;
+    int result = 0;
+    while (result == 0 && (ent = readdir(dir)) != NULL)
+    {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+
+        char *path = malloc(strlen(directory) + strlen(ent->d_name) + 2);
+        sprintf(path, "%s/%s", directory, ent->d_name);
+
+        /* Links to directories are not followed, as by the walk of the files */
+        struct stat st;
+        if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode))
+            result = addWatchTree(watch, path);
+        free(path);
+    }
+
+    closedir(dir);
+    return result;
+}
+
+int initWatch(struct t_watch *watch, char *directory)
+{
+    memset(watch, 0, sizeof (struct t_watch));
+
+    watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->fd < 0)
+    {
+        printWatchError(directory, strerror(errno));
+        return 1;
+    }
+
+    /* Watches are set before the walk, so no file created meanwhile is missed */
+    watch->directory = directory;
+    watch->rescan = 1;
+    return addWatchTree(watch, directory);
+}
+
+void finishWatch(struct t_watch *watch)
+{
+    size_t i;
+    if (watch->fd >= 0)
+        close(watch->fd);
+    for (i = 0; i < watch->ndirs; i++)
+    {
+        free(watch->dirs[i].name);
+    }
+    for (i = 0; i < watch->nfiles; i++)
+    {
+        free(watch->files[i].name);
+    }
+    free(watch->dirs);
+    free(watch->files);
+    free(watch->index);
+    free(watch->dirty);
+    free(watch->pending);
+    memset(watch, 0, sizeof (struct t_watch));
+    watch->fd = -1;
+}
+
+int readWatchEvents(struct t_watch *watch, int timeout)
+{
+    struct pollfd pfd;
+    pfd.fd = watch->fd;
+    pfd.events = POLLIN;
+
+    int ready = poll(&pfd, 1, timeout);
+    if (ready < 0 && errno != EINTR)
+    {
+        printError("Unable to wait for inotify events!");
+        return 1;
+    }
+    if (ready <= 0)
+        return 0;
+
+    char buffer[EN_WATCH_EVENTS] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(watch->fd, buffer, sizeof (buffer))) > 0)
+    {
+        char *p;
+        for (p = buffer; p < buffer + n; p += sizeof (struct inotify_event) + ((struct inotify_event *) p)->len)
+        {
+            struct inotify_event *event = (struct inotify_event *) p;
+
+            /* Lost events are recovered by a walk of the whole tree */
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                watch->rescan = 1;
+                if (addWatchTree(watch, watch->directory) != 0)
+                    return 1;
+                continue;
+            }
+            if (event->len == 0)
+                continue;
+
+            size_t d;
+            for (d = 0; d < watch->ndirs && watch->dirs[d].wd != event->wd; d++)
+                ;
+            if (d == watch->ndirs)
+                continue;
+
+            char *path = malloc(strlen(watch->dirs[d].name) + strlen(event->name) + 2);
+            sprintf(path, "%s/%s", watch->dirs[d].name, event->name);
+
+            int result = 0;
+            if (event->mask & IN_ISDIR)
+            {
+                /* Files of a new directory may be there before its watch */
+                if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                {
+                    result = addWatchTree(watch, path);
+                    watch->rescan = 1;
+                }
+            }
+            else if (event->mask & (IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO))
+                result = markWatchedFile(watch, path);
+
+            free(path);
+            if (result != 0)
+                return 1;
+        }
+    }
+
+    if (n < 0 && errno != EAGAIN && errno != EINTR)
+    {
+        printError("Unable to read inotify events!");
+        return 1;
+    }
+    return 0;
+}
+
+int collectWatchChanges(struct t_watch *watch, struct t_fileList *list)
+{
+    size_t i;
+
+    if (watch->rescan)
+    {
+        /* Every file of the tree is checked, known files only for their growth */
+        struct t_fileList all;
+        initFileList(&all);
+        int result = walkDirectory(watch->directory, &all);
+        for (i = 0; result == 0 && i < all.count; i++)
+        {
+            result = markWatchedFile(watch, all.files[i].name);
+        }
+        finishFileList(&all);
+        if (result != 0)
+            return 1;
+        watch->rescan = 0;
+    }
+
+    for (i = 0; i < watch->ndirty; i++)
+    {
+        struct t_watchedFile *file = &(watch->files[watch->dirty[i]]);
+        file->dirty = 0;
+
+        /* Removed files and streams are of no interest */
+        struct stat st;
+        if (stat(file->name, &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+
+        /* Compressed files are read whole when they appear, they should be moved in complete, an incomplete one is read again as it changes */
+        int fd = open(file->name, O_RDONLY | O_CLOEXEC);
+        char compressed = (fd >= 0 && detectCompression(fd) != EN_COMPRESS_NONE);
+        if (fd >= 0)
+            close(fd);
+        if (compressed && file->read != 0)
+        {
+            if (st.st_size != file->read)
+                fprintf(stderr, "WARN: %s: %s\n", file->name, "Compressed file changed, it is not read again!");
+            file->read = st.st_size;
+            continue;
+        }
+
+        /* Only complete records are read, the rest is read once it is written */
+        off_t end = compressed ? st.st_size : st.st_size - (off_t) (st.st_size % sizeof (struct flow));
+        if (end < file->read)
+        {
+            fprintf(stderr, "WARN: %s: %s\n", file->name, "File shrank, its records are aggregated already!");
+            file->read = end;
+            continue;
+        }
+        if (end == file->read)
+            continue;
+
+        char *name = strdup(file->name);
+        if (name == NULL || addInputFile(list, name, &st) != 0)
+        {
+            printError("Unable to allocate file list!");
+            free(name);
+            return 1;
+        }
+        if (!compressed)
+        {
+            list->files[list->count - 1].offset = file->read;
+            list->files[list->count - 1].length = end - file->read;
+        }
+
+        /* The offset moves only once the records are aggregated */
+        file->pending = end;
+        file->compressed = compressed;
+        watch->pending[watch->npending++] = watch->dirty[i];
+    }
+    watch->ndirty = 0;
+
+    return 0;
+}
+
+void finishWatchPass(struct t_watch *watch, int failed)
+{
+    size_t i;
+    for (i = 0; i < watch->npending; i++)
+    {
+        struct t_watchedFile *file = &(watch->files[watch->pending[i]]);
+        if (!failed)
+            file->read = file->pending;
+
+        /* Records of a failed pass are read again, a compressed file once it changes, it may be incomplete yet */
+        else if (!file->compressed && !file->dirty)
+        {
+            file->dirty = 1;
+            watch->dirty[watch->ndirty++] = watch->pending[i];
+        }
+    }
+    watch->npending = 0;
+}
+
+/* Milliseconds remaining to given time */
+static long getRemainingTime(const struct timespec *deadline)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+}
+
+int watchReports(char *directory, struct t_report *reports, int nscanned, int nreports, int sortkey, uint32_t topN,
+    int threads, char presize, char *cache, const struct t_filter *filter, int interval)
+{
+    struct t_watch watch;
+    if (initWatch(&watch, directory) != 0)
+    {
+        finishWatch(&watch);
+        return 1;
+    }
+
+    /* The watch runs until it is interrupted or terminated */
+    struct sigaction action;
+    memset(&action, 0, sizeof (action));
+    action.sa_handler = handleStop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    int result = 0;
+    char first = 1;
+    int r;
+    while (!stopWatch)
+    {
+        /* Events are collected until the time of the next pass */
+        long remaining;
+        while (!stopWatch && (remaining = getRemainingTime(&deadline)) > 0)
+        {
+            if (readWatchEvents(&watch, remaining) != 0)
+            {
+                result = 1;
+                break;
+            }
+        }
+        if (result == 0 && !stopWatch && readWatchEvents(&watch, 0) != 0)
+            result = 1;
+        if (result != 0 || stopWatch)
+            break;
+        deadline.tv_sec += interval;
+
+        struct t_fileList files;
+        initFileList(&files);
+        if (collectWatchChanges(&watch, &files) != 0)
+        {
+            finishFileList(&files);
+            result = 1;
+            break;
+        }
+
+        if (first)
+        {
+            /* The first pass reads the whole tree right into the tables of the reports */
+            if (aggregateFiles(&files, reports, nscanned, threads, presize, cache, filter) != 0)
+            {
+                finishFileList(&files);
+                finishWatch(&watch);
+                return 1;
+            }
+            finishWatchPass(&watch, 0);
+            first = 0;
+        }
+        else if (files.count > 0)
+        {
+            /* New records are aggregated apart and added to the tables kept */
+            struct t_report fresh[EN_MAX_REPORTS];
+            memcpy(fresh, reports, nscanned * sizeof (struct t_report));
+            int failed = aggregateFiles(&files, fresh, nscanned, threads, 0, NULL, filter);
+            finishWatchPass(&watch, failed);
+            if (failed == 0)
+            {
+                for (r = 0; r < nscanned; r++)
+                {
+                    addAggregation(&(reports[r].aggregation), &(fresh[r].aggregation));
+                    settleAggregation(&(reports[r].aggregation));
+                    finishAggregation(&(fresh[r].aggregation));
+                }
+            }
+            else
+                printError("Aggregation of new records failed, they are read again later!");
+        }
+        finishFileList(&files);
+
+        /* Snapshot of all reports, coarser masks of rollups are derived again */
+        double start = getStatsTime();
+        for (r = nscanned; r < nreports; r++)
+        {
+            struct t_report *source = &reports[reports[r].rollup];
+            if (rollupAggregation(&(reports[r].aggregation), &(source->aggregation), reports[r].aggkey, reports[r].mask) != 0)
+                result = 1;
+        }
+        addPhaseTime(EN_PHASE_ROLLUP, start);
+        for (r = 0; r < nreports && result == 0; r++)
+        {
+            if (writeReport(&reports[r], sortkey, topN, threads) != 0)
+                result = 1;
+        }
+        for (r = nscanned; r < nreports; r++)
+        {
+            finishAggregation(&(reports[r].aggregation));
+        }
+        if (result != 0)
+            break;
+    }
+
+    if (!first)
+    {
+        for (r = 0; r < nscanned; r++)
+        {
+            finishAggregation(&(reports[r].aggregation));
+        }
+    }
+    finishWatch(&watch);
+    return result;
+}
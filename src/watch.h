@@ -0,0 +1,77 @@
+/*
+ * File:    watch.h
+ * Author:  Martin Simon <martiinsiimon@gmail.com>
+ * License: See the LICENSE file
+ */
+
+#ifndef WATCH_H
+#define	WATCH_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "main.h"
+#include "reader.h"
+
+/*
+ * Continuous aggregation of a directory. The tables stay in memory, the
+ * directory tree is watched by inotify and only the records added since
+ * the last pass are read: new files and the growth of the old ones. Every
+ * interval the records added meanwhile are aggregated and the reports are
+ * written again.
+ */
+
+/* Initial number of slots of the file index */
+#define EN_WATCH_INDEX 1024
+
+/* Size of the buffer of inotify events */
+#define EN_WATCH_EVENTS 65536
+
+/* Watched directory */
+struct t_watchedDir
+{
+    int wd;
+    char *name;
+};
+
+/* File known to the watch */
+struct t_watchedFile
+{
+    char *name;
+    off_t read; //records before this offset are aggregated already
+    off_t pending; //records before this offset are read by the pass in progress
+    char dirty; //changed since the last pass
+    char compressed; //read whole by the decompression tool
+};
+
+struct t_watch
+{
+    int fd; //inotify instance
+    char *directory; //root of the watched tree
+    struct t_watchedDir *dirs;
+    size_t ndirs;
+    size_t dirsSize;
+
+    /* Files, indexed by the hash of the name */
+    struct t_watchedFile *files;
+    size_t nfiles;
+    size_t filesSize;
+    uint32_t *index; //file number + 1, zero for an empty slot
+    uint32_t indexSize;
+
+    uint32_t *dirty; //numbers of changed files
+    size_t ndirty;
+    uint32_t *pending; //numbers of the files read by the pass in progress
+    size_t npending;
+    char rescan; //events were lost, the whole tree has to be walked
+};
+
+/* Prototypes */
+int initWatch(struct t_watch *watch, char *directory);
+void finishWatch(struct t_watch *watch);
+int readWatchEvents(struct t_watch *watch, int timeout);
+int collectWatchChanges(struct t_watch *watch, struct t_fileList *list);
+void finishWatchPass(struct t_watch *watch, int failed);
+int watchReports(char *directory, struct t_report *reports, int nscanned, int nreports, int sortkey, uint32_t topN,
+    int threads, char presize, char *cache, const struct t_filter *filter, int interval);
+
+#endif /* WATCH_H */